@@ -0,0 +1,129 @@
+/*
+ * Memory the log phase takes from the request pool, with nginx built with
+ * the module and no access log. The pool is walked before and after the
+ * handlers: the bytes taken from its blocks, the blocks added and the
+ * large allocations, which nginx makes with malloc. Prints the averages
+ * per request. Lua values are not covered, there is no lua in the bench.
+ */
+
+#include <stdio.h>
+#include <sys/wait.h>
+
+#include "harness.h"
+
+#define REQUESTS 100000
+
+typedef struct {
+    const char *name;
+    const char *location;
+} bench_config_t;
+
+static const bench_config_t bench_configs[] = {
+    { "no datas",
+      "" },
+    { "params",
+      "graphite_data bench.location params=rps|request_time|request_time:buckets=10,50,100|request_time/50|request_time/99|bytes_sent|response_xxx_rps;" },
+    { "params, if=",
+      "graphite_data bench.location params=rps|request_time|request_time/99;"
+      "graphite_data bench.errors params=rps|request_time|request_time/99 if=$bench_error;" },
+    { "params, topk and unique",
+      "graphite_data bench.location params=rps|request_time|rps:unique=$status|request_time:topk=$status,5;" },
+};
+
+static const char bench_conf[] =
+    "daemon off;\n"
+    "master_process off;\n"
+    "error_log stderr error;\n"
+    "events {}\n"
+    "http {\n"
+    "    access_log off;\n"
+    "    graphite_config prefix=bench server=127.0.0.1 intervals=1m;\n"
+    "    map $status $bench_error { default 0; 500 1; }\n"
+    "    server {\n"
+    "        listen unix:bench.sock;\n"
+    "        location / {\n"
+    "            %s\n"
+    "        }\n"
+    "    }\n"
+    "}\n";
+
+typedef struct {
+    size_t bytes;
+    ngx_uint_t blocks;
+    ngx_uint_t large;
+} bench_usage_t;
+
+static bench_usage_t
+bench_usage(ngx_pool_t *pool) {
+
+    bench_usage_t usage = { 0, 0, 0 };
+
+    ngx_pool_t *p;
+    for (p = pool; p; p = p->d.next) {
+        usage.bytes += p->d.last - (u_char*)p;
+        usage.blocks++;
+    }
+
+    ngx_pool_large_t *l;
+    for (l = pool->large; l; l = l->next) {
+        if (l->alloc)
+            usage.large++;
+    }
+
+    return usage;
+}
+
+static void
+bench_run(char **argv, const bench_config_t *config) {
+
+    static char conf[4096];
+    snprintf(conf, sizeof(conf), bench_conf, config->location);
+
+    bench_init(argv, conf);
+
+    bench_usage_t total = { 0, 0, 0 };
+
+    ngx_uint_t i;
+    for (i = 0; i < REQUESTS; i++) {
+        ngx_http_request_t *r = bench_request(i);
+
+        bench_usage_t before = bench_usage(r->pool);
+        bench_log(r);
+        bench_usage_t after = bench_usage(r->pool);
+
+        total.bytes += after.bytes - before.bytes;
+        total.blocks += after.blocks - before.blocks;
+        total.large += after.large - before.large;
+
+        bench_free(r);
+    }
+
+    printf("%-26s %10.1f %10.3f %10.3f\n", config->name, (double)total.bytes / REQUESTS, (double)total.blocks / REQUESTS, (double)total.large / REQUESTS);
+
+    bench_done();
+}
+
+int
+main(int argc, char **argv) {
+
+    printf("%-26s %10s %10s %10s\n", "config", "bytes", "blocks", "large");
+
+    size_t c;
+    for (c = 0; c < sizeof(bench_configs) / sizeof(bench_configs[0]); c++) {
+        fflush(stdout);
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            bench_run(argv, &bench_configs[c]);
+            return 0;
+        }
+
+        int status;
+        if (pid == -1 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "bench: %s failed\n", bench_configs[c].name);
+            return 1;
+        }
+    }
+
+    return 0;
+}
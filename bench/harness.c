@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "harness.h"
+
+extern char **environ;
+
+static char bench_prefix[] = "/tmp/graphite-bench.XXXXXX";
+
+static ngx_connection_t *bench_connection;
+static void **bench_loc_conf;
+
+/* statuses of the made up requests, mostly successful */
+static const ngx_uint_t bench_statuses[] = { 200, 200, 200, 200, 304, 404, 500, 200 };
+
+#define NSTATUSES (sizeof(bench_statuses) / sizeof(bench_statuses[0]))
+
+static void
+bench_fail(const char *what) {
+
+    fprintf(stderr, "bench: %s failed\n", what);
+    exit(1);
+}
+
+static void
+bench_write_conf(const char *conf) {
+
+    if (mkdtemp(bench_prefix) == NULL || chdir(bench_prefix) != 0)
+        bench_fail("prefix");
+
+    /* the lock file and the default error log are opened in logs */
+    if (mkdir("logs", 0700) != 0)
+        bench_fail("logs");
+
+    FILE *file = fopen("nginx.conf", "w");
+    if (file == NULL || fputs(conf, file) == EOF || fclose(file) != 0)
+        bench_fail("nginx.conf");
+}
+
+/* what main of nginx does before and after ngx_init_cycle for a single process */
+static ngx_cycle_t *
+bench_start(char **argv) {
+
+    static ngx_cycle_t init_cycle;
+    static u_char prefix[NGX_MAX_PATH];
+    static u_char conf_file[NGX_MAX_PATH];
+
+    ngx_debug_init();
+
+    if (ngx_strerror_init() != NGX_OK)
+        bench_fail("ngx_strerror_init");
+
+    ngx_time_init();
+
+    ngx_pid = ngx_getpid();
+
+    u_char *last = ngx_snprintf(prefix, sizeof(prefix) - 1, "%s/", bench_prefix);
+    *last = '\0';
+
+#if (nginx_version >= 1019005)
+    ngx_log_t *log = ngx_log_init(prefix, NULL);
+#else
+    ngx_log_t *log = ngx_log_init(prefix);
+#endif
+    if (log == NULL)
+        bench_fail("ngx_log_init");
+
+#if (NGX_OPENSSL)
+    ngx_ssl_init(log);
+#endif
+
+    init_cycle.log = log;
+    ngx_cycle = &init_cycle;
+
+    init_cycle.pool = ngx_create_pool(1024, log);
+    if (init_cycle.pool == NULL)
+        bench_fail("ngx_create_pool");
+
+    ngx_argc = 1;
+    ngx_argv = argv;
+    ngx_os_argv = argv;
+    ngx_os_environ = environ;
+
+    init_cycle.prefix.data = prefix;
+    init_cycle.prefix.len = last - prefix;
+    init_cycle.conf_prefix = init_cycle.prefix;
+
+    last = ngx_snprintf(conf_file, sizeof(conf_file) - 1, "%snginx.conf", prefix);
+    *last = '\0';
+
+    init_cycle.conf_file.data = conf_file;
+    init_cycle.conf_file.len = last - conf_file;
+    ngx_str_set(&init_cycle.conf_param, "");
+
+    if (ngx_os_init(log) != NGX_OK)
+        bench_fail("ngx_os_init");
+
+    if (ngx_crc32_table_init() != NGX_OK)
+        bench_fail("ngx_crc32_table_init");
+
+#if (nginx_version >= 1013000)
+    ngx_slab_sizes_init();
+#endif
+
+    if (ngx_preinit_modules() != NGX_OK)
+        bench_fail("ngx_preinit_modules");
+
+    ngx_cycle_t *cycle = ngx_init_cycle(&init_cycle);
+    if (cycle == NULL)
+        bench_fail("ngx_init_cycle");
+
+    ngx_cycle = cycle;
+    ngx_process = NGX_PROCESS_SINGLE;
+
+    ngx_uint_t i;
+    for (i = 0; cycle->modules[i]; i++) {
+        if (cycle->modules[i]->init_process && cycle->modules[i]->init_process(cycle) == NGX_ERROR)
+            bench_fail("init_process");
+    }
+
+    return cycle;
+}
+
+/* a connection like the one ngx_http_init_connection makes for the first server */
+static ngx_connection_t *
+bench_connect(ngx_cycle_t *cycle) {
+
+    ngx_http_core_main_conf_t *cmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_core_module);
+    ngx_http_core_srv_conf_t *cscf = ((ngx_http_core_srv_conf_t**)cmcf->servers.elts)[0];
+
+    ngx_connection_t *c = ngx_pcalloc(cycle->pool, sizeof(ngx_connection_t));
+    ngx_http_connection_t *hc = ngx_pcalloc(cycle->pool, sizeof(ngx_http_connection_t));
+    ngx_http_log_ctx_t *ctx = ngx_pcalloc(cycle->pool, sizeof(ngx_http_log_ctx_t));
+    ngx_log_t *log = ngx_palloc(cycle->pool, sizeof(ngx_log_t));
+    if (c == NULL || hc == NULL || ctx == NULL || log == NULL)
+        bench_fail("connection");
+
+    *log = *cycle->log;
+    log->handler = NULL;
+    log->data = ctx;
+    ctx->connection = c;
+
+    hc->conf_ctx = cscf->ctx;
+
+    c->data = hc;
+    c->log = log;
+    c->pool = cycle->pool;
+    c->fd = (ngx_socket_t)-1;
+
+    /* the first location of the tree, the only one in bench configs */
+    ngx_http_core_loc_conf_t *clcf = cscf->ctx->loc_conf[ngx_http_core_module.ctx_index];
+    ngx_http_location_tree_node_t *node = clcf->static_locations;
+    if (node == NULL)
+        bench_fail("location");
+
+    clcf = node->exact ? node->exact : node->inclusive;
+    bench_loc_conf = clcf->loc_conf;
+
+    return c;
+}
+
+ngx_cycle_t *
+bench_init(char **argv, const char *conf) {
+
+    bench_write_conf(conf);
+
+    ngx_cycle_t *cycle = bench_start(argv);
+
+    bench_connection = bench_connect(cycle);
+
+    return cycle;
+}
+
+void
+bench_done(void) {
+
+    char command[sizeof(bench_prefix) + 16];
+    snprintf(command, sizeof(command), "rm -rf %s", bench_prefix);
+
+    if (system(command) != 0)
+        fprintf(stderr, "bench: can't remove %s\n", bench_prefix);
+}
+
+/* the n-th request differs from its neighbours in status, time and sizes */
+ngx_http_request_t *
+bench_request(ngx_uint_t n) {
+
+    ngx_connection_t *c = bench_connection;
+
+    /* keepalive connections serve four requests */
+    c->requests = n % 4 + 1;
+    c->sent = 200 + (n * 37) % 20000;
+    c->destroyed = 0;
+
+    ngx_http_request_t *r = ngx_http_alloc_request(c);
+    if (r == NULL)
+        bench_fail("ngx_http_alloc_request");
+
+    r->loc_conf = bench_loc_conf;
+
+    /* requests take up to 300 ms */
+    ngx_time_t *tp = ngx_timeofday();
+    ngx_msec_t start = (ngx_msec_t)tp->sec * 1000 + tp->msec - (n * 7) % 300;
+    r->start_sec = start / 1000;
+    r->start_msec = start % 1000;
+
+    r->headers_out.status = bench_statuses[n % NSTATUSES];
+    r->header_size = 200;
+    r->request_length = 100 + n % 500;
+
+    return r;
+}
+
+/* what ngx_http_log_request does at the end of the request */
+void
+bench_log(ngx_http_request_t *r) {
+
+    ngx_http_core_main_conf_t *cmcf = ngx_http_get_module_main_conf(r, ngx_http_core_module);
+
+    ngx_http_handler_pt *handlers = cmcf->phases[NGX_HTTP_LOG_PHASE].handlers.elts;
+    ngx_uint_t n = cmcf->phases[NGX_HTTP_LOG_PHASE].handlers.nelts;
+
+    ngx_uint_t i;
+    for (i = 0; i < n; i++)
+        handlers[i](r);
+
+    r->logged = 1;
+}
+
+void
+bench_free(ngx_http_request_t *r) {
+
+    ngx_http_free_request(r, 0);
+}
+
+uint64_t
+bench_nsec(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
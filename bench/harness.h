@@ -0,0 +1,24 @@
+#ifndef _BENCH_HARNESS_H_INCLUDED_
+#define _BENCH_HARNESS_H_INCLUDED_
+
+#include <nginx.h>
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+/*
+ * Runs the log phase of nginx built with the module on requests made up
+ * in memory, without a network or a worker loop. bench_init starts nginx
+ * as a single process with the config text in a temporary prefix, the
+ * requests are served by the first location of the first server.
+ */
+ngx_cycle_t *bench_init(char **argv, const char *conf);
+void bench_done(void);
+
+ngx_http_request_t *bench_request(ngx_uint_t n);
+void bench_log(ngx_http_request_t *r);
+void bench_free(ngx_http_request_t *r);
+
+uint64_t bench_nsec(void);
+
+#endif
@@ -0,0 +1,127 @@
+/*
+ * Accuracy of the percentile estimators on bimodal distributions, like
+ * latencies of cache hits and misses. Every flush of n values is estimated
+ * by extended P2 and by the reservoir, and compared with the exact
+ * percentiles of the flush. Prints the mean rank error of each, the share
+ * of the values between the estimate and the exact percentile, in percent.
+ * Unlike the relative error it is not blown up when the percentile falls
+ * into the gap between the modes.
+ */
+
+#include <nginx.h>
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include <math.h>
+#include <stdio.h>
+
+#include "ngx_http_graphite_statistic.h"
+
+#define RUNS 100
+
+typedef struct {
+    const char *name;
+    double share;
+    double mean1, dev1;
+    double mean2, dev2;
+} bench_distribution_t;
+
+static const bench_distribution_t bench_distributions[] = {
+    { "hits 90%, misses 10%", 0.9, 5, 1, 200, 30 },
+    { "hits 50%, misses 50%", 0.5, 5, 1, 200, 30 },
+    { "hits 99%, misses 1%", 0.99, 5, 1, 200, 30 },
+};
+
+static const ngx_uint_t bench_sizes[] = { 100, 1000, 10000, 100000 };
+
+/* in thousandths of a percent, as in the config */
+static const ngx_uint_t bench_percentiles[] = { 50000, 90000, 99000 };
+
+#define NPERCENTILES (sizeof(bench_percentiles) / sizeof(bench_percentiles[0]))
+
+static double
+bench_normal(double mean, double dev) {
+
+    double u = (random() + 1.0) / ((double)RAND_MAX + 2.0);
+    double v = (random() + 1.0) / ((double)RAND_MAX + 2.0);
+
+    return fabs(mean + dev * sqrt(-2 * log(u)) * cos(2 * M_PI * v));
+}
+
+/* the share of the sorted values below value */
+static double
+bench_rank(const double *values, ngx_uint_t n, double value) {
+
+    ngx_uint_t lo = 0, hi = n;
+    while (lo < hi) {
+        ngx_uint_t mid = (lo + hi) / 2;
+        if (values[mid] < value)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return (double)lo / n;
+}
+
+static int
+bench_compare(const void *one, const void *two) {
+
+    double a = *(const double*)one;
+    double b = *(const double*)two;
+
+    return (a < b) ? -1 : (a > b);
+}
+
+int
+main(void) {
+
+    static double values[100000];
+    static double samples[RESERVOIR_SIZE];
+
+    srandom(1);
+
+    printf("%-22s %7s %5s %12s %12s\n", "distribution", "n", "p", "p2 error", "reservoir");
+
+    size_t d, z, k;
+    for (d = 0; d < sizeof(bench_distributions) / sizeof(bench_distributions[0]); d++) {
+        const bench_distribution_t *dist = &bench_distributions[d];
+
+        for (z = 0; z < sizeof(bench_sizes) / sizeof(bench_sizes[0]); z++) {
+            ngx_uint_t n = bench_sizes[z];
+            double p2_error[NPERCENTILES] = { 0 };
+            double reservoir_error[NPERCENTILES] = { 0 };
+
+            int run;
+            for (run = 0; run < RUNS; run++) {
+                ngx_http_graphite_statistic_data_t p2, reservoir;
+                ngx_http_graphite_statistic_init(&p2, bench_percentiles, NPERCENTILES);
+                ngx_http_graphite_statistic_init(&reservoir, bench_percentiles, NPERCENTILES);
+                reservoir.samples = samples;
+
+                ngx_uint_t i;
+                for (i = 0; i < n; i++) {
+                    double value = (random() < dist->share * RAND_MAX) ? bench_normal(dist->mean1, dist->dev1) : bench_normal(dist->mean2, dist->dev2);
+                    values[i] = value;
+                    ngx_http_graphite_add_statistic_data(&p2, value);
+                    ngx_http_graphite_add_statistic_data(&reservoir, value);
+                }
+
+                qsort(values, n, sizeof(double), bench_compare);
+                ngx_http_graphite_statistic_sort(&reservoir);
+
+                for (k = 0; k < NPERCENTILES; k++) {
+                    double exact = bench_rank(values, n, values[(n - 1) * bench_percentiles[k] / 100000]);
+                    p2_error[k] += fabs(bench_rank(values, n, ngx_http_graphite_statistic_value(&p2, 2 * k + 2, bench_percentiles[k])) - exact);
+                    reservoir_error[k] += fabs(bench_rank(values, n, ngx_http_graphite_statistic_value(&reservoir, 2 * k + 2, bench_percentiles[k])) - exact);
+                }
+            }
+
+            for (k = 0; k < NPERCENTILES; k++)
+                printf("%-22s %7lu %5lu %11.2f%% %11.2f%%\n", dist->name, (unsigned long)n, (unsigned long)(bench_percentiles[k] / 1000), p2_error[k] * 100 / RUNS, reservoir_error[k] * 100 / RUNS);
+        }
+    }
+
+    return 0;
+}
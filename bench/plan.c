@@ -0,0 +1,127 @@
+/*
+ * Log phase time of a location collecting 24 params, the case the plans
+ * of locations are made for. Every config is run by nginx of its own in a
+ * child process, the requests differ in status, time and sizes and every
+ * eighth one is a 500 counted by the filtered datas. Prints nanoseconds
+ * per request. To compare versions of the module, build nginx with each
+ * of them and run the benchmark against both.
+ */
+
+#include <stdio.h>
+#include <sys/wait.h>
+
+#include "harness.h"
+
+#define REQUESTS 1000000
+#define WARMUP 10000
+
+/* the time is updated every this many requests, so seconds go by */
+#define TIME_UPDATE 1024
+
+#define COUNTERS "rps|keepalive_rps|response_2xx_rps|response_3xx_rps|response_4xx_rps|response_5xx_rps|response_xxx_rps|bytes_sent|body_bytes_sent|request_length"
+#define TIMES "request_time|request_time:max|request_time:buckets=10,50,100,250|upstream_time|upstream_connect_time|upstream_header_time"
+#define UPSTREAMS "upstream_response_2xx_rps|upstream_response_4xx_rps|upstream_response_5xx_rps|request_length:max"
+#define PERCENTILES "request_time/50|request_time/90|request_time/99|upstream_time/99"
+
+typedef struct {
+    const char *name;
+    const char *http;
+    const char *server;
+    const char *location;
+} bench_config_t;
+
+static const bench_config_t bench_configs[] = {
+    { "one data",
+      "",
+      "",
+      "graphite_data bench.location params=" COUNTERS "|" TIMES "|" UPSTREAMS "|" PERCENTILES ";" },
+    { "http, server, location",
+      "graphite_data bench.http params=" COUNTERS ";",
+      "graphite_data bench.server params=" TIMES ";",
+      "graphite_data bench.location params=" UPSTREAMS "|" PERCENTILES ";" },
+    { "two filtered datas",
+      "",
+      "",
+      "graphite_data bench.location params=" COUNTERS "|" TIMES ";"
+      "graphite_data bench.errors params=" UPSTREAMS "|" PERCENTILES " if=$bench_error;"
+      "graphite_data bench.slow params=" UPSTREAMS "|" PERCENTILES " if=$bench_slow;" },
+    { "sample=1/10",
+      "",
+      "",
+      "graphite_data bench.location params=" COUNTERS "|" TIMES "|" UPSTREAMS "|" PERCENTILES " sample=1/10;" },
+};
+
+static const char bench_conf[] =
+    "daemon off;\n"
+    "master_process off;\n"
+    "error_log stderr error;\n"
+    "events {}\n"
+    "http {\n"
+    "    access_log off;\n"
+    "    graphite_config prefix=bench server=127.0.0.1 intervals=1m|5m shared=16m;\n"
+    "    map $status $bench_error { default 0; 500 1; }\n"
+    "    map $status $bench_slow { default 0; 404 1; 500 1; }\n"
+    "    %s\n"
+    "    server {\n"
+    "        listen unix:bench.sock;\n"
+    "        %s\n"
+    "        location / {\n"
+    "            %s\n"
+    "        }\n"
+    "    }\n"
+    "}\n";
+
+static void
+bench_run(char **argv, const bench_config_t *config) {
+
+    static char conf[8192];
+    snprintf(conf, sizeof(conf), bench_conf, config->http, config->server, config->location);
+
+    bench_init(argv, conf);
+
+    uint64_t time = 0;
+
+    ngx_uint_t i;
+    for (i = 0; i < WARMUP + REQUESTS; i++) {
+        if (i % TIME_UPDATE == 0)
+            ngx_time_update();
+
+        ngx_http_request_t *r = bench_request(i);
+
+        uint64_t start = bench_nsec();
+        bench_log(r);
+        if (i >= WARMUP)
+            time += bench_nsec() - start;
+
+        bench_free(r);
+    }
+
+    printf("%-24s %10.1f\n", config->name, (double)time / REQUESTS);
+
+    bench_done();
+}
+
+int
+main(int argc, char **argv) {
+
+    printf("%-24s %10s\n", "config", "ns/request");
+
+    size_t c;
+    for (c = 0; c < sizeof(bench_configs) / sizeof(bench_configs[0]); c++) {
+        fflush(stdout);
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            bench_run(argv, &bench_configs[c]);
+            return 0;
+        }
+
+        int status;
+        if (pid == -1 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "bench: %s failed\n", bench_configs[c].name);
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -31,7 +31,7 @@ void ngx_http_graphite_allocator_slab_free(void *pool, void *p) {
 void *ngx_http_graphite_allocator_alloc(ngx_http_graphite_allocator_t *allocator, size_t size) {
     void *p = allocator->alloc(allocator->pool, size);
     if (p == NULL)
-        allocator->nomemory = 1;
+        allocator->nomemory++;
     return p;
 }
 
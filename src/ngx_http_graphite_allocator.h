@@ -10,7 +10,7 @@ typedef struct ngx_http_graphite_allocator_s {
     void *pool;
     void *(*alloc)(void *pool, size_t size);
     void (*free)(void *pool, void *p);
-    ngx_int_t nomemory;
+    ngx_uint_t nomemory;
 } ngx_http_graphite_allocator_t;
 
 void ngx_http_graphite_allocator_init(ngx_http_graphite_allocator_t *allocator, void *pool, void* (*alloc)(void *, size_t), void (*free)(void *, void *));
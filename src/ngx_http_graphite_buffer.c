@@ -0,0 +1,93 @@
+#include <nginx.h>
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "ngx_http_graphite_buffer.h"
+
+ngx_int_t
+ngx_http_graphite_buffer_init(ngx_http_graphite_buffer_t *buffer, ngx_pool_t *pool, size_t size) {
+
+    buffer->pool = pool;
+    buffer->size = size;
+    buffer->out = NULL;
+    buffer->last = NULL;
+    buffer->busy = NULL;
+    buffer->free = NULL;
+    buffer->nomemory = 0;
+
+    buffer->record = ngx_palloc(pool, size);
+    if (buffer->record == NULL)
+        return NGX_ERROR;
+
+    return NGX_OK;
+}
+
+void
+ngx_http_graphite_buffer_reset(ngx_http_graphite_buffer_t *buffer) {
+
+    if (buffer->last) {
+        buffer->last->next = buffer->free;
+        buffer->free = buffer->out;
+    }
+
+    buffer->out = NULL;
+    buffer->last = NULL;
+    buffer->busy = NULL;
+    buffer->nomemory = 0;
+}
+
+static ngx_chain_t *
+ngx_http_graphite_buffer_block(ngx_http_graphite_buffer_t *buffer) {
+
+    ngx_chain_t *cl = buffer->free;
+
+    if (cl) {
+        buffer->free = cl->next;
+    }
+    else {
+        cl = ngx_alloc_chain_link(buffer->pool);
+        if (cl == NULL)
+            return NULL;
+
+        cl->buf = ngx_create_temp_buf(buffer->pool, buffer->size);
+        if (cl->buf == NULL)
+            return NULL;
+    }
+
+    cl->buf->pos = cl->buf->start;
+    cl->buf->last = cl->buf->start;
+    cl->next = NULL;
+
+    return cl;
+}
+
+ngx_int_t
+ngx_http_graphite_buffer_append(ngx_http_graphite_buffer_t *buffer, u_char *last) {
+
+    size_t len = last - buffer->record;
+
+    /* the record is truncated if it has filled the whole staging area */
+    if (len >= buffer->size)
+        return NGX_DECLINED;
+
+    ngx_chain_t *cl = buffer->last;
+
+    if (cl == NULL || (size_t)(cl->buf->end - cl->buf->last) < len) {
+
+        cl = ngx_http_graphite_buffer_block(buffer);
+        if (cl == NULL)
+            return NGX_ERROR;
+
+        if (buffer->last)
+            buffer->last->next = cl;
+        else
+            buffer->out = cl;
+
+        buffer->last = cl;
+    }
+
+    cl->buf->last = ngx_cpymem(cl->buf->last, buffer->record, len);
+
+    return NGX_OK;
+}
@@ -0,0 +1,24 @@
+#ifndef _NGX_HTTP_GRAPHITE_BUFFER_H_INCLUDED_
+#define _NGX_HTTP_GRAPHITE_BUFFER_H_INCLUDED_
+
+#include <nginx.h>
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+typedef struct ngx_http_graphite_buffer_s {
+    ngx_pool_t *pool;
+    size_t size;
+    u_char *record;
+    ngx_chain_t *out;
+    ngx_chain_t *last;
+    ngx_chain_t *busy;
+    ngx_chain_t *free;
+    ngx_uint_t nomemory;
+} ngx_http_graphite_buffer_t;
+
+ngx_int_t ngx_http_graphite_buffer_init(ngx_http_graphite_buffer_t *buffer, ngx_pool_t *pool, size_t size);
+void ngx_http_graphite_buffer_reset(ngx_http_graphite_buffer_t *buffer);
+ngx_int_t ngx_http_graphite_buffer_append(ngx_http_graphite_buffer_t *buffer, u_char *last);
+
+#endif
@@ -0,0 +1,161 @@
+#include <nginx.h>
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "ngx_http_graphite_hash.h"
+
+static ngx_http_graphite_hash_table_t *
+ngx_http_graphite_hash_alloc(ngx_http_graphite_allocator_t *allocator, ngx_uint_t nalloc) {
+
+    size_t size = sizeof(ngx_http_graphite_hash_table_t) + nalloc * sizeof(ngx_http_graphite_hash_elt_t);
+
+    ngx_http_graphite_hash_table_t *table = ngx_http_graphite_allocator_alloc(allocator, size);
+    if (table == NULL)
+        return NULL;
+
+    ngx_memzero(table, size);
+    table->nalloc = nalloc;
+
+    return table;
+}
+
+static void
+ngx_http_graphite_hash_insert(ngx_http_graphite_hash_table_t *table, ngx_uint_t key, const ngx_str_t *name, void *value) {
+
+    ngx_http_graphite_hash_elt_t *elts = table->elts;
+    ngx_uint_t mask = table->nalloc - 1;
+
+    ngx_uint_t i = key & mask;
+    while (elts[i].value != NULL)
+        i = (i + 1) & mask;
+
+    elts[i].key = key;
+    elts[i].name = *name;
+    ngx_memory_barrier();
+    elts[i].value = value;
+}
+
+ngx_http_graphite_hash_t *
+ngx_http_graphite_hash_create(ngx_http_graphite_allocator_t *allocator, ngx_uint_t n) {
+
+    ngx_http_graphite_hash_t *hash = ngx_http_graphite_allocator_alloc(allocator, sizeof(ngx_http_graphite_hash_t));
+    if (hash == NULL)
+        return NULL;
+
+    ngx_uint_t nalloc = 8;
+    while (nalloc < n * 2)
+        nalloc *= 2;
+
+    hash->table = ngx_http_graphite_hash_alloc(allocator, nalloc);
+    if (hash->table == NULL) {
+        ngx_http_graphite_allocator_free(allocator, hash);
+        return NULL;
+    }
+
+    hash->nelts = 0;
+    hash->version = 0;
+    hash->allocator = allocator;
+
+    return hash;
+}
+
+void *
+ngx_http_graphite_hash_find(const ngx_http_graphite_hash_t *hash, const ngx_str_t *name) {
+
+    ngx_uint_t key = ngx_hash_key(name->data, name->len);
+    ngx_atomic_uint_t version;
+    void *value = NULL;
+
+    do {
+        version = hash->version;
+        if (version & 1) {
+            ngx_cpu_pause();
+            continue;
+        }
+
+        ngx_memory_barrier();
+
+        /* the table is loaded once, its size and elements come together */
+        const ngx_http_graphite_hash_table_t *table = hash->table;
+        const ngx_http_graphite_hash_elt_t *elts = table->elts;
+        ngx_uint_t mask = table->nalloc - 1;
+        ngx_uint_t i = key & mask;
+
+        value = NULL;
+        while (elts[i].value != NULL) {
+            if (elts[i].key == key && elts[i].name.len == name->len && ngx_strncmp(elts[i].name.data, name->data, name->len) == 0) {
+                value = elts[i].value;
+                break;
+            }
+            i = (i + 1) & mask;
+        }
+
+        ngx_memory_barrier();
+
+    } while (version & 1 || hash->version != version);
+
+    return value;
+}
+
+ngx_int_t
+ngx_http_graphite_hash_add(ngx_http_graphite_hash_t *hash, const ngx_str_t *name, void *value) {
+
+    ngx_uint_t key = ngx_hash_key(name->data, name->len);
+
+    ngx_http_graphite_hash_table_t *old = hash->table;
+
+    /* keep the load factor under 3/4 */
+    if ((hash->nelts + 1) * 4 > old->nalloc * 3) {
+
+        ngx_http_graphite_hash_table_t *table = ngx_http_graphite_hash_alloc(hash->allocator, old->nalloc * 2);
+        if (table == NULL)
+            return NGX_ERROR;
+
+        ngx_uint_t i;
+        for (i = 0; i < old->nalloc; i++) {
+            if (old->elts[i].value != NULL)
+                ngx_http_graphite_hash_insert(table, old->elts[i].key, &old->elts[i].name, old->elts[i].value);
+        }
+
+        /* the new table is complete before it is published */
+        ngx_memory_barrier();
+
+        hash->version++;
+        ngx_memory_barrier();
+
+        hash->table = table;
+
+        ngx_memory_barrier();
+        hash->version++;
+    }
+
+    hash->version++;
+    ngx_memory_barrier();
+
+    ngx_http_graphite_hash_insert(hash->table, key, name, value);
+    hash->nelts++;
+
+    ngx_memory_barrier();
+    hash->version++;
+
+    return NGX_OK;
+}
+
+ngx_http_graphite_hash_t *
+ngx_http_graphite_hash_copy(ngx_http_graphite_allocator_t *allocator, const ngx_http_graphite_hash_t *hash) {
+
+    ngx_http_graphite_hash_t *copy = ngx_http_graphite_hash_create(allocator, hash->nelts);
+    if (copy == NULL)
+        return NULL;
+
+    const ngx_http_graphite_hash_table_t *table = hash->table;
+
+    ngx_uint_t i;
+    for (i = 0; i < table->nalloc; i++) {
+        if (table->elts[i].value != NULL && ngx_http_graphite_hash_add(copy, &table->elts[i].name, table->elts[i].value) != NGX_OK)
+            return NULL;
+    }
+
+    return copy;
+}
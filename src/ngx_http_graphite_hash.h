@@ -0,0 +1,44 @@
+#ifndef _NGX_HTTP_GRAPHITE_HASH_H_INCLUDED_
+#define _NGX_HTTP_GRAPHITE_HASH_H_INCLUDED_
+
+#include <nginx.h>
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "ngx_http_graphite_allocator.h"
+
+typedef struct {
+    ngx_uint_t key;
+    ngx_str_t name;
+    void *value;
+} ngx_http_graphite_hash_elt_t;
+
+/*
+ * The size of a table lives in the block of its elements, so a reader that
+ * loads the table pointer once always probes within that table.
+ */
+typedef struct ngx_http_graphite_hash_table_s {
+    ngx_uint_t nalloc;
+    ngx_http_graphite_hash_elt_t elts[];
+} ngx_http_graphite_hash_table_t;
+
+/*
+ * Open addressing hash table of named values. Writers must be serialized by
+ * the caller, readers don't take any lock: the table version is odd while a
+ * writer changes the table and readers retry if it has changed under them.
+ * Old tables are not freed on growth, so a reader never touches freed memory.
+ */
+typedef struct ngx_http_graphite_hash_s {
+    ngx_http_graphite_hash_table_t *volatile table;
+    ngx_uint_t nelts;
+    ngx_atomic_t version;
+    ngx_http_graphite_allocator_t *allocator;
+} ngx_http_graphite_hash_t;
+
+ngx_http_graphite_hash_t *ngx_http_graphite_hash_create(ngx_http_graphite_allocator_t *allocator, ngx_uint_t n);
+void *ngx_http_graphite_hash_find(const ngx_http_graphite_hash_t *hash, const ngx_str_t *name);
+ngx_int_t ngx_http_graphite_hash_add(ngx_http_graphite_hash_t *hash, const ngx_str_t *name, void *value);
+ngx_http_graphite_hash_t *ngx_http_graphite_hash_copy(ngx_http_graphite_allocator_t *allocator, const ngx_http_graphite_hash_t *hash);
+
+#endif
@@ -3,9 +3,12 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+#include <math.h>
+
 #include "ngx_http_graphite_module.h"
 #include "ngx_http_graphite_net.h"
-#include "ngx_http_graphite_bsearch.h"
+#include "ngx_http_graphite_reduce.h"
+#include "ngx_http_graphite_statistic.h"
 
 typedef struct {
     ngx_array_t *default_data_template;
@@ -15,8 +18,11 @@ typedef struct {
     ngx_array_t *datas;
 } ngx_http_graphite_srv_conf_t;
 
+typedef struct ngx_http_graphite_plan_s ngx_http_graphite_plan_t;
+
 typedef struct {
     ngx_array_t *datas;
+    ngx_http_graphite_plan_t *plan;
 } ngx_http_graphite_loc_conf_t;
 
 #define PHASE_CONFIG 0
@@ -27,14 +33,50 @@ typedef struct {
 
 #define SOURCE_INTERNAL (ngx_uint_t)-1
 
+#define HANDLER_SAMPLE_RATE 64
+
+/* measured requests per budget check, and the most statistics are thinned, 1/2^max */
+#define BUDGET_SAMPLES 16
+#define DEGRADATION_MAX 6
+
+#define IDLE_SEND 0
+#define IDLE_SKIP 1
+#define IDLE_TRAIL 2
+
+#define PERCENTILE_P2 0
+#define PERCENTILE_RESERVOIR 1
+
+#define LOCK_SITE_HANDLER 0
+#define LOCK_SITE_GET 1
+#define LOCK_SITE_SET 2
+#define LOCK_SITE_PARAM 3
+#define LOCK_SITE_FLUSH 4
+
+static const ngx_str_t ngx_http_graphite_lock_sites[NGX_HTTP_GRAPHITE_LOCK_SITES] = {
+    ngx_string("handler"),
+    ngx_string("get"),
+    ngx_string("set"),
+    ngx_string("param"),
+    ngx_string("flush"),
+};
+
+static ngx_http_graphite_lock_stat_t ngx_http_graphite_worker_locks[NGX_HTTP_GRAPHITE_LOCK_SITES];
+
+static ngx_uint_t ngx_http_graphite_lock(ngx_slab_pool_t *shpool, ngx_uint_t site);
+static void ngx_http_graphite_unlock(ngx_slab_pool_t *shpool, ngx_uint_t site, ngx_uint_t locked);
+static ngx_uint_t ngx_http_graphite_wlock(ngx_http_graphite_storage_t *storage, ngx_uint_t site);
+static void ngx_http_graphite_wunlock(ngx_http_graphite_storage_t *storage, ngx_uint_t site, ngx_uint_t locked);
+
 static ngx_int_t ngx_http_graphite_add_variables(ngx_conf_t *cf);
 static ngx_int_t ngx_http_graphite_init(ngx_conf_t *cf);
 static ngx_int_t ngx_http_graphite_process_init(ngx_cycle_t *cycle);
 
 static void *ngx_http_graphite_create_main_conf(ngx_conf_t *cf);
+static char *ngx_http_graphite_init_main_conf(ngx_conf_t *cf, void *conf);
 static void *ngx_http_graphite_create_srv_conf(ngx_conf_t *cf);
 static void *ngx_http_graphite_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_graphite_merge_loc_conf(ngx_conf_t* cf, void* parent, void* child);
+static ngx_int_t ngx_http_graphite_plan_rollups(ngx_conf_t *cf, ngx_http_graphite_main_conf_t *gmcf);
 
 static ngx_str_t *ngx_http_graphite_location(ngx_pool_t *pool, const ngx_str_t *uri);
 static ngx_str_t *ngx_http_graphite_server_name(ngx_pool_t *pool, ngx_conf_t* cf);
@@ -47,9 +89,10 @@ static char *ngx_http_graphite_config(ngx_conf_t *cf, ngx_command_t *cmd, void *
 static char *ngx_http_graphite_default_data(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *ngx_http_graphite_data(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *ngx_http_graphite_param(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_graphite_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 
 static char *ngx_http_graphite_add_default_data(ngx_conf_t *cf, ngx_array_t *datas, const ngx_str_t *location, const ngx_str_t *server_name, const ngx_array_t *template, const ngx_array_t *params, const ngx_http_complex_value_t *filter);
-static char *ngx_http_graphite_add_data(ngx_conf_t *cf, ngx_array_t *datas, const ngx_str_t *split, const ngx_array_t *params, const ngx_http_complex_value_t *filter);
+static char *ngx_http_graphite_add_data(ngx_conf_t *cf, ngx_array_t *datas, const ngx_str_t *split, const ngx_array_t *params, const ngx_http_complex_value_t *filter, ngx_uint_t rollup, ngx_uint_t sample);
 
 typedef struct ngx_http_graphite_context_s {
     ngx_int_t phase;
@@ -57,6 +100,7 @@ typedef struct ngx_http_graphite_context_s {
     ngx_pool_t *pool;
     ngx_log_t *log;
     ngx_http_graphite_main_conf_t *gmcf;
+    ngx_conf_t *cf;
 } ngx_http_graphite_context_t;
 
 static char *ngx_http_graphite_config_arg_prefix(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value);
@@ -68,10 +112,16 @@ static char *ngx_http_graphite_config_arg_intervals(ngx_http_graphite_context_t
 static char *ngx_http_graphite_config_arg_params(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value);
 static char *ngx_http_graphite_config_arg_shared(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value);
 static char *ngx_http_graphite_config_arg_buffer(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value);
+static char *ngx_http_graphite_config_arg_self(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value);
+static char *ngx_http_graphite_config_arg_lock_profiling(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value);
 static char *ngx_http_graphite_config_arg_package(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value);
 static char *ngx_http_graphite_config_arg_template(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value);
 static char *ngx_http_graphite_config_arg_protocol(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value);
 static char *ngx_http_graphite_config_arg_timeout(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value);
+static char *ngx_http_graphite_config_arg_idle(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value);
+static char *ngx_http_graphite_config_arg_heartbeat(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value);
+static char *ngx_http_graphite_config_arg_percentile_mode(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value);
+static char *ngx_http_graphite_config_arg_budget(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value);
 #ifdef NGX_LOG_LIMIT_ENABLED
 static char *ngx_http_graphite_config_arg_error_log(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value);
 #endif
@@ -80,11 +130,14 @@ static char *ngx_http_graphite_param_arg_name(ngx_http_graphite_context_t *conte
 static char *ngx_http_graphite_param_arg_aggregate(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value);
 static char *ngx_http_graphite_param_arg_interval(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value);
 static char *ngx_http_graphite_param_arg_percentile(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value);
+static char *ngx_http_graphite_param_arg_sample(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value);
 
 static char *ngx_http_graphite_parse_params(ngx_http_graphite_context_t *context, const ngx_str_t *value, ngx_array_t *params);
 static char *ngx_http_graphite_parse_string(ngx_http_graphite_context_t *context, ngx_str_t *value, ngx_str_t *result);
 static char *ngx_http_graphite_parse_size(ngx_http_graphite_context_t *context, ngx_str_t *value, size_t *result);
 static char *ngx_http_graphite_parse_time(ngx_http_graphite_context_t *context, ngx_str_t *value, ngx_uint_t *result);
+static char *ngx_http_graphite_parse_flag(ngx_http_graphite_context_t *context, ngx_str_t *value, ngx_uint_t *result);
+static char *ngx_http_graphite_parse_sample(ngx_http_graphite_context_t *context, ngx_str_t *value, ngx_uint_t *result);
 
 static ngx_command_t ngx_http_graphite_commands[] = {
 
@@ -110,12 +163,19 @@ static ngx_command_t ngx_http_graphite_commands[] = {
       NULL },
 
     { ngx_string("graphite_data"),
-      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_HTTP_LIF_CONF | NGX_CONF_TAKE123,
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_HTTP_LIF_CONF | NGX_CONF_1MORE,
       ngx_http_graphite_data,
       0,
       0,
       NULL },
 
+    { ngx_string("graphite_status"),
+      NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+      ngx_http_graphite_status,
+      0,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
@@ -124,7 +184,7 @@ static ngx_http_module_t ngx_http_graphite_module_ctx = {
     ngx_http_graphite_init,                /* postconfiguration */
 
     ngx_http_graphite_create_main_conf,    /* create main configuration */
-    NULL,                                  /* init main configuration */
+    ngx_http_graphite_init_main_conf,      /* init main configuration */
 
     ngx_http_graphite_create_srv_conf,     /* create server configuration */
     NULL,                                  /* merge server configuration */
@@ -189,18 +249,25 @@ static const ngx_http_graphite_arg_t ngx_http_graphite_config_args[] = {
     { ngx_string("template"), ngx_http_graphite_config_arg_template, ngx_null_string },
     { ngx_string("protocol"), ngx_http_graphite_config_arg_protocol, ngx_string("udp") },
     { ngx_string("timeout"), ngx_http_graphite_config_arg_timeout, ngx_string("100") },
+    { ngx_string("self"), ngx_http_graphite_config_arg_self, ngx_string("off") },
+    { ngx_string("lock_profiling"), ngx_http_graphite_config_arg_lock_profiling, ngx_string("off") },
+    { ngx_string("idle"), ngx_http_graphite_config_arg_idle, ngx_string("send") },
+    { ngx_string("heartbeat"), ngx_http_graphite_config_arg_heartbeat, ngx_string("0") },
+    { ngx_string("percentile_mode"), ngx_http_graphite_config_arg_percentile_mode, ngx_string("p2") },
+    { ngx_string("budget"), ngx_http_graphite_config_arg_budget, ngx_string("0") },
 #ifdef NGX_LOG_LIMIT_ENABLED
     { ngx_string("error_log"), ngx_http_graphite_config_arg_error_log, ngx_null_string },
 #endif
 };
 
-#define PARAM_ARGS_COUNT 4
+#define PARAM_ARGS_COUNT 5
 
 static const ngx_http_graphite_arg_t ngx_http_graphite_param_args[PARAM_ARGS_COUNT] = {
     { ngx_string("name"), ngx_http_graphite_param_arg_name, ngx_null_string },
     { ngx_string("aggregate"), ngx_http_graphite_param_arg_aggregate, ngx_null_string },
     { ngx_string("interval"), ngx_http_graphite_param_arg_interval, ngx_null_string },
     { ngx_string("percentile"), ngx_http_graphite_param_arg_percentile, ngx_null_string },
+    { ngx_string("sample"), ngx_http_graphite_param_arg_sample, ngx_null_string },
 };
 
 static ngx_event_t timer;
@@ -213,52 +280,107 @@ typedef struct ngx_http_graphite_interval_s {
 typedef struct ngx_http_graphite_metric_data_s {
     double value;
     ngx_uint_t count;
+    double squares;
 } ngx_http_graphite_metric_data_t;
 
 typedef struct ngx_http_graphite_gauge_data_s {
     double value;
 } ngx_http_graphite_gauge_data_t;
 
-#define P2_METRIC_COUNT 5
-
-typedef struct ngx_http_graphite_statistic_data_s {
-    double q[P2_METRIC_COUNT];
-    double dn[P2_METRIC_COUNT];
-    double np[P2_METRIC_COUNT];
-    ngx_int_t n[P2_METRIC_COUNT];
-    ngx_uint_t count;
-} ngx_http_graphite_statistic_data_t;
-
 typedef double (*ngx_http_graphite_aggregate_pt)(const ngx_http_graphite_interval_t*, const void*);
 
 static double ngx_http_graphite_aggregate_avg(const ngx_http_graphite_interval_t *interval, const void *data);
 static double ngx_http_graphite_aggregate_persec(const ngx_http_graphite_interval_t *interval, const void *data);
 static double ngx_http_graphite_aggregate_sum(const ngx_http_graphite_interval_t *interval, const void *data);
 static double ngx_http_graphite_aggregate_gauge(const ngx_http_graphite_interval_t *interval, const void *data);
+static double ngx_http_graphite_aggregate_min(const ngx_http_graphite_interval_t *interval, const void *data);
+static double ngx_http_graphite_aggregate_max(const ngx_http_graphite_interval_t *interval, const void *data);
+static double ngx_http_graphite_aggregate_count(const ngx_http_graphite_interval_t *interval, const void *data);
+static double ngx_http_graphite_aggregate_stddev(const ngx_http_graphite_interval_t *interval, const void *data);
+static double ngx_http_graphite_aggregate_apdex(const ngx_http_graphite_interval_t *interval, const void *data);
 
 typedef struct ngx_http_graphite_aggregate_s {
     ngx_str_t name;
     ngx_http_graphite_aggregate_pt get;
 } ngx_http_graphite_aggregate_t;
 
-#define AGGREGATE_COUNT 4
+#define AGGREGATE_COUNT 8
 
 static const ngx_http_graphite_aggregate_t ngx_http_graphite_aggregates[AGGREGATE_COUNT] = {
     { ngx_string("avg"), ngx_http_graphite_aggregate_avg },
     { ngx_string("persec"), ngx_http_graphite_aggregate_persec },
     { ngx_string("sum"), ngx_http_graphite_aggregate_sum },
     { ngx_string("gauge"), ngx_http_graphite_aggregate_gauge },
+    { ngx_string("min"), ngx_http_graphite_aggregate_min },
+    { ngx_string("max"), ngx_http_graphite_aggregate_max },
+    { ngx_string("count"), ngx_http_graphite_aggregate_count },
+    { ngx_string("stddev"), ngx_http_graphite_aggregate_stddev },
+};
+
+/*
+ * The variable of a unique or topk vector resolved for one request. A key
+ * with zero weight is not counted.
+ */
+struct ngx_http_graphite_key_s {
+    ngx_str_t value;
+    uint32_t hash;
+    uint32_t weight;
 };
 
 struct ngx_http_graphite_source_s;
 typedef double (*ngx_http_graphite_source_handler_pt)(const struct ngx_http_graphite_source_s *source, ngx_http_request_t*);
-
+typedef void (*ngx_http_graphite_source_count_pt)(const struct ngx_http_graphite_source_s *source, ngx_http_request_t*, uint32_t *row);
+typedef void (*ngx_http_graphite_source_add_pt)(const struct ngx_http_graphite_source_s *source, const ngx_http_graphite_key_t *key, uint32_t *row);
+typedef u_char *(*ngx_http_graphite_source_label_pt)(const struct ngx_http_graphite_source_s *source, ngx_uint_t cell, u_char *buffer, size_t buffer_size);
+typedef ngx_int_t (*ngx_http_graphite_source_init_pt)(struct ngx_http_graphite_source_s *source);
+
+/*
+ * A source with cells is a vector: instead of one value per request it
+ * increments the counters of a row, one counter per cell. Its name contains
+ * "xxx" which is replaced with the cell label on output. A cumulative
+ * vector sends every cell as the sum of the cells up to it.
+ *
+ * A buckets vector is made from a plain source by the buckets= option,
+ * it keeps get and arg of the plain source and has bounds instead of count:
+ * its value is taken before the shared memory lock like a plain one and
+ * counted into the cell of the first bound not less than it. An apdex
+ * source keeps get of the plain source as base and compares its value
+ * with threshold.
+ * A unique vector keeps HyperLogLog registers of a variable in its row,
+ * for the requests counted by base if it is a counter, like rps, and for
+ * all requests otherwise, and is sent as one estimate.
+ * A topk vector keeps the heaviest values of a variable, weighted by base,
+ * and sends topk of them. Both have add instead of count: variable handlers
+ * may run any code, so the key is resolved before the shared memory lock
+ * and add only writes it into the row.
+ *
+ * A regex source may set init to parse its name into arg once at config
+ * time instead of on every request.
+ *
+ * An integral source always returns whole numbers, its metrics are summed
+ * into integer cells with atomic adds, without the shared memory lock.
+ */
 typedef struct ngx_http_graphite_source_s {
     ngx_str_t name;
     ngx_flag_t re;
     ngx_http_graphite_source_handler_pt get;
     ngx_http_graphite_aggregate_pt aggregate;
     ngx_uint_t type;
+    ngx_uint_t cells;
+    ngx_http_graphite_source_count_pt count;
+    ngx_http_graphite_source_add_pt add;
+    ngx_http_graphite_source_label_pt label;
+    ngx_http_graphite_source_init_pt init;
+    ngx_uint_t arg;
+    ngx_flag_t integral;
+    ngx_flag_t cumulative;
+    ngx_uint_t *bounds;
+    ngx_http_graphite_source_handler_pt base;
+    ngx_uint_t threshold;
+    ngx_flag_t unique;
+    ngx_flag_t counter;
+    ngx_uint_t topk;
+    ngx_int_t variable;
 } ngx_http_graphite_source_t;
 
 static double ngx_http_graphite_source_request_time(const ngx_http_graphite_source_t *source, ngx_http_request_t *r);
@@ -282,6 +404,19 @@ static double ngx_http_graphite_source_upstream_response_3xx_rps(const ngx_http_
 static double ngx_http_graphite_source_upstream_response_4xx_rps(const ngx_http_graphite_source_t *source, ngx_http_request_t *r);
 static double ngx_http_graphite_source_upstream_response_5xx_rps(const ngx_http_graphite_source_t *source, ngx_http_request_t *r);
 static double ngx_http_graphite_source_upstream_response_xxx_rps(const ngx_http_graphite_source_t *source, ngx_http_request_t *r);
+static void ngx_http_graphite_source_response_codes_rps(const ngx_http_graphite_source_t *source, ngx_http_request_t *r, uint32_t *row);
+static void ngx_http_graphite_source_upstream_response_codes_rps(const ngx_http_graphite_source_t *source, ngx_http_request_t *r, uint32_t *row);
+static u_char *ngx_http_graphite_status_label(const ngx_http_graphite_source_t *source, ngx_uint_t cell, u_char *buffer, size_t buffer_size);
+static void ngx_http_graphite_source_upstream_cache_codes_rps(const ngx_http_graphite_source_t *source, ngx_http_request_t *r, uint32_t *row);
+static u_char *ngx_http_graphite_cache_status_label(const ngx_http_graphite_source_t *source, ngx_uint_t cell, u_char *buffer, size_t buffer_size);
+static double ngx_http_graphite_source_apdex(const ngx_http_graphite_source_t *source, ngx_http_request_t *r);
+static void ngx_http_graphite_source_key(const ngx_http_graphite_source_t *source, ngx_http_request_t *r, ngx_http_graphite_key_t *key);
+static void ngx_http_graphite_source_topk(const ngx_http_graphite_source_t *source, const ngx_http_graphite_key_t *key, uint32_t *row);
+static void ngx_http_graphite_source_unique(const ngx_http_graphite_source_t *source, const ngx_http_graphite_key_t *key, uint32_t *row);
+static ngx_uint_t ngx_http_graphite_buckets_cell(const ngx_http_graphite_source_t *source, double value);
+static u_char *ngx_http_graphite_buckets_label(const ngx_http_graphite_source_t *source, ngx_uint_t cell, u_char *buffer, size_t buffer_size);
+static ngx_int_t ngx_http_graphite_source_init_status(ngx_http_graphite_source_t *source);
+static ngx_int_t ngx_http_graphite_source_init_cache_status(ngx_http_graphite_source_t *source);
 #ifdef NGX_GRAPHITE_PATCH
 static double ngx_http_graphite_source_ssl_handshake_time(const ngx_http_graphite_source_t *source, ngx_http_request_t *r);
 static double ngx_http_graphite_source_content_time(const ngx_http_graphite_source_t *source, ngx_http_request_t *r);
@@ -289,28 +424,92 @@ static double ngx_http_graphite_source_gzip_time(const ngx_http_graphite_source_
 static double ngx_http_graphite_source_lua_time(const ngx_http_graphite_source_t *source, ngx_http_request_t *r);
 #endif
 
+#define VECTOR_MAX_CELLS 128
+#define VECTOR_MAX_NAME 64
+
+/* 256 four bit registers, 6.5% standard error */
+#define UNIQUE_REGISTERS 256
+#define UNIQUE_CELLS (UNIQUE_REGISTERS / 8)
+#define UNIQUE_MAX_RANK 15
+
+/* space saving counters of a topk row, the flush merges them into more */
+#define TOPK_COUNTERS 16
+#define TOPK_MERGE (TOPK_COUNTERS * 4)
+#define TOPK_KEY 23
+#define TOPK_DEFAULT 5
+
+typedef struct ngx_http_graphite_topk_entry_s {
+    uint32_t hash;
+    uint32_t weight;
+    u_char len;
+    u_char key[TOPK_KEY];
+} ngx_http_graphite_topk_entry_t;
+
+#define TOPK_CELLS (TOPK_COUNTERS * sizeof(ngx_http_graphite_topk_entry_t) / sizeof(uint32_t))
+
+/* the sum of a key over an interval doesn't fit the 32 bit weight of a second */
+typedef struct ngx_http_graphite_topk_merge_s {
+    uint32_t hash;
+    uint64_t weight;
+    u_char len;
+    u_char key[TOPK_KEY];
+} ngx_http_graphite_topk_merge_t;
+
+static void ngx_http_graphite_topk_add(ngx_http_graphite_topk_entry_t *entries, ngx_uint_t n, uint32_t hash, const u_char *key, size_t len, uint32_t weight);
+static void ngx_http_graphite_topk_merge(ngx_http_graphite_topk_merge_t *entries, const ngx_http_graphite_topk_entry_t *row);
+
+#define STATUS_CELLS 72
+
+/* cell 0 counts all codes missing in this table */
+static const ngx_uint_t ngx_http_graphite_status_codes[STATUS_CELLS - 1] = {
+    100, 101, 102, 103,
+    200, 201, 202, 203, 204, 205, 206, 207, 208, 226,
+    300, 301, 302, 303, 304, 305, 306, 307, 308,
+    400, 401, 402, 403, 404, 405, 406, 407, 408, 409, 410, 411, 412, 413, 414, 415, 416, 417, 418,
+    421, 422, 423, 424, 425, 426, 428, 429, 431, 444, 451, 494, 495, 496, 497, 498, 499,
+    500, 501, 502, 503, 504, 505, 506, 507, 508, 509, 510, 511,
+};
+
+static u_char ngx_http_graphite_status_cells[500];
+
+#define CACHE_STATUS_CELLS 8
+
+/* in order of NGX_HTTP_CACHE_MISS..NGX_HTTP_CACHE_HIT, cell 0 counts the rest */
+static const ngx_str_t ngx_http_graphite_cache_statuses[CACHE_STATUS_CELLS - 1] = {
+    ngx_string("miss"),
+    ngx_string("bypass"),
+    ngx_string("expired"),
+    ngx_string("stale"),
+    ngx_string("updating"),
+    ngx_string("revalidated"),
+    ngx_string("hit"),
+};
+
 static const ngx_http_graphite_source_t ngx_http_graphite_sources[] = {
-    { .name = ngx_string("request_time"), .get = ngx_http_graphite_source_request_time, .aggregate = ngx_http_graphite_aggregate_avg },
-    { .name = ngx_string("bytes_sent"), .get = ngx_http_graphite_source_bytes_sent, .aggregate = ngx_http_graphite_aggregate_avg },
-    { .name = ngx_string("body_bytes_sent"), .get = ngx_http_graphite_source_body_bytes_sent, .aggregate = ngx_http_graphite_aggregate_avg },
-    { .name = ngx_string("request_length"), .get = ngx_http_graphite_source_request_length, .aggregate = ngx_http_graphite_aggregate_avg },
+    { .name = ngx_string("request_time"), .integral = 1, .get = ngx_http_graphite_source_request_time, .aggregate = ngx_http_graphite_aggregate_avg },
+    { .name = ngx_string("bytes_sent"), .integral = 1, .get = ngx_http_graphite_source_bytes_sent, .aggregate = ngx_http_graphite_aggregate_avg },
+    { .name = ngx_string("body_bytes_sent"), .integral = 1, .get = ngx_http_graphite_source_body_bytes_sent, .aggregate = ngx_http_graphite_aggregate_avg },
+    { .name = ngx_string("request_length"), .integral = 1, .get = ngx_http_graphite_source_request_length, .aggregate = ngx_http_graphite_aggregate_avg },
     { .name = ngx_string("ssl_cache_usage"), .get = ngx_http_graphite_source_ssl_cache_usage, .aggregate = ngx_http_graphite_aggregate_avg, .type = NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF },
-    { .name = ngx_string("rps"), .get = ngx_http_graphite_source_rps, .aggregate = ngx_http_graphite_aggregate_persec },
-    { .name = ngx_string("keepalive_rps"), .get = ngx_http_graphite_source_keepalive_rps, .aggregate = ngx_http_graphite_aggregate_persec },
-    { .name = ngx_string("response_2xx_rps"), .get = ngx_http_graphite_source_response_2xx_rps, .aggregate = ngx_http_graphite_aggregate_persec },
-    { .name = ngx_string("response_3xx_rps"), .get = ngx_http_graphite_source_response_3xx_rps, .aggregate = ngx_http_graphite_aggregate_persec },
-    { .name = ngx_string("response_4xx_rps"), .get = ngx_http_graphite_source_response_4xx_rps, .aggregate = ngx_http_graphite_aggregate_persec },
-    { .name = ngx_string("response_5xx_rps"), .get = ngx_http_graphite_source_response_5xx_rps, .aggregate = ngx_http_graphite_aggregate_persec },
-    { .name = ngx_string("response_\\d\\d\\d_rps"), .re = 1, .get = ngx_http_graphite_source_response_xxx_rps, .aggregate = ngx_http_graphite_aggregate_persec },
-    { .name = ngx_string("upstream_cache_(miss|bypass|expired|stale|updating|revalidated|hit)_rps"), .re = 1, .get = ngx_http_graphite_source_upstream_cache_status_rps, .aggregate = ngx_http_graphite_aggregate_persec },
-    { .name = ngx_string("upstream_time"), .get = ngx_http_graphite_source_upstream_time, .aggregate = ngx_http_graphite_aggregate_avg },
-    { .name = ngx_string("upstream_connect_time"), .get = ngx_http_graphite_source_upstream_connect_time, .aggregate = ngx_http_graphite_aggregate_avg },
-    { .name = ngx_string("upstream_header_time"), .get = ngx_http_graphite_source_upstream_header_time, .aggregate = ngx_http_graphite_aggregate_avg },
-    { .name = ngx_string("upstream_response_2xx_rps"), .get = ngx_http_graphite_source_upstream_response_2xx_rps, .aggregate = ngx_http_graphite_aggregate_persec },
-    { .name = ngx_string("upstream_response_3xx_rps"), .get = ngx_http_graphite_source_upstream_response_3xx_rps, .aggregate = ngx_http_graphite_aggregate_persec },
-    { .name = ngx_string("upstream_response_4xx_rps"), .get = ngx_http_graphite_source_upstream_response_4xx_rps, .aggregate = ngx_http_graphite_aggregate_persec },
-    { .name = ngx_string("upstream_response_5xx_rps"), .get = ngx_http_graphite_source_upstream_response_5xx_rps, .aggregate = ngx_http_graphite_aggregate_persec },
-    { .name = ngx_string("upstream_response_\\d\\d\\d_rps"), .re = 1, .get = ngx_http_graphite_source_upstream_response_xxx_rps, .aggregate = ngx_http_graphite_aggregate_persec },
+    { .name = ngx_string("rps"), .integral = 1, .get = ngx_http_graphite_source_rps, .aggregate = ngx_http_graphite_aggregate_persec },
+    { .name = ngx_string("keepalive_rps"), .integral = 1, .get = ngx_http_graphite_source_keepalive_rps, .aggregate = ngx_http_graphite_aggregate_persec },
+    { .name = ngx_string("response_2xx_rps"), .integral = 1, .get = ngx_http_graphite_source_response_2xx_rps, .aggregate = ngx_http_graphite_aggregate_persec },
+    { .name = ngx_string("response_3xx_rps"), .integral = 1, .get = ngx_http_graphite_source_response_3xx_rps, .aggregate = ngx_http_graphite_aggregate_persec },
+    { .name = ngx_string("response_4xx_rps"), .integral = 1, .get = ngx_http_graphite_source_response_4xx_rps, .aggregate = ngx_http_graphite_aggregate_persec },
+    { .name = ngx_string("response_5xx_rps"), .integral = 1, .get = ngx_http_graphite_source_response_5xx_rps, .aggregate = ngx_http_graphite_aggregate_persec },
+    { .name = ngx_string("response_xxx_rps"), .count = ngx_http_graphite_source_response_codes_rps, .label = ngx_http_graphite_status_label, .cells = STATUS_CELLS, .aggregate = ngx_http_graphite_aggregate_persec },
+    { .name = ngx_string("^response_\\d\\d\\d_rps$"), .re = 1, .init = ngx_http_graphite_source_init_status, .integral = 1, .get = ngx_http_graphite_source_response_xxx_rps, .aggregate = ngx_http_graphite_aggregate_persec },
+    { .name = ngx_string("upstream_cache_xxx_rps"), .count = ngx_http_graphite_source_upstream_cache_codes_rps, .label = ngx_http_graphite_cache_status_label, .cells = CACHE_STATUS_CELLS, .aggregate = ngx_http_graphite_aggregate_persec },
+    { .name = ngx_string("^upstream_cache_(miss|bypass|expired|stale|updating|revalidated|hit)_rps$"), .re = 1, .init = ngx_http_graphite_source_init_cache_status, .integral = 1, .get = ngx_http_graphite_source_upstream_cache_status_rps, .aggregate = ngx_http_graphite_aggregate_persec },
+    { .name = ngx_string("upstream_time"), .integral = 1, .get = ngx_http_graphite_source_upstream_time, .aggregate = ngx_http_graphite_aggregate_avg },
+    { .name = ngx_string("upstream_connect_time"), .integral = 1, .get = ngx_http_graphite_source_upstream_connect_time, .aggregate = ngx_http_graphite_aggregate_avg },
+    { .name = ngx_string("upstream_header_time"), .integral = 1, .get = ngx_http_graphite_source_upstream_header_time, .aggregate = ngx_http_graphite_aggregate_avg },
+    { .name = ngx_string("upstream_response_2xx_rps"), .integral = 1, .get = ngx_http_graphite_source_upstream_response_2xx_rps, .aggregate = ngx_http_graphite_aggregate_persec },
+    { .name = ngx_string("upstream_response_3xx_rps"), .integral = 1, .get = ngx_http_graphite_source_upstream_response_3xx_rps, .aggregate = ngx_http_graphite_aggregate_persec },
+    { .name = ngx_string("upstream_response_4xx_rps"), .integral = 1, .get = ngx_http_graphite_source_upstream_response_4xx_rps, .aggregate = ngx_http_graphite_aggregate_persec },
+    { .name = ngx_string("upstream_response_5xx_rps"), .integral = 1, .get = ngx_http_graphite_source_upstream_response_5xx_rps, .aggregate = ngx_http_graphite_aggregate_persec },
+    { .name = ngx_string("upstream_response_xxx_rps"), .count = ngx_http_graphite_source_upstream_response_codes_rps, .label = ngx_http_graphite_status_label, .cells = STATUS_CELLS, .aggregate = ngx_http_graphite_aggregate_persec },
+    { .name = ngx_string("^upstream_response_\\d\\d\\d_rps$"), .re = 1, .init = ngx_http_graphite_source_init_status, .integral = 1, .get = ngx_http_graphite_source_upstream_response_xxx_rps, .aggregate = ngx_http_graphite_aggregate_persec },
 #ifdef NGX_GRAPHITE_PATCH
     { .name = ngx_string("ssl_handshake_time"), .get = ngx_http_graphite_source_ssl_handshake_time, .aggregate = ngx_http_graphite_aggregate_avg },
     { .name = ngx_string("content_time"), .get = ngx_http_graphite_source_content_time, .aggregate = ngx_http_graphite_aggregate_avg },
@@ -328,12 +527,34 @@ typedef struct ngx_http_graphite_param_s {
     ngx_http_graphite_aggregate_pt aggregate;
     ngx_uint_t percentile;
     ngx_http_graphite_array_t *percentiles;
+    ngx_http_graphite_interval_t ewma;
+    ngx_uint_t sample;
 } ngx_http_graphite_param_t;
 
+/*
+ * Values and counts of a metric for second a are values[a * stride] and
+ * counts[a * stride]. Metrics known at config time share the storage
+ * planes, where a row holds one second of all of them; metrics created at
+ * runtime have planes of their own with stride 1. Metrics of integral
+ * sources are summed into ints[a * stride] instead of values, only the
+ * storage planes have ints. The op tells how a value goes into a second:
+ * summed, or kept as the minimum or the maximum; stddev metrics also sum
+ * the squares of the values into squares[a * stride].
+ */
+#define METRIC_SUM 0
+#define METRIC_MIN 1
+#define METRIC_MAX 2
+#define METRIC_STDDEV 3
+
 typedef struct ngx_http_graphite_metric_s {
     ngx_uint_t split;
     ngx_uint_t param;
-    ngx_http_graphite_metric_data_t *data;
+    ngx_uint_t op;
+    double *values;
+    ngx_uint_t *counts;
+    ngx_atomic_t *ints;
+    double *squares;
+    ngx_uint_t stride;
 } ngx_http_graphite_metric_t;
 
 typedef struct ngx_http_graphite_gauge_s {
@@ -342,17 +563,33 @@ typedef struct ngx_http_graphite_gauge_s {
     ngx_http_graphite_gauge_data_t *data;
 } ngx_http_graphite_gauge_t;
 
+/*
+ * Statistics of one source and split share the data of the first of
+ * them, the group, where the percentile of each one is the marker.
+ */
 typedef struct ngx_http_graphite_statistic_s {
     ngx_uint_t split;
     ngx_uint_t param;
+    ngx_uint_t group;
+    ngx_uint_t marker;
     ngx_http_graphite_statistic_data_t *data;
 } ngx_http_graphite_statistic_t;
 
+typedef struct ngx_http_graphite_vector_s {
+    ngx_uint_t split;
+    ngx_uint_t param;
+    ngx_uint_t cells;
+    uint32_t *data;
+} ngx_http_graphite_vector_t;
+
 typedef struct ngx_http_graphite_data_s {
     ngx_http_graphite_array_t *metrics;
     ngx_http_graphite_array_t *gauges;
     ngx_http_graphite_array_t *statistics;
+    ngx_http_graphite_array_t *vectors;
     ngx_http_complex_value_t *filter;
+    ngx_uint_t rollup;
+    ngx_uint_t sample;
 } ngx_http_graphite_data_t;
 
 typedef struct ngx_http_graphite_internal_s {
@@ -360,6 +597,90 @@ typedef struct ngx_http_graphite_internal_s {
     ngx_http_graphite_data_t data;
 } ngx_http_graphite_internal_t;
 
+#define PLAN_METRIC 0
+#define PLAN_GAUGE 1
+#define PLAN_STATISTIC 2
+#define PLAN_VECTOR 3
+#define PLAN_FOLD 4
+#define PLAN_COUNTER 5
+
+#define FILTER_NONE (ngx_uint_t)-1
+
+typedef struct ngx_http_graphite_plan_entry_s {
+    ngx_uint_t kind;
+    ngx_uint_t index;
+    ngx_uint_t value;
+    ngx_uint_t percentile;
+    const ngx_http_graphite_source_t *source;
+    void *data;
+    ngx_uint_t *counts;
+    ngx_uint_t stride;
+    ngx_uint_t rollup;
+    ngx_uint_t op;
+    double *squares;
+    ngx_uint_t sample;
+} ngx_http_graphite_plan_entry_t;
+
+typedef struct ngx_http_graphite_plan_group_s {
+    ngx_uint_t main;
+    ngx_uint_t filter;
+    ngx_uint_t start;
+    ngx_uint_t counters;
+    ngx_uint_t end;
+} ngx_http_graphite_plan_group_t;
+
+/*
+ * All datas of a location (main, server and location ones) flattened into
+ * one array of entries. Entries without a filter are merged into one group
+ * per main flag and sorted by kind and index, so the shared memory is
+ * walked in order. Only the sources used by the entries are evaluated,
+ * entry->value is a slot in the values of these sources. Vector entries
+ * have no slot, their source counts the request straight into the row.
+ * Keys of the unique and topk vectors are resolved before the lock into
+ * the scratch keys, entry->value of such a vector is its source.
+ * Datas with the same filter share one group, and every distinct filter is
+ * evaluated once per request, before the lock is taken. Folds are the
+ * metrics with min, max or stddev aggregates. Counters, the summed
+ * metrics of integral sources, are sorted to the end of a group, from
+ * group->counters, and are added without the lock. Statistics of a data
+ * with sample=1/N are updated on every Nth request of the location in the
+ * worker only, counted by requests. A request that updates no statistic
+ * and has nothing else to lock takes the lock-free path of counters.
+ */
+struct ngx_http_graphite_plan_s {
+    ngx_http_graphite_plan_group_t *groups;
+    ngx_uint_t ngroups;
+    ngx_http_graphite_plan_entry_t *entries;
+    ngx_uint_t nentries;
+    ngx_uint_t *sources;
+    ngx_uint_t nsources;
+    ngx_uint_t *keys;
+    ngx_uint_t nkeys;
+    ngx_http_complex_value_t **filters;
+    ngx_uint_t nfilters;
+    ngx_uint_t nlocked;
+    ngx_uint_t nstatistics;
+    ngx_uint_t requests;
+    ngx_uint_t subrequests;
+};
+
+#define ROLLUP_NONE (ngx_uint_t)-1
+
+/*
+ * A metric of a main data with rollup=on is not updated in the locations
+ * where an unfiltered location data has a metric of the same param, the
+ * child. The flush adds the child to the parent instead. A link is kept
+ * only if every location updating the child drops the parent, so no
+ * request is counted twice or lost. Main datas don't count subrequests,
+ * so a location logging them has no child.
+ */
+typedef struct ngx_http_graphite_rollup_s {
+    ngx_uint_t child;
+    ngx_uint_t parent;
+    ngx_uint_t plans;
+    ngx_uint_t last;
+} ngx_http_graphite_rollup_t;
+
 typedef struct ngx_http_graphite_internal_value_s {
     time_t ts;
     ngx_http_graphite_internal_t *internal;
@@ -373,7 +694,12 @@ typedef struct ngx_http_graphite_log_s {
 } ngx_http_graphite_log_t;
 #endif
 
+#define REQCTX_INLINE_VALUES 8
+
+/* values set from lua are kept inline and spill into the array only when there are too many */
 typedef struct ngx_http_graphite_reqctx_s {
+    ngx_http_graphite_internal_value_t values[REQCTX_INLINE_VALUES];
+    ngx_uint_t nvalues;
     ngx_array_t *internal_values;
 } ngx_http_graphite_reqctx_t;
 
@@ -427,7 +753,20 @@ static const ngx_http_graphite_template_arg_t ngx_http_graphite_default_data_arg
 
 static ngx_http_complex_value_t *ngx_http_graphite_complex_compile(ngx_conf_t *cf, ngx_str_t *value);
 
+static ngx_http_graphite_plan_t *ngx_http_graphite_plan_create(ngx_conf_t *cf, ngx_http_graphite_main_conf_t *gmcf, ngx_http_graphite_srv_conf_t *gscf, ngx_http_graphite_loc_conf_t *glcf);
+static void ngx_http_graphite_plan_resolve(ngx_http_graphite_plan_t *plan, ngx_http_graphite_main_conf_t *gmcf, ngx_http_graphite_storage_t *storage);
+static ngx_uint_t ngx_http_graphite_filter(ngx_http_request_t *r, ngx_http_complex_value_t *filter);
+
 static ngx_int_t ngx_http_graphite_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_graphite_handler2(ngx_http_request_t *r);
+static ngx_uint_t ngx_http_graphite_usec(void);
+static ngx_atomic_uint_t ngx_http_graphite_stat_take(ngx_atomic_t *stat);
+static ngx_uint_t ngx_http_graphite_append_record(ngx_http_graphite_buffer_t *buffer, u_char *last);
+static ngx_uint_t ngx_http_graphite_append_vector(ngx_http_graphite_main_conf_t *gmcf, ngx_http_graphite_storage_t *storage, ngx_uint_t v, const ngx_http_graphite_interval_t *interval, time_t ts);
+static ngx_uint_t ngx_http_graphite_append_self(ngx_http_graphite_main_conf_t *gmcf, ngx_slab_pool_t *shpool, time_t ts);
+static ngx_uint_t ngx_http_graphite_append_self_locks(ngx_http_graphite_main_conf_t *gmcf, ngx_http_graphite_storage_t *storage, time_t ts);
+static ngx_int_t ngx_http_graphite_status_handler(ngx_http_request_t *r);
+static const ngx_http_graphite_link_t *ngx_http_graphite_link_storage(ngx_http_graphite_context_t *context, const ngx_str_t *name, const ngx_str_t *config);
 static void ngx_http_graphite_timer_handler(ngx_event_t *ev);
 static ngx_int_t ngx_http_graphite_shared_init(ngx_shm_zone_t *shm_zone, void *data);
 static void ngx_http_graphite_del_old_records(ngx_http_graphite_main_conf_t *gmcf, time_t ts);
@@ -594,6 +933,26 @@ ngx_http_graphite_init(ngx_conf_t *cf) {
         return NGX_ERROR;
 #endif
 
+    ngx_uint_t i;
+    for (i = 0; i < STATUS_CELLS - 1; i++)
+        ngx_http_graphite_status_cells[ngx_http_graphite_status_codes[i] - 100] = i + 1;
+
+    ngx_http_graphite_main_conf_t *gmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_graphite_module);
+
+    /* every plan uses at most all sources and all filters */
+    gmcf->scratch_values = ngx_palloc(cf->pool, sizeof(double) * ngx_max(gmcf->sources->nelts, 1));
+    gmcf->scratch_filters = ngx_palloc(cf->pool, ngx_max(gmcf->filters->nelts, 1));
+    gmcf->scratch_keys = ngx_pcalloc(cf->pool, sizeof(ngx_http_graphite_key_t) * ngx_max(gmcf->sources->nelts, 1));
+    if (gmcf->scratch_values == NULL || gmcf->scratch_filters == NULL || gmcf->scratch_keys == NULL) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite can't alloc memory");
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_graphite_plan_rollups(cf, gmcf) != NGX_OK) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite can't alloc memory");
+        return NGX_ERROR;
+    }
+
     cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
 
     h = ngx_array_push(&cmcf->phases[NGX_HTTP_LOG_PHASE].handlers);
@@ -617,6 +976,30 @@ ngx_http_graphite_process_init(ngx_cycle_t *cycle) {
         timer.data = gmcf;
         timer.log = cycle->log;
         ngx_add_timer(&timer, gmcf->frequency);
+
+        /* links are stable until reload, so each worker caches them by name */
+        ngx_http_graphite_allocator_t *allocator = ngx_palloc(cycle->pool, sizeof(ngx_http_graphite_allocator_t));
+        if (allocator == NULL)
+            return NGX_ERROR;
+        ngx_http_graphite_allocator_init(allocator, cycle->pool, ngx_http_graphite_allocator_pool_alloc, ngx_http_graphite_allocator_pool_free);
+
+        gmcf->links = ngx_http_graphite_hash_create(allocator, 64);
+        if (gmcf->links == NULL)
+            return NGX_ERROR;
+
+        /* shared memory data of the plans is known only after the zone init */
+        ngx_slab_pool_t *shpool = (ngx_slab_pool_t*)gmcf->shared->shm.addr;
+        ngx_http_graphite_storage_t *storage = (ngx_http_graphite_storage_t*)shpool->data;
+
+        gmcf->reduce_values = ngx_palloc(cycle->pool, sizeof(double) * ngx_max(storage->metric_stride, 1));
+        gmcf->reduce_counts = ngx_palloc(cycle->pool, sizeof(ngx_uint_t) * ngx_max(storage->metric_stride, 1));
+        gmcf->reduce_ints = ngx_palloc(cycle->pool, sizeof(ngx_atomic_uint_t) * ngx_max(storage->metric_stride, 1));
+        if (gmcf->reduce_values == NULL || gmcf->reduce_counts == NULL || gmcf->reduce_ints == NULL)
+            return NGX_ERROR;
+
+        ngx_uint_t i;
+        for (i = 0; i < gmcf->plans->nelts; i++)
+            ngx_http_graphite_plan_resolve(((ngx_http_graphite_plan_t**)gmcf->plans->elts)[i], gmcf, storage);
     }
 
     return NGX_OK;
@@ -639,12 +1022,16 @@ ngx_http_graphite_create_main_conf(ngx_conf_t *cf) {
     gmcf->default_data_template = ngx_array_create(cf->pool, 1, sizeof(ngx_http_graphite_template_t));
     gmcf->default_data_params = ngx_array_create(cf->pool, 1, sizeof(ngx_uint_t));
     gmcf->datas = ngx_array_create(cf->pool, 1, sizeof(ngx_http_graphite_data_t));
+    gmcf->plans = ngx_array_create(cf->pool, 1, sizeof(ngx_http_graphite_plan_t*));
+    gmcf->filters = ngx_array_create(cf->pool, 1, sizeof(ngx_http_complex_value_t*));
+    gmcf->rollups = ngx_array_create(cf->pool, 1, sizeof(ngx_http_graphite_rollup_t));
+    gmcf->data_statistics = ngx_array_create(cf->pool, 4, sizeof(ngx_http_graphite_array_t*));
     gmcf->internal_values = ngx_array_create(cf->pool, 16, sizeof(ngx_http_graphite_internal_value_t));
 #ifdef NGX_LOG_LIMIT_ENABLED
     gmcf->logs = ngx_array_create(cf->pool, 1, sizeof(ngx_http_graphite_log_t));
 #endif
 
-    if (gmcf->sources == NULL || gmcf->splits == NULL || gmcf->intervals == NULL || gmcf->default_params == NULL || gmcf->template == NULL || gmcf->default_data_template == NULL || gmcf->default_data_params == NULL || gmcf->datas == NULL || gmcf->internal_values == NULL) {
+    if (gmcf->sources == NULL || gmcf->splits == NULL || gmcf->intervals == NULL || gmcf->default_params == NULL || gmcf->template == NULL || gmcf->default_data_template == NULL || gmcf->default_data_params == NULL || gmcf->datas == NULL || gmcf->plans == NULL || gmcf->filters == NULL || gmcf->rollups == NULL || gmcf->data_statistics == NULL || gmcf->internal_values == NULL) {
         ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite can't alloc memory");
         return NULL;
     }
@@ -664,12 +1051,13 @@ ngx_http_graphite_create_main_conf(ngx_conf_t *cf) {
 
     gmcf->storage->allocator = allocator;
     gmcf->storage->params = ngx_http_graphite_array_create(allocator, 1, sizeof(ngx_http_graphite_param_t));
-    gmcf->storage->internals = ngx_http_graphite_array_create(allocator, 1, sizeof(ngx_http_graphite_internal_t*));
+    gmcf->storage->internals = ngx_http_graphite_hash_create(allocator, 1);
     gmcf->storage->metrics = ngx_http_graphite_array_create(allocator, 1, sizeof(ngx_http_graphite_metric_t));
     gmcf->storage->gauges = ngx_http_graphite_array_create(allocator, 1, sizeof(ngx_http_graphite_gauge_t));
     gmcf->storage->statistics = ngx_http_graphite_array_create(allocator, 1, sizeof(ngx_http_graphite_statistic_t));
+    gmcf->storage->vectors = ngx_http_graphite_array_create(allocator, 1, sizeof(ngx_http_graphite_vector_t));
 
-    if (gmcf->storage->params == NULL || gmcf->storage->internals == NULL || gmcf->storage->metrics == NULL || gmcf->storage->gauges == NULL || gmcf->storage->statistics == NULL) {
+    if (gmcf->storage->params == NULL || gmcf->storage->internals == NULL || gmcf->storage->metrics == NULL || gmcf->storage->gauges == NULL || gmcf->storage->statistics == NULL || gmcf->storage->vectors == NULL) {
         ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite can't alloc memory");
         return NULL;
     }
@@ -677,6 +1065,92 @@ ngx_http_graphite_create_main_conf(ngx_conf_t *cf) {
     return gmcf;
 }
 
+static ngx_uint_t
+ngx_http_graphite_statistic_same_datas(const ngx_array_t *data_statistics, ngx_uint_t a, ngx_uint_t b) {
+
+    ngx_uint_t d;
+    for (d = 0; d < data_statistics->nelts; d++) {
+        const ngx_http_graphite_array_t *statistics = ((ngx_http_graphite_array_t**)data_statistics->elts)[d];
+        ngx_uint_t has_a = 0, has_b = 0;
+
+        ngx_uint_t i;
+        for (i = 0; i < statistics->nelts; i++) {
+            ngx_uint_t s = ((ngx_uint_t*)statistics->elts)[i];
+            has_a |= (s == a);
+            has_b |= (s == b);
+        }
+
+        if (has_a != has_b)
+            return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Percentiles of one source in one split are estimated together by the
+ * extended P2 algorithm if exactly the same datas update them, so every
+ * series keeps the requests it would have with an estimator of its own.
+ * The first of them leads the group, and every data updates the leader
+ * once for all its percentiles. Datas are final here, plans aren't made yet.
+ */
+static char *
+ngx_http_graphite_init_main_conf(ngx_conf_t *cf, void *conf) {
+
+    ngx_http_graphite_main_conf_t *gmcf = conf;
+    ngx_http_graphite_storage_t *storage = gmcf->storage;
+    ngx_http_graphite_statistic_t *statistics = storage->statistics->elts;
+    const ngx_http_graphite_param_t *params = storage->params->elts;
+
+    ngx_uint_t s, i, j;
+    for (s = 0; s < storage->statistics->nelts; s++) {
+        ngx_uint_t split = statistics[s].split;
+        ngx_uint_t source = params[statistics[s].param].source;
+
+        if (split == SPLIT_INTERNAL || source == SOURCE_INTERNAL)
+            continue;
+
+        for (i = 0; i < s; i++) {
+            if (statistics[i].group != i || statistics[i].split != split || params[statistics[i].param].source != source)
+                continue;
+
+            ngx_uint_t m = 0;
+            for (j = i; j < s; j++) {
+                if (statistics[j].group == i)
+                    m++;
+            }
+
+            if (m < P2_MAX_QUANTILES && ngx_http_graphite_statistic_same_datas(gmcf->data_statistics, i, s)) {
+                statistics[s].group = i;
+                break;
+            }
+        }
+    }
+
+    ngx_uint_t d;
+    for (d = 0; d < gmcf->data_statistics->nelts; d++) {
+        ngx_http_graphite_array_t *data = ((ngx_http_graphite_array_t**)gmcf->data_statistics->elts)[d];
+        ngx_uint_t *indexes = data->elts;
+        ngx_uint_t n = 0;
+
+        for (i = 0; i < data->nelts; i++) {
+            ngx_uint_t group = statistics[indexes[i]].group;
+
+            for (j = 0; j < n; j++) {
+                if (indexes[j] == group)
+                    break;
+            }
+
+            if (j == n)
+                indexes[n++] = group;
+        }
+
+        data->nelts = n;
+    }
+
+    return NGX_CONF_OK;
+}
+
 static void *
 ngx_http_graphite_create_srv_conf(ngx_conf_t *cf) {
 
@@ -771,2426 +1245,4539 @@ ngx_http_graphite_merge_loc_conf(ngx_conf_t* cf, void* parent, void* child) {
         *data = *prev_data;
     }
 
+    ngx_http_graphite_main_conf_t *gmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_graphite_module);
+    ngx_http_graphite_srv_conf_t *gscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_graphite_module);
+
+    if (gmcf->enable) {
+        conf->plan = ngx_http_graphite_plan_create(cf, gmcf, gscf, conf);
+        if (conf->plan == NULL)
+            return NGX_CONF_ERROR;
+    }
+
     return NGX_CONF_OK;
 }
 
-static ngx_str_t *
-ngx_http_graphite_server_name(ngx_pool_t *pool, ngx_conf_t* cf) {
+static ngx_int_t
+ngx_http_graphite_plan_add_entries(ngx_conf_t *cf, ngx_array_t *entries, const ngx_http_graphite_data_t *data) {
 
-    ngx_str_t *split = ngx_palloc(pool, sizeof(ngx_str_t));
-    split->len = 0;
-    if (!split)
-        return NULL;
+    ngx_http_graphite_main_conf_t *gmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_graphite_module);
+    ngx_http_graphite_storage_t *storage = gmcf->storage;
+    const ngx_http_graphite_array_t *indexes[] = { data->metrics, data->gauges, data->statistics, data->vectors };
 
-    ngx_http_core_srv_conf_t *cscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_core_module);
-    if (!cscf) {
-        return split;
-    }
-    if (!cscf->server_names.nelts) {
-        return split;
-    }
-    if (!cscf->server_names.elts) {
-        return split;
-    }
-    ngx_http_server_name_t *value;
-    value = cscf->server_names.elts;
-    ngx_str_t *server_name_old = &value[0].name;
+    ngx_uint_t kind;
+    for (kind = PLAN_METRIC; kind <= PLAN_VECTOR; kind++) {
 
+        ngx_uint_t i;
+        for (i = 0; i < indexes[kind]->nelts; i++) {
+            ngx_uint_t index = ((ngx_uint_t*)indexes[kind]->elts)[i];
+            ngx_uint_t p;
+
+            if (kind == PLAN_METRIC)
+                p = ((ngx_http_graphite_metric_t*)storage->metrics->elts)[index].param;
+            else if (kind == PLAN_GAUGE)
+                p = ((ngx_http_graphite_gauge_t*)storage->gauges->elts)[index].param;
+            else if (kind == PLAN_STATISTIC)
+                p = ((ngx_http_graphite_statistic_t*)storage->statistics->elts)[index].param;
+            else
+                p = ((ngx_http_graphite_vector_t*)storage->vectors->elts)[index].param;
 
-    split->data = ngx_palloc(pool, server_name_old->len);
-    ngx_uint_t i;
-    for (i = 0; i < server_name_old->len; ++i) {
-        if (isalnum(server_name_old->data[i]))
-            split->data[split->len++] = server_name_old->data[i];
-        else
-            split->data[split->len++] = '_';
-    }
-    while (split->len > 0 && split->data[0] == '_') {
-        split->data++;
-        split->len--;
+            const ngx_http_graphite_param_t *param = &((ngx_http_graphite_param_t*)storage->params->elts)[p];
+
+            ngx_http_graphite_plan_entry_t *entry = ngx_array_push(entries);
+            if (entry == NULL)
+                return NGX_ERROR;
+
+            entry->kind = kind;
+            entry->op = METRIC_SUM;
+            if (kind == PLAN_METRIC) {
+                entry->op = ((ngx_http_graphite_metric_t*)storage->metrics->elts)[index].op;
+                if (entry->op != METRIC_SUM)
+                    entry->kind = PLAN_FOLD;
+                else if (param->source != SOURCE_INTERNAL && ((ngx_http_graphite_source_t*)gmcf->sources->elts)[param->source].integral)
+                    entry->kind = PLAN_COUNTER;
+            }
+            entry->index = index;
+            entry->value = (param->source != SOURCE_INTERNAL) ? param->source : 0;
+            entry->percentile = param->percentile;
+            entry->source = NULL;
+            entry->data = NULL;
+            entry->counts = NULL;
+            entry->stride = 0;
+            entry->rollup = data->rollup;
+            entry->squares = NULL;
+            entry->sample = data->sample;
+        }
     }
-    while (split->len > 0 && split->data[split->len - 1] == '_')
-        split->len--;
 
-    return split;
+    return NGX_OK;
 }
 
-static ngx_str_t *
-ngx_http_graphite_location(ngx_pool_t *pool, const ngx_str_t *uri) {
-
-    ngx_str_t *split = ngx_palloc(pool, sizeof(ngx_str_t));
-    if (!split)
-        return NULL;
+static ngx_int_t
+ngx_http_graphite_plan_compare(const void *one, const void *two) {
 
-    split->data = ngx_palloc(pool, uri->len);
-    split->len = 0;
+    const ngx_http_graphite_plan_entry_t *a = one;
+    const ngx_http_graphite_plan_entry_t *b = two;
 
-    if (!split->data)
-        return NULL;
+    if (a->kind != b->kind)
+        return (a->kind < b->kind) ? -1 : 1;
+    if (a->index != b->index)
+        return (a->index < b->index) ? -1 : 1;
+    return 0;
+}
 
-    size_t i;
-    for (i = 0; i < uri->len; i++) {
-        if (isalnum(uri->data[i]))
-            split->data[split->len++] = uri->data[i];
-        else
-            split->data[split->len++] = '_';
-    }
+static ngx_uint_t
+ngx_http_graphite_plan_has_group(const ngx_http_graphite_plan_t *plan, ngx_uint_t main, const ngx_http_complex_value_t *filter) {
 
-    while (split->len > 1 && split->data[0] == '_') {
-        split->data++;
-        split->len--;
+    ngx_uint_t g;
+    for (g = 0; g < plan->ngroups; g++) {
+        const ngx_http_graphite_plan_group_t *group = &plan->groups[g];
+        if (group->main == main && group->filter != FILTER_NONE && plan->filters[group->filter] == filter)
+            return 1;
     }
 
-    while (split->len > 1 && split->data[split->len - 1] == '_')
-        split->len--;
-
-    return split;
+    return 0;
 }
 
-#if (NGX_SSL)
-static ngx_int_t
-ngx_http_graphite_ssl_session_reused(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+static void
+ngx_http_graphite_plan_add_group(ngx_conf_t *cf, ngx_http_graphite_plan_t *plan, ngx_array_t *entries, ngx_uint_t main, ngx_http_complex_value_t *filter) {
 
-    ngx_str_t s;
+    if (entries->nelts == 0)
+        return;
 
-    if (r->connection->requests == 1) {
-        if (r->connection->ssl && SSL_session_reused(r->connection->ssl->connection)) {
-            ngx_str_set(&s, "yes");
-        }
-        else {
-            ngx_str_set(&s, "no");
+    ngx_sort(entries->elts, entries->nelts, sizeof(ngx_http_graphite_plan_entry_t), ngx_http_graphite_plan_compare);
+
+    ngx_uint_t f = FILTER_NONE;
+    if (filter != NULL) {
+        for (f = 0; f < plan->nfilters; f++) {
+            if (plan->filters[f] == filter)
+                break;
         }
-    }
-    else {
-        ngx_str_set(&s, "none");
+
+        if (f == plan->nfilters)
+            plan->filters[plan->nfilters++] = filter;
     }
 
-    v->len = s.len;
-    v->data = s.data;
-    v->valid = 1;
-    v->no_cacheable = 0;
-    v->not_found = 0;
+    ngx_http_graphite_plan_group_t *group = &plan->groups[plan->ngroups++];
+    group->main = main;
+    group->filter = f;
+    group->start = plan->nentries;
+    group->end = plan->nentries + entries->nelts;
 
-    return NGX_OK;
-}
-#endif
+    ngx_uint_t i;
+    for (i = 0; i < entries->nelts; i++) {
+        if (((ngx_http_graphite_plan_entry_t*)entries->elts)[i].kind == PLAN_COUNTER)
+            break;
+    }
 
-static ngx_http_graphite_context_t
-ngx_http_graphite_context_from_config(ngx_conf_t *cf) {
+    group->counters = plan->nentries + i;
+    plan->nlocked += i;
 
-    ngx_http_graphite_main_conf_t *gmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_graphite_module);
+    for (i = 0; i < entries->nelts; i++) {
+        if (((ngx_http_graphite_plan_entry_t*)entries->elts)[i].kind == PLAN_STATISTIC)
+            plan->nstatistics++;
+    }
 
-    ngx_http_graphite_context_t context;
-    context.phase = PHASE_CONFIG;
-    context.storage = gmcf->storage;
-    context.pool = cf->pool;
-    context.log = cf->log;
-    context.gmcf = gmcf;
+    ngx_memcpy(&plan->entries[plan->nentries], entries->elts, entries->nelts * sizeof(ngx_http_graphite_plan_entry_t));
+    plan->nentries += entries->nelts;
 
-    return context;
+    entries->nelts = 0;
 }
 
-static ngx_http_graphite_context_t
-ngx_http_graphite_context_from_request(ngx_http_request_t *r) {
+static ngx_http_graphite_plan_t *
+ngx_http_graphite_plan_create(ngx_conf_t *cf, ngx_http_graphite_main_conf_t *gmcf, ngx_http_graphite_srv_conf_t *gscf, ngx_http_graphite_loc_conf_t *glcf) {
 
-    ngx_http_graphite_main_conf_t *gmcf = ngx_http_get_module_main_conf(r, ngx_http_graphite_module);
+    ngx_array_t *levels[] = { gmcf->datas, gscf->datas, glcf->datas };
+    ngx_uint_t mains[] = { 1, 1, 0 };
 
-    ngx_http_graphite_storage_t *storage = NULL;
+    ngx_uint_t ndatas = 0;
+    ngx_uint_t nentries = 0;
 
-    if (gmcf->enable) {
-        ngx_slab_pool_t *shpool = (ngx_slab_pool_t*)gmcf->shared->shm.addr;
-        storage = (ngx_http_graphite_storage_t*)shpool->data;
+    ngx_uint_t l, i;
+    for (l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+        for (i = 0; i < levels[l]->nelts; i++) {
+            const ngx_http_graphite_data_t *data = &((ngx_http_graphite_data_t*)levels[l]->elts)[i];
+            nentries += data->metrics->nelts + data->gauges->nelts + data->statistics->nelts + data->vectors->nelts;
+            ndatas++;
+        }
     }
 
-    ngx_http_graphite_context_t context;
-    context.phase = PHASE_REQUEST;
-    context.storage = storage;
-    context.pool = r->pool;
-    context.log = r->connection->log;
-    context.gmcf = gmcf;
-    return context;
-}
+    ngx_http_graphite_plan_t *plan = ngx_pcalloc(cf->pool, sizeof(ngx_http_graphite_plan_t));
+    ngx_array_t *entries = ngx_array_create(cf->pool, nentries ? nentries : 1, sizeof(ngx_http_graphite_plan_entry_t));
+    ngx_http_graphite_plan_t **pplan = ngx_array_push(gmcf->plans);
+    if (plan == NULL || entries == NULL || pplan == NULL) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite can't alloc memory");
+        return NULL;
+    }
 
-static char *
-ngx_http_graphite_parse_args(ngx_http_graphite_context_t *context, const ngx_array_t *vars, void *conf, const ngx_http_graphite_arg_t *args, ngx_uint_t args_count) {
+    ngx_http_core_loc_conf_t *clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    plan->subrequests = clcf->log_subrequest;
 
-    ngx_uint_t isset[args_count];
-    ngx_memzero(isset, args_count * sizeof(ngx_uint_t));
+    /* at most one group per filtered data and one unfiltered group per main flag */
+    plan->groups = ngx_palloc(cf->pool, sizeof(ngx_http_graphite_plan_group_t) * (ndatas + 2));
+    plan->entries = ngx_palloc(cf->pool, sizeof(ngx_http_graphite_plan_entry_t) * (nentries ? nentries : 1));
+    plan->filters = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t*) * (ndatas ? ndatas : 1));
+    if (plan->groups == NULL || plan->entries == NULL || plan->filters == NULL) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite can't alloc memory");
+        return NULL;
+    }
 
-    ngx_uint_t i;
-    for (i = 1; i < vars->nelts; i++) {
-        ngx_str_t *var = &((ngx_str_t*)vars->elts)[i];
+    ngx_uint_t main;
+    for (main = 0; main <= 1; main++) {
 
-        ngx_uint_t found = 0;
-        ngx_uint_t j;
-        for (j = 0; j < args_count; j++) {
-            const ngx_http_graphite_arg_t *arg = &args[j];
+        for (l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+            if (mains[l] != main)
+                continue;
 
-            if (!ngx_strncmp(arg->name.data, var->data, arg->name.len) && var->data[arg->name.len] == '=') {
-                isset[j] = 1;
-                found = 1;
-                ngx_str_t value;
-                value.data = var->data + arg->name.len + 1;
-                value.len = var->len - (arg->name.len + 1);
-
-                if (arg->handler(context, conf, &value) == NGX_CONF_ERROR)
-                    return NGX_CONF_ERROR;
-                break;
+            for (i = 0; i < levels[l]->nelts; i++) {
+                const ngx_http_graphite_data_t *data = &((ngx_http_graphite_data_t*)levels[l]->elts)[i];
+                if (data->filter == NULL && ngx_http_graphite_plan_add_entries(cf, entries, data) != NGX_OK) {
+                    ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite can't alloc memory");
+                    return NULL;
+                }
             }
         }
 
-        if (!found) {
-            ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite unknown option %V", var);
-            return NGX_CONF_ERROR;
-        }
-    }
+        ngx_http_graphite_plan_add_group(cf, plan, entries, main, NULL);
 
-    for (i = 0; i < args_count; i++) {
-        if (!isset[i]) {
+        for (l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+            if (mains[l] != main)
+                continue;
 
-            const ngx_http_graphite_arg_t *arg = &args[i];
-            if (arg->deflt.len) {
-                if (arg->handler(context, conf, (ngx_str_t*)&arg->deflt) == NGX_CONF_ERROR) {
-                    ngx_log_error(NGX_LOG_CRIT, context->log, 0, "graphite invalid option default value %V", &arg->deflt);
-                    return NGX_CONF_ERROR;
+            for (i = 0; i < levels[l]->nelts; i++) {
+                const ngx_http_graphite_data_t *data = &((ngx_http_graphite_data_t*)levels[l]->elts)[i];
+                if (data->filter == NULL || ngx_http_graphite_plan_has_group(plan, main, data->filter))
+                    continue;
+
+                /* gather all datas with this filter into one group */
+                ngx_uint_t k, j;
+                for (k = l; k < sizeof(levels) / sizeof(levels[0]); k++) {
+                    if (mains[k] != main)
+                        continue;
+
+                    for (j = (k == l) ? i : 0; j < levels[k]->nelts; j++) {
+                        const ngx_http_graphite_data_t *same = &((ngx_http_graphite_data_t*)levels[k]->elts)[j];
+                        if (same->filter == data->filter && ngx_http_graphite_plan_add_entries(cf, entries, same) != NGX_OK) {
+                            ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite can't alloc memory");
+                            return NULL;
+                        }
+                    }
                 }
+
+                ngx_http_graphite_plan_add_group(cf, plan, entries, main, data->filter);
             }
         }
     }
 
-    return NGX_CONF_OK;
-}
+    plan->sources = ngx_palloc(cf->pool, sizeof(ngx_uint_t) * (nentries ? nentries : 1));
+    plan->keys = ngx_palloc(cf->pool, sizeof(ngx_uint_t) * (nentries ? nentries : 1));
+    if (plan->sources == NULL || plan->keys == NULL) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite can't alloc memory");
+        return NULL;
+    }
 
-static ngx_int_t
-ngx_http_graphite_init_data(ngx_http_graphite_context_t *context, ngx_http_graphite_data_t *data) {
+    for (i = 0; i < plan->nentries; i++) {
+        ngx_http_graphite_plan_entry_t *entry = &plan->entries[i];
 
-    ngx_http_graphite_allocator_t *allocator = context->storage->allocator;
+        /* a buckets vector takes its value before the lock like a plain param */
+        const ngx_http_graphite_source_t *source = (entry->kind == PLAN_VECTOR) ? &((ngx_http_graphite_source_t*)gmcf->sources->elts)[entry->value] : NULL;
 
-    data->metrics = ngx_http_graphite_array_create(allocator, 1, sizeof(ngx_uint_t));
-    data->gauges = ngx_http_graphite_array_create(allocator, 1, sizeof(ngx_uint_t));
-    data->statistics = ngx_http_graphite_array_create(allocator, 1, sizeof(ngx_uint_t));
-    if (data->metrics == NULL || data->gauges == NULL || data->statistics == NULL) {
-        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
-        return NGX_ERROR;
-    }
-    data->filter = NULL;
+        if (source != NULL && source->bounds == NULL) {
+            if (source->add == NULL)
+                continue;
 
-    return NGX_OK;
-}
+            ngx_uint_t k;
+            for (k = 0; k < plan->nkeys; k++) {
+                if (plan->keys[k] == entry->value)
+                    break;
+            }
 
-static ngx_int_t
-ngx_http_graphite_add_param_to_config(ngx_http_graphite_context_t *context, const ngx_http_graphite_param_t *param, ngx_uint_t *created) {
+            if (k == plan->nkeys)
+                plan->keys[plan->nkeys++] = entry->value;
 
-    ngx_http_graphite_array_t *params = context->storage->params;
+            continue;
+        }
 
-    ngx_uint_t p;
-    for (p = 0; p < params->nelts; p++) {
-        ngx_http_graphite_param_t *old_param = &((ngx_http_graphite_param_t*)params->elts)[p];
-        if (param->name.len == old_param->name.len && !ngx_strncmp(param->name.data, old_param->name.data, param->name.len)) {
-            if (!param->percentile && !old_param->percentile) {
-                if (param->aggregate == old_param->aggregate && param->interval.value == old_param->interval.value) {
-                    if (created != NULL)
-                        *created = 0;
-                    return p;
-                }
-                else {
-                    ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite param with different aggregate or interval");
-                    return NGX_ERROR;
-                }
-            }
-            else if (param->percentile == old_param->percentile) {
-                if (created != NULL)
-                    *created = 0;
-                return p;
-            }
+        ngx_uint_t v;
+        for (v = 0; v < plan->nsources; v++) {
+            if (plan->sources[v] == entry->value)
+                break;
         }
-    }
 
-    ngx_http_graphite_param_t *new_param = ngx_http_graphite_array_push(params);
-    if (!new_param) {
-        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
-        return NGX_ERROR;
+        if (v == plan->nsources)
+            plan->sources[plan->nsources++] = entry->value;
+
+        entry->value = v;
     }
 
-    *new_param = *param;
-    if (created != NULL)
-        *created = 1;
+    *pplan = plan;
 
-    return params->nelts - 1;
+    return plan;
 }
 
-static char *
-ngx_http_graphite_add_param_to_data(ngx_http_graphite_context_t *context, ngx_uint_t split, ngx_uint_t param, ngx_http_graphite_data_t *data) {
+static ngx_uint_t
+ngx_http_graphite_plan_rollup_child(const ngx_http_graphite_storage_t *storage, const ngx_http_graphite_plan_t *plan, const ngx_http_graphite_plan_entry_t *parent) {
 
-    ngx_http_graphite_storage_t *storage = context->storage;
+    if (!parent->rollup || (parent->kind != PLAN_METRIC && parent->kind != PLAN_COUNTER) || plan->subrequests)
+        return ROLLUP_NONE;
 
-    ngx_http_graphite_param_t *p = &((ngx_http_graphite_param_t*)storage->params->elts)[param];
+    ngx_uint_t p = ((ngx_http_graphite_metric_t*)storage->metrics->elts)[parent->index].param;
+
+    ngx_uint_t g;
+    for (g = 0; g < plan->ngroups; g++) {
+        const ngx_http_graphite_plan_group_t *group = &plan->groups[g];
+        if (group->main || group->filter != FILTER_NONE)
+            continue;
 
-    if (p->percentile == 0 && p->aggregate != ngx_http_graphite_aggregate_gauge) {
         ngx_uint_t i;
-        for (i = 0; i < storage->metrics->nelts; i++) {
-            ngx_http_graphite_metric_t *metric = &((ngx_http_graphite_metric_t*)storage->metrics->elts)[i];
-            if (metric->split == split && metric->param == param)
-                break;
+        for (i = group->start; i < group->end; i++) {
+            const ngx_http_graphite_plan_entry_t *entry = &plan->entries[i];
+            if (entry->kind == parent->kind && entry->index != parent->index && ((ngx_http_graphite_metric_t*)storage->metrics->elts)[entry->index].param == p)
+                return entry->index;
         }
+    }
 
-        if (i == storage->metrics->nelts) {
-            ngx_http_graphite_metric_t *metric = ngx_http_graphite_array_push(storage->metrics);
-            if (!metric) {
-                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
-                return NGX_CONF_ERROR;
-            }
-
-            metric->split = split;
-            metric->param = param;
-            if (context->phase == PHASE_REQUEST) {
-                metric->data = ngx_http_graphite_allocator_alloc(storage->allocator, sizeof(ngx_http_graphite_metric_data_t) * (storage->max_interval + 1));
-                if (metric->data == NULL) {
-                    storage->metrics->nelts--;
-                    ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
-                    return NGX_CONF_ERROR;
-                }
-                ngx_memzero(metric->data, sizeof(ngx_http_graphite_metric_data_t) * (storage->max_interval + 1));
-            }
-            else
-                metric->data = NULL;
-        }
+    return ROLLUP_NONE;
+}
 
-        ngx_uint_t *m = ngx_http_graphite_array_push(data->metrics);
-        if (!m) {
-            ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
-            return NGX_CONF_ERROR;
-        }
+static ngx_http_graphite_rollup_t *
+ngx_http_graphite_find_rollup(ngx_array_t *rollups, ngx_uint_t child, ngx_uint_t parent) {
 
-        *m = i;
+    ngx_uint_t i;
+    for (i = 0; i < rollups->nelts; i++) {
+        ngx_http_graphite_rollup_t *rollup = &((ngx_http_graphite_rollup_t*)rollups->elts)[i];
+        if (rollup->child == child && rollup->parent == parent)
+            return rollup;
     }
-    else if (p->aggregate == ngx_http_graphite_aggregate_gauge) {
-        ngx_uint_t i;
-        for (i = 0; i < storage->gauges->nelts; i++) {
-            ngx_http_graphite_gauge_t *gauge = &((ngx_http_graphite_gauge_t*)storage->gauges->elts)[i];
-            if (gauge->split == split && gauge->param == param)
-                break;
-        }
 
-        if (i == storage->gauges->nelts) {
-            ngx_http_graphite_gauge_t *gauge = ngx_http_graphite_array_push(storage->gauges);
-            if (!gauge) {
-                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
-                return NGX_CONF_ERROR;
-            }
+    return NULL;
+}
 
-            gauge->split = split;
-            gauge->param = param;
-            if (context->phase == PHASE_REQUEST) {
-                gauge->data = ngx_http_graphite_allocator_alloc(storage->allocator, sizeof(ngx_http_graphite_gauge_data_t));
-                if (gauge->data == NULL) {
-                    storage->gauges->nelts--;
-                    ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
-                    return NGX_CONF_ERROR;
-                }
-                ngx_memzero(gauge->data, sizeof(ngx_http_graphite_gauge_data_t));
+static ngx_int_t
+ngx_http_graphite_plan_rollups(ngx_conf_t *cf, ngx_http_graphite_main_conf_t *gmcf) {
+
+    ngx_http_graphite_storage_t *storage = gmcf->storage;
+    ngx_http_graphite_plan_t **plans = gmcf->plans->elts;
+    ngx_uint_t nmetrics = ngx_max(storage->metrics->nelts, 1);
+
+    ngx_array_t *candidates = ngx_array_create(cf->pool, 4, sizeof(ngx_http_graphite_rollup_t));
+    ngx_uint_t *nplans = ngx_pcalloc(cf->pool, sizeof(ngx_uint_t) * nmetrics);
+    ngx_uint_t *seen = ngx_pcalloc(cf->pool, sizeof(ngx_uint_t) * nmetrics);
+    if (candidates == NULL || nplans == NULL || seen == NULL)
+        return NGX_ERROR;
+
+    ngx_uint_t n, i;
+    for (n = 0; n < gmcf->plans->nelts; n++) {
+        const ngx_http_graphite_plan_t *plan = plans[n];
+
+        for (i = 0; i < plan->nentries; i++) {
+            const ngx_http_graphite_plan_entry_t *entry = &plan->entries[i];
+
+            if (entry->kind != PLAN_METRIC && entry->kind != PLAN_COUNTER)
+                continue;
+
+            if (seen[entry->index] != n + 1) {
+                seen[entry->index] = n + 1;
+                nplans[entry->index]++;
             }
-            else
-                gauge->data = NULL;
-        }
 
-        ngx_uint_t *g = ngx_http_graphite_array_push(data->gauges);
-        if (!g) {
-            ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
-            return NGX_CONF_ERROR;
-        }
+            ngx_uint_t child = ngx_http_graphite_plan_rollup_child(storage, plan, entry);
+            if (child == ROLLUP_NONE)
+                continue;
 
-        *g = i;
-    }
-    else if (p->percentile != 0) {
-        ngx_uint_t i;
-        for (i = 0; i < storage->statistics->nelts; i++) {
-            ngx_http_graphite_statistic_t *statistic = &((ngx_http_graphite_statistic_t*)storage->statistics->elts)[i];
-            if (statistic->split == split && statistic->param == param)
-                break;
-        }
+            ngx_http_graphite_rollup_t *rollup = ngx_http_graphite_find_rollup(candidates, child, entry->index);
+            if (rollup == NULL) {
+                rollup = ngx_array_push(candidates);
+                if (rollup == NULL)
+                    return NGX_ERROR;
 
-        if (i == storage->statistics->nelts) {
-            ngx_http_graphite_statistic_t *statistic = ngx_http_graphite_array_push(storage->statistics);
-            if (!statistic) {
-                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
-                return NGX_CONF_ERROR;
+                rollup->child = child;
+                rollup->parent = entry->index;
+                rollup->plans = 0;
+                rollup->last = 0;
             }
 
-            statistic->split = split;
-            statistic->param = param;
-            if (context->phase == PHASE_REQUEST) {
-                statistic->data = ngx_http_graphite_allocator_alloc(storage->allocator, sizeof(ngx_http_graphite_statistic_data_t));
-                if (statistic->data == NULL) {
-                    storage->statistics->nelts--;
-                    ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
-                    return NGX_CONF_ERROR;
-                }
-                ngx_memzero(statistic->data, sizeof(ngx_http_graphite_statistic_data_t));
+            /* the parent may come from several datas of the plan */
+            if (rollup->last != n + 1) {
+                rollup->last = n + 1;
+                rollup->plans++;
             }
-            else
-                statistic->data = NULL;
         }
+    }
 
-        ngx_uint_t *s = ngx_http_graphite_array_push(data->statistics);
-        if (!s) {
-            ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
-            return NGX_CONF_ERROR;
+    ngx_http_graphite_rollup_t *rollups = candidates->elts;
+
+    for (i = 0; i < candidates->nelts; i++) {
+        ngx_http_graphite_rollup_t *rollup = &rollups[i];
+
+        if (rollup->plans != nplans[rollup->child])
+            continue;
+
+        ngx_uint_t j;
+        for (j = 0; j < candidates->nelts; j++) {
+            if (rollups[j].parent == rollup->child || rollups[j].child == rollup->parent)
+                break;
         }
 
-        *s = i;
-    }
-    else {
-        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite unknown error");
-        return NGX_CONF_ERROR;
+        if (j != candidates->nelts)
+            continue;
+
+        ngx_http_graphite_rollup_t *valid = ngx_array_push(gmcf->rollups);
+        if (valid == NULL)
+            return NGX_ERROR;
+
+        *valid = *rollup;
     }
 
-    return NGX_CONF_OK;
-}
+    if (gmcf->rollups->nelts == 0)
+        return NGX_OK;
 
-static char *
-ngx_http_graphite_add_param_to_params(ngx_http_graphite_context_t *context, ngx_uint_t param, ngx_array_t *params) {
+    /*
+     * Entries are compacted in place. The children are in the unfiltered
+     * location group, which goes before the main groups and loses nothing.
+     */
+    for (n = 0; n < gmcf->plans->nelts; n++) {
+        ngx_http_graphite_plan_t *plan = plans[n];
+        ngx_uint_t nentries = 0;
 
-    ngx_http_graphite_main_conf_t *gmcf = context->gmcf;
+        plan->nlocked = 0;
 
-    ngx_uint_t i;
-    for (i = 0; i < params->nelts; i++) {
-        ngx_uint_t p = ((ngx_uint_t*)params->elts)[i];
-        if (p == param) {
-            ngx_http_graphite_param_t *old_param = &((ngx_http_graphite_param_t*)gmcf->storage->params->elts)[p];
-            if (old_param->percentile == 0) {
-                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite duplicate param %V", &old_param->name);
-            }
-            else {
-                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite duplicate param %V/%ui", &old_param->name, old_param->percentile);
+        ngx_uint_t g;
+        for (g = 0; g < plan->ngroups; g++) {
+            ngx_http_graphite_plan_group_t *group = &plan->groups[g];
+            ngx_uint_t start = nentries;
+            ngx_uint_t counters = ROLLUP_NONE;
+
+            for (i = group->start; i < group->end; i++) {
+                const ngx_http_graphite_plan_entry_t *entry = &plan->entries[i];
+
+                ngx_uint_t child = ngx_http_graphite_plan_rollup_child(storage, plan, entry);
+                if (child != ROLLUP_NONE && ngx_http_graphite_find_rollup(gmcf->rollups, child, entry->index) != NULL)
+                    continue;
+
+                if (i >= group->counters && counters == ROLLUP_NONE)
+                    counters = nentries;
+
+                plan->entries[nentries++] = *entry;
             }
-            return NGX_CONF_ERROR;
+
+            group->start = start;
+            group->counters = (counters != ROLLUP_NONE) ? counters : nentries;
+            group->end = nentries;
+            plan->nlocked += group->counters - group->start;
         }
-    }
 
-    ngx_uint_t *new_param = ngx_array_push(params);
-    if (!new_param) {
-        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
-        return NGX_CONF_ERROR;
+        plan->nentries = nentries;
     }
-    *new_param = param;
 
-    return NGX_CONF_OK;
+    return NGX_OK;
 }
 
-#define HOST_LEN 256
-
-static char *
-ngx_http_graphite_config(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
-{
-    ngx_http_graphite_main_conf_t *gmcf = conf;
+static void
+ngx_http_graphite_plan_resolve(ngx_http_graphite_plan_t *plan, ngx_http_graphite_main_conf_t *gmcf, ngx_http_graphite_storage_t *storage) {
 
-    if (gmcf->enable) {
-            ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite duplicate config");
-            return NGX_CONF_ERROR;
+    ngx_uint_t i;
+    for (i = 0; i < plan->nentries; i++) {
+        ngx_http_graphite_plan_entry_t *entry = &plan->entries[i];
+
+        if (entry->kind == PLAN_METRIC || entry->kind == PLAN_FOLD || entry->kind == PLAN_COUNTER) {
+            const ngx_http_graphite_metric_t *metric = &((ngx_http_graphite_metric_t*)storage->metrics->elts)[entry->index];
+            entry->data = (entry->kind != PLAN_COUNTER) ? (void*)metric->values : (void*)metric->ints;
+            entry->counts = metric->counts;
+            entry->squares = metric->squares;
+            entry->stride = metric->stride;
+        }
+        else if (entry->kind == PLAN_GAUGE)
+            entry->data = ((ngx_http_graphite_gauge_t*)storage->gauges->elts)[entry->index].data;
+        else if (entry->kind == PLAN_STATISTIC)
+            entry->data = ((ngx_http_graphite_statistic_t*)storage->statistics->elts)[entry->index].data;
+        else {
+            const ngx_http_graphite_vector_t *vector = &((ngx_http_graphite_vector_t*)storage->vectors->elts)[entry->index];
+            const ngx_http_graphite_param_t *param = &((ngx_http_graphite_param_t*)storage->params->elts)[vector->param];
+            entry->data = vector->data;
+            entry->source = &((ngx_http_graphite_source_t*)gmcf->sources->elts)[param->source];
+        }
     }
+}
+
+static ngx_str_t *
+ngx_http_graphite_server_name(ngx_pool_t *pool, ngx_conf_t* cf) {
+
+    ngx_str_t *split = ngx_palloc(pool, sizeof(ngx_str_t));
+    split->len = 0;
+    if (!split)
+        return NULL;
+
+    ngx_http_core_srv_conf_t *cscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_core_module);
+    if (!cscf) {
+        return split;
+    }
+    if (!cscf->server_names.nelts) {
+        return split;
+    }
+    if (!cscf->server_names.elts) {
+        return split;
+    }
+    ngx_http_server_name_t *value;
+    value = cscf->server_names.elts;
+    ngx_str_t *server_name_old = &value[0].name;
+
+
+    split->data = ngx_palloc(pool, server_name_old->len);
+    ngx_uint_t i;
+    for (i = 0; i < server_name_old->len; ++i) {
+        if (isalnum(server_name_old->data[i]))
+            split->data[split->len++] = server_name_old->data[i];
+        else
+            split->data[split->len++] = '_';
+    }
+    while (split->len > 0 && split->data[0] == '_') {
+        split->data++;
+        split->len--;
+    }
+    while (split->len > 0 && split->data[split->len - 1] == '_')
+        split->len--;
+
+    return split;
+}
+
+static ngx_str_t *
+ngx_http_graphite_location(ngx_pool_t *pool, const ngx_str_t *uri) {
+
+    ngx_str_t *split = ngx_palloc(pool, sizeof(ngx_str_t));
+    if (!split)
+        return NULL;
+
+    split->data = ngx_palloc(pool, uri->len);
+    split->len = 0;
+
+    if (!split->data)
+        return NULL;
+
+    size_t i;
+    for (i = 0; i < uri->len; i++) {
+        if (isalnum(uri->data[i]))
+            split->data[split->len++] = uri->data[i];
+        else
+            split->data[split->len++] = '_';
+    }
+
+    while (split->len > 1 && split->data[0] == '_') {
+        split->data++;
+        split->len--;
+    }
+
+    while (split->len > 1 && split->data[split->len - 1] == '_')
+        split->len--;
+
+    return split;
+}
+
+#if (NGX_SSL)
+static ngx_int_t
+ngx_http_graphite_ssl_session_reused(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+
+    ngx_str_t s;
+
+    if (r->connection->requests == 1) {
+        if (r->connection->ssl && SSL_session_reused(r->connection->ssl->connection)) {
+            ngx_str_set(&s, "yes");
+        }
+        else {
+            ngx_str_set(&s, "no");
+        }
+    }
+    else {
+        ngx_str_set(&s, "none");
+    }
+
+    v->len = s.len;
+    v->data = s.data;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    return NGX_OK;
+}
+#endif
+
+static ngx_http_graphite_context_t
+ngx_http_graphite_context_from_config(ngx_conf_t *cf) {
+
+    ngx_http_graphite_main_conf_t *gmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_graphite_module);
+
+    ngx_http_graphite_context_t context;
+    context.phase = PHASE_CONFIG;
+    context.storage = gmcf->storage;
+    context.pool = cf->pool;
+    context.log = cf->log;
+    context.gmcf = gmcf;
+    context.cf = cf;
+
+    return context;
+}
+
+static ngx_http_graphite_context_t
+ngx_http_graphite_context_from_request(ngx_http_request_t *r) {
+
+    ngx_http_graphite_main_conf_t *gmcf = ngx_http_get_module_main_conf(r, ngx_http_graphite_module);
+
+    ngx_http_graphite_storage_t *storage = NULL;
+
+    if (gmcf->enable) {
+        ngx_slab_pool_t *shpool = (ngx_slab_pool_t*)gmcf->shared->shm.addr;
+        storage = (ngx_http_graphite_storage_t*)shpool->data;
+    }
+
+    ngx_http_graphite_context_t context;
+    context.phase = PHASE_REQUEST;
+    context.storage = storage;
+    context.pool = r->pool;
+    context.log = r->connection->log;
+    context.gmcf = gmcf;
+    context.cf = NULL;
+    return context;
+}
+
+static char *
+ngx_http_graphite_parse_args(ngx_http_graphite_context_t *context, const ngx_array_t *vars, void *conf, const ngx_http_graphite_arg_t *args, ngx_uint_t args_count) {
+
+    ngx_uint_t isset[args_count];
+    ngx_memzero(isset, args_count * sizeof(ngx_uint_t));
+
+    ngx_uint_t i;
+    for (i = 1; i < vars->nelts; i++) {
+        ngx_str_t *var = &((ngx_str_t*)vars->elts)[i];
+
+        ngx_uint_t found = 0;
+        ngx_uint_t j;
+        for (j = 0; j < args_count; j++) {
+            const ngx_http_graphite_arg_t *arg = &args[j];
+
+            if (!ngx_strncmp(arg->name.data, var->data, arg->name.len) && var->data[arg->name.len] == '=') {
+                isset[j] = 1;
+                found = 1;
+                ngx_str_t value;
+                value.data = var->data + arg->name.len + 1;
+                value.len = var->len - (arg->name.len + 1);
+
+                if (arg->handler(context, conf, &value) == NGX_CONF_ERROR)
+                    return NGX_CONF_ERROR;
+                break;
+            }
+        }
+
+        if (!found) {
+            ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite unknown option %V", var);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    for (i = 0; i < args_count; i++) {
+        if (!isset[i]) {
+
+            const ngx_http_graphite_arg_t *arg = &args[i];
+            if (arg->deflt.len) {
+                if (arg->handler(context, conf, (ngx_str_t*)&arg->deflt) == NGX_CONF_ERROR) {
+                    ngx_log_error(NGX_LOG_CRIT, context->log, 0, "graphite invalid option default value %V", &arg->deflt);
+                    return NGX_CONF_ERROR;
+                }
+            }
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_http_graphite_init_data(ngx_http_graphite_context_t *context, ngx_http_graphite_data_t *data) {
+
+    ngx_http_graphite_allocator_t *allocator = context->storage->allocator;
+
+    data->metrics = ngx_http_graphite_array_create(allocator, 1, sizeof(ngx_uint_t));
+    data->gauges = ngx_http_graphite_array_create(allocator, 1, sizeof(ngx_uint_t));
+    data->statistics = ngx_http_graphite_array_create(allocator, 1, sizeof(ngx_uint_t));
+    data->vectors = ngx_http_graphite_array_create(allocator, 1, sizeof(ngx_uint_t));
+    if (data->metrics == NULL || data->gauges == NULL || data->statistics == NULL || data->vectors == NULL) {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+        return NGX_ERROR;
+    }
+    data->filter = NULL;
+    data->rollup = 0;
+    data->sample = 1;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_graphite_add_param_to_config(ngx_http_graphite_context_t *context, const ngx_http_graphite_param_t *param, ngx_uint_t *created) {
+
+    ngx_http_graphite_array_t *params = context->storage->params;
+
+    ngx_uint_t p;
+    for (p = 0; p < params->nelts; p++) {
+        ngx_http_graphite_param_t *old_param = &((ngx_http_graphite_param_t*)params->elts)[p];
+        if (param->name.len == old_param->name.len && !ngx_strncmp(param->name.data, old_param->name.data, param->name.len)) {
+            /* rps_ewma of 1m and 5m are different params of one name */
+            if (param->ewma.value != old_param->ewma.value)
+                continue;
+
+            if (!param->percentile && !old_param->percentile) {
+                if (param->aggregate == old_param->aggregate && param->interval.value == old_param->interval.value) {
+                    if (created != NULL)
+                        *created = 0;
+                    return p;
+                }
+                else {
+                    ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite param with different aggregate or interval");
+                    return NGX_ERROR;
+                }
+            }
+            else if (param->percentile == old_param->percentile) {
+                if (created != NULL)
+                    *created = 0;
+                return p;
+            }
+        }
+    }
+
+    ngx_http_graphite_param_t *new_param = ngx_http_graphite_array_push(params);
+    if (!new_param) {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+        return NGX_ERROR;
+    }
+
+    *new_param = *param;
+    if (created != NULL)
+        *created = 1;
+
+    return params->nelts - 1;
+}
+
+static ngx_uint_t
+ngx_http_graphite_metric_op(const ngx_http_graphite_param_t *param) {
+
+    if (param->aggregate == ngx_http_graphite_aggregate_min)
+        return METRIC_MIN;
+    if (param->aggregate == ngx_http_graphite_aggregate_max)
+        return METRIC_MAX;
+    if (param->aggregate == ngx_http_graphite_aggregate_stddev)
+        return METRIC_STDDEV;
+
+    return METRIC_SUM;
+}
+
+static char *
+ngx_http_graphite_add_param_to_data(ngx_http_graphite_context_t *context, ngx_uint_t split, ngx_uint_t param, ngx_http_graphite_data_t *data) {
+
+    ngx_http_graphite_storage_t *storage = context->storage;
+
+    ngx_http_graphite_param_t *p = &((ngx_http_graphite_param_t*)storage->params->elts)[param];
+
+    const ngx_http_graphite_source_t *source = NULL;
+    if (p->source != SOURCE_INTERNAL)
+        source = &((ngx_http_graphite_source_t*)context->gmcf->sources->elts)[p->source];
+
+    if (source != NULL && source->cells != 0) {
+        ngx_uint_t i;
+        for (i = 0; i < storage->vectors->nelts; i++) {
+            ngx_http_graphite_vector_t *vector = &((ngx_http_graphite_vector_t*)storage->vectors->elts)[i];
+            if (vector->split == split && vector->param == param)
+                break;
+        }
+
+        if (i == storage->vectors->nelts) {
+            ngx_http_graphite_vector_t *vector = ngx_http_graphite_array_push(storage->vectors);
+            if (!vector) {
+                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+                return NGX_CONF_ERROR;
+            }
+
+            vector->split = split;
+            vector->param = param;
+            vector->cells = source->cells;
+            vector->data = NULL;
+        }
+
+        ngx_uint_t *v = ngx_http_graphite_array_push(data->vectors);
+        if (!v) {
+            ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+            return NGX_CONF_ERROR;
+        }
+
+        *v = i;
+    }
+    else if (p->percentile == 0 && p->aggregate != ngx_http_graphite_aggregate_gauge) {
+        ngx_uint_t i;
+        for (i = 0; i < storage->metrics->nelts; i++) {
+            ngx_http_graphite_metric_t *metric = &((ngx_http_graphite_metric_t*)storage->metrics->elts)[i];
+            if (metric->split == split && metric->param == param)
+                break;
+        }
+
+        if (i == storage->metrics->nelts) {
+            ngx_http_graphite_metric_t *metric = ngx_http_graphite_array_push(storage->metrics);
+            if (!metric) {
+                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+                return NGX_CONF_ERROR;
+            }
+
+            metric->split = split;
+            metric->param = param;
+            metric->op = ngx_http_graphite_metric_op(p);
+            metric->stride = 1;
+            metric->squares = NULL;
+            if (context->phase == PHASE_REQUEST) {
+                /* squares go right after values, so the doubles stay aligned */
+                ngx_uint_t planes = (metric->op == METRIC_STDDEV) ? 2 : 1;
+                size_t size = (sizeof(double) * planes + sizeof(ngx_uint_t)) * (storage->max_interval + 1);
+                metric->values = ngx_http_graphite_allocator_alloc(storage->allocator, size);
+                if (metric->values == NULL) {
+                    storage->metrics->nelts--;
+                    ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+                    return NGX_CONF_ERROR;
+                }
+                ngx_memzero(metric->values, size);
+                if (metric->op == METRIC_STDDEV)
+                    metric->squares = metric->values + storage->max_interval + 1;
+                metric->counts = (ngx_uint_t*)(metric->values + (storage->max_interval + 1) * planes);
+            }
+            else {
+                metric->values = NULL;
+                metric->counts = NULL;
+            }
+            metric->ints = NULL;
+        }
+
+        ngx_uint_t *m = ngx_http_graphite_array_push(data->metrics);
+        if (!m) {
+            ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+            return NGX_CONF_ERROR;
+        }
+
+        *m = i;
+    }
+    else if (p->aggregate == ngx_http_graphite_aggregate_gauge) {
+        ngx_uint_t i;
+        for (i = 0; i < storage->gauges->nelts; i++) {
+            ngx_http_graphite_gauge_t *gauge = &((ngx_http_graphite_gauge_t*)storage->gauges->elts)[i];
+            if (gauge->split == split && gauge->param == param)
+                break;
+        }
+
+        if (i == storage->gauges->nelts) {
+            ngx_http_graphite_gauge_t *gauge = ngx_http_graphite_array_push(storage->gauges);
+            if (!gauge) {
+                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+                return NGX_CONF_ERROR;
+            }
+
+            gauge->split = split;
+            gauge->param = param;
+            if (context->phase == PHASE_REQUEST) {
+                gauge->data = ngx_http_graphite_allocator_alloc(storage->allocator, sizeof(ngx_http_graphite_gauge_data_t));
+                if (gauge->data == NULL) {
+                    storage->gauges->nelts--;
+                    ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+                    return NGX_CONF_ERROR;
+                }
+                ngx_memzero(gauge->data, sizeof(ngx_http_graphite_gauge_data_t));
+            }
+            else
+                gauge->data = NULL;
+        }
+
+        ngx_uint_t *g = ngx_http_graphite_array_push(data->gauges);
+        if (!g) {
+            ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+            return NGX_CONF_ERROR;
+        }
+
+        *g = i;
+    }
+    else if (p->percentile != 0) {
+        ngx_uint_t i;
+        for (i = 0; i < storage->statistics->nelts; i++) {
+            ngx_http_graphite_statistic_t *statistic = &((ngx_http_graphite_statistic_t*)storage->statistics->elts)[i];
+            if (statistic->split == split && statistic->param == param)
+                break;
+        }
+
+        if (i == storage->statistics->nelts) {
+            ngx_http_graphite_statistic_t *statistic = ngx_http_graphite_array_push(storage->statistics);
+            if (!statistic) {
+                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+                return NGX_CONF_ERROR;
+            }
+
+            statistic->split = split;
+            statistic->param = param;
+            statistic->group = i;
+            statistic->marker = 2;
+            if (context->phase == PHASE_REQUEST) {
+                size_t samples = (context->gmcf->percentile_mode == PERCENTILE_RESERVOIR) ? RESERVOIR_SIZE : 0;
+                statistic->data = ngx_http_graphite_allocator_alloc(storage->allocator, sizeof(ngx_http_graphite_statistic_data_t) + sizeof(double) * samples);
+                if (statistic->data == NULL) {
+                    storage->statistics->nelts--;
+                    ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+                    return NGX_CONF_ERROR;
+                }
+                ngx_http_graphite_statistic_init(statistic->data, &p->percentile, 1);
+                if (samples)
+                    statistic->data->samples = (double*)(statistic->data + 1);
+            }
+            else
+                statistic->data = NULL;
+        }
+
+        ngx_uint_t j;
+        for (j = 0; j < data->statistics->nelts; j++) {
+            if (((ngx_uint_t*)data->statistics->elts)[j] == i)
+                break;
+        }
+
+        if (j == data->statistics->nelts) {
+            ngx_uint_t *s = ngx_http_graphite_array_push(data->statistics);
+            if (!s) {
+                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+                return NGX_CONF_ERROR;
+            }
+
+            *s = i;
+        }
+    }
+    else {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite unknown error");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_graphite_add_param_to_params(ngx_http_graphite_context_t *context, ngx_uint_t param, ngx_array_t *params) {
+
+    ngx_http_graphite_main_conf_t *gmcf = context->gmcf;
+
+    ngx_uint_t i;
+    for (i = 0; i < params->nelts; i++) {
+        ngx_uint_t p = ((ngx_uint_t*)params->elts)[i];
+        if (p == param) {
+            ngx_http_graphite_param_t *old_param = &((ngx_http_graphite_param_t*)gmcf->storage->params->elts)[p];
+            if (old_param->percentile == 0) {
+                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite duplicate param %V", &old_param->name);
+            }
+            else {
+                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite duplicate param %V/%ui", &old_param->name, old_param->percentile);
+            }
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    ngx_uint_t *new_param = ngx_array_push(params);
+    if (!new_param) {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+        return NGX_CONF_ERROR;
+    }
+    *new_param = param;
+
+    return NGX_CONF_OK;
+}
+
+#define HOST_LEN 256
+
+static char *
+ngx_http_graphite_config(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_graphite_main_conf_t *gmcf = conf;
+
+    if (gmcf->enable) {
+            ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite duplicate config");
+            return NGX_CONF_ERROR;
+    }
+
+    ngx_http_graphite_context_t context = ngx_http_graphite_context_from_config(cf);
 
-    ngx_http_graphite_context_t context = ngx_http_graphite_context_from_config(cf);
-
     if (ngx_http_graphite_parse_args(&context, cf->args, conf, ngx_http_graphite_config_args, CONFIG_ARGS_COUNT) == NGX_CONF_ERROR)
         return NGX_CONF_ERROR;
 
-    if (gmcf->host.len == 0) {
-        char host[HOST_LEN];
-        gethostname(host, HOST_LEN);
-        host[HOST_LEN - 1] = '\0';
-        char *dot = strchr(host, '.');
-        if (dot)
-            *dot = '\0';
+    if (gmcf->host.len == 0) {
+        char host[HOST_LEN];
+        gethostname(host, HOST_LEN);
+        host[HOST_LEN - 1] = '\0';
+        char *dot = strchr(host, '.');
+        if (dot)
+            *dot = '\0';
+
+        size_t host_size = strlen(host);
+
+        gmcf->host.data = ngx_palloc(cf->pool, host_size);
+        if (!gmcf->host.data) {
+            ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite can't alloc memory");
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_memcpy(gmcf->host.data, host, host_size);
+        gmcf->host.len = host_size;
+    }
+
+    if (gmcf->server.name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite config server not set");
+        return NGX_CONF_ERROR;
+    }
+    if (gmcf->protocol.len == 0) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite config protocol is not specified");
+        return NGX_CONF_ERROR;
+    }
+    else if (ngx_strncmp(gmcf->protocol.data, "udp", 3) != 0 && ngx_strncmp(gmcf->protocol.data, "tcp", 3) != 0) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite config invalid protocol");
+        return NGX_CONF_ERROR;
+    }
+
+    if (gmcf->port < 1 || gmcf->port > 65535) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite config port must be in range form 1 to 65535");
+        return NGX_CONF_ERROR;
+    }
+
+    if (gmcf->frequency < 1 || gmcf->frequency > 65535) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite config frequency must be in range form 1 to 65535");
+        return NGX_CONF_ERROR;
+    }
+
+    if (gmcf->intervals->nelts == 0) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite config intervals not set");
+        return NGX_CONF_ERROR;
+    }
+
+    if (gmcf->default_params->nelts == 0) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite config params not set");
+        return NGX_CONF_ERROR;
+    }
+
+    if (gmcf->shared_size == 0 || gmcf->buffer_size == 0) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite config shared must be positive value");
+        return NGX_CONF_ERROR;
+    }
+
+    if (gmcf->buffer_size == 0) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite config buffer must be positive value");
+        return NGX_CONF_ERROR;
+    }
+
+    if (gmcf->package_size == 0) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite config package must be positive value");
+        return NGX_CONF_ERROR;
+    }
+
+    if (gmcf->shared_size < sizeof(ngx_slab_pool_t)) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite too small shared memory");
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_url_t u;
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = gmcf->server.name;
+    u.default_port = gmcf->port;
+
+    if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+        if (u.err)
+            ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "%s in resolver \"%V\"", u.err, &u.url);
+        return NGX_CONF_ERROR;
+    }
+
+    gmcf->server.sockaddr = u.addrs[0].sockaddr;
+    gmcf->server.socklen = u.addrs[0].socklen;
+
+    ngx_str_t graphite_shared_id;
+    graphite_shared_id.len = graphite_shared_name.len + 32;
+    graphite_shared_id.data = ngx_palloc(cf->pool, graphite_shared_id.len);
+    if (!graphite_shared_id.data) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite can't alloc memory");
+        return NGX_CONF_ERROR;
+    }
+    ngx_snprintf(graphite_shared_id.data, graphite_shared_id.len, "%V.%T", &graphite_shared_name, ngx_time());
+
+    gmcf->shared = ngx_shared_memory_add(cf, &graphite_shared_id, gmcf->shared_size, &ngx_http_graphite_module);
+    if (!gmcf->shared) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite can't alloc shared memory");
+        return NGX_CONF_ERROR;
+    }
+    if (gmcf->shared->data) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite shared memory is used");
+        return NGX_CONF_ERROR;
+    }
+    gmcf->shared->init = ngx_http_graphite_shared_init;
+    gmcf->shared->data = gmcf;
+
+    if (ngx_http_graphite_buffer_init(&gmcf->buffer, cf->pool, gmcf->buffer_size) != NGX_OK) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite can't alloc memory");
+        return NGX_CONF_ERROR;
+    }
+
+    gmcf->enable = 1;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_graphite_default_data(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+
+    ngx_http_graphite_context_t context = ngx_http_graphite_context_from_config(cf);
+
+    ngx_http_graphite_main_conf_t *gmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_graphite_module);
+    ngx_http_graphite_srv_conf_t *gscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_graphite_module);
+
+    if (!gmcf->enable) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite config not set");
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_str_t *args = cf->args->elts;
+
+    ngx_array_t *template = NULL;
+    ngx_array_t *params = NULL;
+    ngx_http_complex_value_t **filter;
+
+    if (cf->cmd_type == NGX_HTTP_MAIN_CONF) {
+        template = gmcf->default_data_template;
+        params = gmcf->default_data_params;
+        filter = &gmcf->default_data_filter;
+    }
+    else if (cf->cmd_type == NGX_HTTP_SRV_CONF) {
+        template = gscf->default_data_template;
+        params = gscf->default_data_params;
+        filter = &gscf->default_data_filter;
+    }
+    else
+        return NGX_CONF_ERROR;
+
+    if (ngx_http_graphite_template_compile(&context, template, ngx_http_graphite_default_data_args, DEFAULT_DATA_ARG_COUNT, &args[1]) != NGX_CONF_OK)
+        return NGX_CONF_ERROR;
+
+    if (cf->args->nelts >= 3) {
+        ngx_uint_t i;
+        for (i = 2; i < cf->args->nelts; i++) {
+            if (ngx_strncmp(args[i].data, "params=", 7) == 0) {
+                ngx_str_t value;
+                value.len = args[i].len - 7;
+                value.data = args[i].data + 7;
+                if (ngx_http_graphite_parse_params(&context, &value, params) != NGX_CONF_OK)
+                    return NGX_CONF_ERROR;
+            }
+            else if (ngx_strncmp(args[i].data, "if=", 3) == 0) {
+                ngx_str_t value;
+                value.len = args[i].len - 3;
+                value.data = args[i].data + 3;
+
+                *filter = ngx_http_graphite_complex_compile(cf, &value);
+                if (!*filter)
+                    return NGX_CONF_ERROR;
+            }
+            else {
+                ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite unknown option %V", &args[i]);
+                return NGX_CONF_ERROR;
+            }
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_graphite_data(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+
+    ngx_http_graphite_context_t context = ngx_http_graphite_context_from_config(cf);
+
+    ngx_http_graphite_main_conf_t *gmcf = context.gmcf;
+    ngx_http_graphite_srv_conf_t *gscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_graphite_module);
+    ngx_http_graphite_loc_conf_t *glcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_graphite_module);
+
+    if (!gmcf->enable)
+        return NGX_CONF_OK;
+
+    /* the split and at most params, if, rollup and sample, each once */
+    if (cf->args->nelts > 6) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite too many options");
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_str_t *args = cf->args->elts;
+
+    ngx_uint_t i, j;
+    for (i = 2; i < cf->args->nelts; i++) {
+        u_char *eq = ngx_strlchr(args[i].data, args[i].data + args[i].len, '=');
+        if (eq == NULL)
+            continue;
+
+        size_t len = eq - args[i].data + 1;
+        for (j = 2; j < i; j++) {
+            if (args[j].len >= len && ngx_strncmp(args[j].data, args[i].data, len) == 0) {
+                ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite duplicate option %*s", len - 1, args[i].data);
+                return NGX_CONF_ERROR;
+            }
+        }
+    }
+
+    ngx_str_t *split = &args[1];
+    ngx_array_t *params = ngx_array_create(cf->pool, 1, sizeof(ngx_uint_t));
+    if (!params) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite can't alloc memory");
+        return NULL;
+    }
+    ngx_http_complex_value_t *filter = NULL;
+    ngx_uint_t rollup = 0;
+    ngx_uint_t sample = 1;
+
+    if (cf->args->nelts >= 3) {
+        for (i = 2; i < cf->args->nelts; i++) {
+            if (ngx_strncmp(args[i].data, "params=", 7) == 0) {
+                ngx_str_t value;
+                value.len = args[i].len - 7;
+                value.data = args[i].data + 7;
+                if (ngx_http_graphite_parse_params(&context, &value, params) != NGX_CONF_OK)
+                    return NGX_CONF_ERROR;
+            }
+            else if (ngx_strncmp(args[i].data, "if=", 3) == 0) {
+                ngx_str_t value;
+                value.len = args[i].len - 3;
+                value.data = args[i].data + 3;
+
+                filter = ngx_http_graphite_complex_compile(cf, &value);
+                if (!filter)
+                    return NGX_CONF_ERROR;
+            }
+            else if (ngx_strncmp(args[i].data, "rollup=", 7) == 0) {
+                ngx_str_t value;
+                value.len = args[i].len - 7;
+                value.data = args[i].data + 7;
+                if (ngx_http_graphite_parse_flag(&context, &value, &rollup) != NGX_CONF_OK) {
+                    ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite invalid rollup value %V", &value);
+                    return NGX_CONF_ERROR;
+                }
+
+                if (rollup && !(cf->cmd_type & (NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF))) {
+                    ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite rollup is allowed only in http and server");
+                    return NGX_CONF_ERROR;
+                }
+            }
+            else if (ngx_strncmp(args[i].data, "sample=", 7) == 0) {
+                ngx_str_t value;
+                value.len = args[i].len - 7;
+                value.data = args[i].data + 7;
+                if (ngx_http_graphite_parse_sample(&context, &value, &sample) != NGX_CONF_OK) {
+                    ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite invalid sample value %V", &value);
+                    return NGX_CONF_ERROR;
+                }
+            }
+            else {
+                ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite unknown option %V", &args[i]);
+                return NGX_CONF_ERROR;
+            }
+        }
+    }
+
+    if (rollup && filter) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite rollup can't be used with if");
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_array_t *datas;
+
+    if (cf->cmd_type & NGX_HTTP_MAIN_CONF)
+        datas = gmcf->datas;
+    else if (cf->cmd_type & NGX_HTTP_SRV_CONF)
+        datas = gscf->datas;
+    else
+        datas = glcf->datas;
+
+    if (ngx_http_graphite_add_data(cf, datas, split, params, filter, rollup, sample) != NGX_CONF_OK)
+        return NGX_CONF_ERROR;
+
+    return NGX_CONF_OK;
+}
+
+static ngx_http_graphite_internal_t *
+ngx_http_graphite_search_param(const ngx_http_graphite_hash_t *internals, const ngx_str_t *name) {
+
+    return ngx_http_graphite_hash_find(internals, name);
+}
+
+static ngx_http_graphite_internal_t *
+ngx_http_graphite_link2int(const ngx_http_graphite_link_t *link) {
+
+    return (ngx_http_graphite_internal_t*)link;
+}
+
+static const ngx_http_graphite_link_t *
+ngx_http_graphite_int2link(ngx_http_graphite_internal_t *internal) {
+
+    return (const ngx_http_graphite_link_t*)internal;
+}
+
+static const ngx_http_graphite_link_t *
+ngx_http_graphite_search_param_link(const ngx_http_graphite_hash_t *internals, const ngx_str_t *name) {
+
+    ngx_http_graphite_internal_t *internal;
+
+    internal = ngx_http_graphite_search_param(internals, name);
+    return ngx_http_graphite_int2link(internal);
+}
+
+static void
+ngx_http_graphite_clear_param_args(ngx_http_graphite_context_t *context, ngx_http_graphite_param_t *param) {
+
+    ngx_http_graphite_allocator_t *allocator = context->storage->allocator;
+
+    ngx_http_graphite_allocator_free(allocator, param->name.data);
+    ngx_http_graphite_allocator_free(allocator, param->interval.name.data);
+    ngx_http_graphite_array_destroy(param->percentiles);
+}
+
+static ngx_int_t
+ngx_http_graphite_parse_param_args(ngx_http_graphite_context_t *context, const ngx_array_t *args, ngx_http_graphite_param_t *param) {
+
+    ngx_http_graphite_allocator_t *allocator = context->storage->allocator;
+
+    ngx_memzero(param, sizeof(ngx_http_graphite_param_t));
+
+    param->percentiles = ngx_http_graphite_array_create(allocator, 1, sizeof(ngx_uint_t));
+    if (!param->percentiles) {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+        return NGX_ERROR;
+    }
+
+    ngx_int_t r = NGX_OK;
+
+    if (ngx_http_graphite_parse_args(context, args, param, ngx_http_graphite_param_args, PARAM_ARGS_COUNT) == NGX_CONF_ERROR)
+        r = NGX_ERROR;
+
+    param->source = SOURCE_INTERNAL;
+
+    if (r == NGX_OK && !param->name.data) {
+        r = NGX_ERROR;
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite param name not set");
+    }
+
+    if (r == NGX_OK && (param->aggregate && param->aggregate != ngx_http_graphite_aggregate_gauge && !param->interval.value)) {
+        r = NGX_ERROR;
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite param must contain interval with aggregate avg, persec or sum");
+    }
+
+    if (r == NGX_OK && ((!param->aggregate || param->aggregate == ngx_http_graphite_aggregate_gauge) && param->interval.value)) {
+        r = NGX_ERROR;
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite param must contain aggregate avg, persec or sum with interval or aggregate gauge");
+    }
+
+    if (r == NGX_OK && (param->aggregate == ngx_http_graphite_aggregate_gauge && param->percentiles->nelts != 0)) {
+        r = NGX_ERROR;
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite param must contain aggregate gauge or percentile only");
+    }
+
+    if (r == NGX_OK && (!param->aggregate && !param->interval.value && param->percentiles->nelts == 0)) {
+        r = NGX_ERROR;
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite param must contain aggregate avg, perse or sum and interval, aggregate gauge or percentile");
+    }
+
+    if (r == NGX_OK && (param->interval.value > context->storage->max_interval)) {
+        r = NGX_ERROR;
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite param interval value is greather than max interval");
+    }
+
+    if (r != NGX_OK)
+        ngx_http_graphite_clear_param_args(context, param);
+
+    return r;
+}
+
+static ngx_http_graphite_internal_t *
+ngx_http_graphite_add_internal(ngx_http_graphite_context_t *context, const ngx_http_graphite_param_t *param) {
+
+    ngx_http_graphite_storage_t *storage = context->storage;
+
+    ngx_http_graphite_internal_t *internal;
+    internal = ngx_http_graphite_search_param(storage->internals, &param->name);
+
+    ngx_http_graphite_data_t data;
+    if (internal == NULL) {
+        if (ngx_http_graphite_init_data(context, &data) == NGX_ERROR)
+            return NULL;
+        if (param->sample)
+            data.sample = param->sample;
+    }
+    else
+        data = internal->data;
+
+    ngx_http_graphite_param_t new_param = *param;
+
+    size_t n;
+    for (n = 0; n < param->percentiles->nelts + 1; n++) {
+        if (n == 0) {
+            if (!new_param.aggregate)
+                continue;
+        }
+        else
+            new_param.percentile = ((ngx_uint_t*)new_param.percentiles->elts)[n - 1];
+
+        ngx_uint_t created;
+        ngx_uint_t p = ngx_http_graphite_add_param_to_config(context, &new_param, &created);
+        if ((ngx_int_t)p == NGX_ERROR)
+            return NULL;
+
+        if (created && ngx_http_graphite_add_param_to_data(context, SPLIT_INTERNAL, p, &data) != NGX_CONF_OK)
+            return NULL;
+    }
+
+    if (internal == NULL) {
+        ngx_http_graphite_allocator_t *allocator = storage->allocator;
+
+        if ((internal = ngx_http_graphite_allocator_alloc(allocator, sizeof(*internal))) == NULL) {
+            ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+            return NULL;
+        }
+
+        internal->name = param->name;
+        internal->data = data;
+
+        /* the internal is published to lock-free readers here, so it must be complete */
+        if (ngx_http_graphite_hash_add(storage->internals, &internal->name, internal) != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+            ngx_http_graphite_allocator_free(allocator, internal);
+            return NULL;
+        }
+    }
+
+    return internal;
+}
+
+static char *
+ngx_http_graphite_param(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+
+    ngx_http_graphite_context_t context = ngx_http_graphite_context_from_config(cf);
+
+    ngx_http_graphite_main_conf_t *gmcf = context.gmcf;
+
+    if (!gmcf->enable)
+        return NGX_CONF_OK;
+
+    ngx_http_graphite_param_t param;
+    if (ngx_http_graphite_parse_param_args(&context, cf->args, &param) != NGX_OK)
+        return NGX_CONF_ERROR;
+
+    if (ngx_http_graphite_add_internal(&context, &param) == NULL)
+        return NGX_CONF_ERROR;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_graphite_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+
+    ngx_http_core_loc_conf_t *clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_graphite_status_handler;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_graphite_config_arg_prefix(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+
+    ngx_http_graphite_main_conf_t *gmcf = data;
+    return ngx_http_graphite_parse_string(context, value, &gmcf->prefix);
+}
+
+static char *
+ngx_http_graphite_config_arg_host(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+
+    ngx_http_graphite_main_conf_t *gmcf = data;
+    return ngx_http_graphite_parse_string(context, value, &gmcf->host);
+}
+
+static char *
+ngx_http_graphite_config_arg_protocol(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+
+    ngx_http_graphite_main_conf_t *gmcf = data;
+    return ngx_http_graphite_parse_string(context, value, &gmcf->protocol);
+}
+
+static char *
+ngx_http_graphite_config_arg_timeout(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+
+    ngx_http_graphite_main_conf_t *gmcf = data;
+    gmcf->timeout = ngx_atoi(value->data, value->len) * 1000;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_graphite_config_arg_idle(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+
+    ngx_http_graphite_main_conf_t *gmcf = data;
+
+    if (value->len == 4 && ngx_strncmp(value->data, "send", 4) == 0)
+        gmcf->idle = IDLE_SEND;
+    else if (value->len == 4 && ngx_strncmp(value->data, "skip", 4) == 0)
+        gmcf->idle = IDLE_SKIP;
+    else if (value->len == 5 && ngx_strncmp(value->data, "trail", 5) == 0)
+        gmcf->idle = IDLE_TRAIL;
+    else {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite config idle must be send, skip or trail");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_graphite_config_arg_percentile_mode(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+
+    ngx_http_graphite_main_conf_t *gmcf = data;
+
+    if (value->len == 2 && ngx_strncmp(value->data, "p2", 2) == 0)
+        gmcf->percentile_mode = PERCENTILE_P2;
+    else if (value->len == 9 && ngx_strncmp(value->data, "reservoir", 9) == 0)
+        gmcf->percentile_mode = PERCENTILE_RESERVOIR;
+    else {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite config percentile_mode must be p2 or reservoir");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_graphite_config_arg_budget(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+
+    ngx_http_graphite_main_conf_t *gmcf = data;
+
+    ngx_int_t budget = ngx_atoi(value->data, value->len);
+    if (budget == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite config invalid budget %V", value);
+        return NGX_CONF_ERROR;
+    }
+
+    gmcf->budget = budget;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_graphite_config_arg_heartbeat(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+
+    ngx_http_graphite_main_conf_t *gmcf = data;
+
+    if (ngx_http_graphite_parse_time(context, value, &gmcf->heartbeat) == NGX_CONF_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite config invalid heartbeat %V", value);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+#ifdef NGX_LOG_LIMIT_ENABLED
+static char *
+ngx_http_graphite_config_arg_error_log(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+
+    ngx_http_graphite_main_conf_t *gmcf = data;
+    return ngx_http_graphite_parse_string(context, value, &gmcf->error_log);
+}
+#endif
+
+static char *
+ngx_http_graphite_config_arg_server(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+
+    ngx_http_graphite_main_conf_t *gmcf = data;
+    return ngx_http_graphite_parse_string(context, value, &gmcf->server.name);
+}
+
+static char *
+ngx_http_graphite_config_arg_port(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+
+    ngx_http_graphite_main_conf_t *gmcf = data;
+    gmcf->port = ngx_atoi(value->data, value->len);
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_graphite_config_arg_frequency(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+
+    ngx_http_graphite_main_conf_t *gmcf = data;
+    gmcf->frequency = ngx_atoi(value->data, value->len) * 1000;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_graphite_config_arg_intervals(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+
+    ngx_http_graphite_main_conf_t *gmcf = data;
+    ngx_http_graphite_allocator_t *allocator = context->storage->allocator;
+
+    ngx_uint_t i;
+    ngx_uint_t s = 0;
+    for (i = 0; i <= value->len; i++) {
+
+        if (i == value->len || value->data[i] == '|') {
+
+            if (i == s) {
+                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite config intervals is empty");
+                return NGX_CONF_ERROR;
+            }
+
+            ngx_http_graphite_interval_t *interval = ngx_array_push(gmcf->intervals);
+            if (!interval) {
+                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+                return NGX_CONF_ERROR;
+            }
+
+            interval->name.data = ngx_http_graphite_allocator_alloc(allocator, i - s);
+            if (!interval->name.data) {
+                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+                return NGX_CONF_ERROR;
+            }
+
+            ngx_memcpy(interval->name.data, &value->data[s], i - s);
+            interval->name.len = i - s;
+
+            if (ngx_http_graphite_parse_time(context, &interval->name, &interval->value) == NGX_CONF_ERROR) {
+                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite config interval is invalid");
+                return NGX_CONF_ERROR;
+            }
+
+            if (interval->value > gmcf->storage->max_interval)
+                gmcf->storage->max_interval = interval->value;
+
+            s = i + 1;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_graphite_config_arg_params(ngx_http_graphite_context_t *context, void *conf, ngx_str_t *value) {
+
+    ngx_http_graphite_main_conf_t *gmcf = conf;
+    return ngx_http_graphite_parse_params(context, value, gmcf->default_params);
+}
+
+static char *
+ngx_http_graphite_config_arg_shared(ngx_http_graphite_context_t *context, void *conf, ngx_str_t *value) {
+
+    ngx_http_graphite_main_conf_t *gmcf = conf;
+    return ngx_http_graphite_parse_size(context, value, &gmcf->shared_size);
+}
+
+static char *
+ngx_http_graphite_config_arg_buffer(ngx_http_graphite_context_t *context, void *conf, ngx_str_t *value) {
+
+    ngx_http_graphite_main_conf_t *gmcf = conf;
+    return ngx_http_graphite_parse_size(context, value, &gmcf->buffer_size);
+}
+
+static char *
+ngx_http_graphite_config_arg_self(ngx_http_graphite_context_t *context, void *conf, ngx_str_t *value) {
+
+    ngx_http_graphite_main_conf_t *gmcf = conf;
+    return ngx_http_graphite_parse_flag(context, value, &gmcf->self);
+}
+
+static char *
+ngx_http_graphite_config_arg_lock_profiling(ngx_http_graphite_context_t *context, void *conf, ngx_str_t *value) {
+
+    ngx_http_graphite_main_conf_t *gmcf = conf;
+    return ngx_http_graphite_parse_flag(context, value, &gmcf->lock_profiling);
+}
+
+static char *
+ngx_http_graphite_config_arg_package(ngx_http_graphite_context_t *context, void *conf, ngx_str_t *value) {
+
+    ngx_http_graphite_main_conf_t *gmcf = conf;
+    return ngx_http_graphite_parse_size(context, value, &gmcf->package_size);
+}
+
+static char *
+ngx_http_graphite_config_arg_template(ngx_http_graphite_context_t *context, void *conf, ngx_str_t *value) {
+
+    ngx_http_graphite_main_conf_t *gmcf = conf;
+    return ngx_http_graphite_template_compile(context, gmcf->template, ngx_http_graphite_template_args, TEMPLATE_ARG_COUNT, value);
+}
+
+static char *
+ngx_http_graphite_param_arg_name(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+
+    ngx_http_graphite_allocator_t *allocator = context->storage->allocator;
+    ngx_http_graphite_param_t *param = (ngx_http_graphite_param_t*)data;
+
+    param->name.data = ngx_http_graphite_allocator_alloc(allocator, value->len);
+    if (!param->name.data) {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+        return NGX_CONF_ERROR;
+    }
+    ngx_memcpy(param->name.data, value->data, value->len);
+    param->name.len = value->len;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_graphite_param_arg_aggregate(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+
+    ngx_http_graphite_param_t *param = (ngx_http_graphite_param_t*)data;
+
+    ngx_uint_t found = 0;
+    ngx_uint_t a;
+    for (a = 0; a < AGGREGATE_COUNT; a++) {
+        if ((ngx_http_graphite_aggregates[a].name.len == value->len) && !ngx_strncmp(ngx_http_graphite_aggregates[a].name.data, value->data, value->len)) {
+            found = 1;
+            param->aggregate = ngx_http_graphite_aggregates[a].get;
+        }
+    }
+
+    if (!found) {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite param unknow aggregate %V", value);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_graphite_param_arg_interval(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+
+    ngx_http_graphite_allocator_t *allocator = context->storage->allocator;
+    ngx_http_graphite_param_t *param = (ngx_http_graphite_param_t*)data;
+    ngx_http_graphite_interval_t *interval = &param->interval;
+
+    interval->name.data = ngx_http_graphite_allocator_alloc(allocator, value->len);
+    if (!interval->name.data) {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memcpy(interval->name.data, value->data, value->len);
+    interval->name.len = value->len;
+
+    if (ngx_http_graphite_parse_time(context, value, &interval->value) == NGX_CONF_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite param interval is invalid");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_graphite_param_arg_sample(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+
+    ngx_http_graphite_param_t *param = (ngx_http_graphite_param_t*)data;
+
+    if (ngx_http_graphite_parse_sample(context, value, &param->sample) == NGX_CONF_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite param sample is invalid");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_graphite_param_arg_percentile(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+
+    ngx_http_graphite_param_t *param = (ngx_http_graphite_param_t*)data;
+
+    ngx_uint_t i;
+    ngx_uint_t s = 0;
+    for (i = 0; i <= value->len; i++) {
+
+        if (i == value->len || value->data[i] == '|') {
+
+            if (i == s) {
+                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite param percentile is empty");
+                return NGX_CONF_ERROR;
+            }
+
+            ngx_int_t p = ngx_atofp(&value->data[s], i - s, 3);
+            if (p == NGX_ERROR || p <= 0 || p > 100000) {
+                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite param percentile is invalid");
+                return NGX_CONF_ERROR;
+            }
+
+            ngx_uint_t *percentile = ngx_http_graphite_array_push(param->percentiles);
+            if (!percentile) {
+                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+                return NGX_CONF_ERROR;
+            }
+            *percentile = p;
+
+
+            s = i + 1;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+static ngx_uint_t
+ngx_http_graphite_add_split(ngx_conf_t *cf, const ngx_str_t *name) {
+
+    ngx_http_graphite_main_conf_t *gmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_graphite_module);
+
+    ngx_array_t *splits = gmcf->splits;
+
+    ngx_uint_t s = SPLIT_EMPTY;
+
+    ngx_uint_t i = 0;
+    for (i = 0; i < splits->nelts; i++) {
+        ngx_str_t *split = &((ngx_str_t*)splits->elts)[i];
+        if ((split->len == name->len) && !ngx_strncmp(split->data, name->data, name->len)) {
+            s = i;
+            break;
+        }
+    }
+
+    if (s == SPLIT_EMPTY) {
+
+        s = splits->nelts;
+
+        ngx_str_t *split = ngx_array_push(splits);
+        if (!split) {
+            ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite can't alloc memory");
+            return SPLIT_EMPTY;
+        }
+
+        split->data = ngx_pstrdup(cf->pool, (ngx_str_t*)name);
+        if (!split->data) {
+            ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite can't alloc memory");
+            return SPLIT_EMPTY;
+        }
+
+        split->len = name->len;
+    }
+
+    return s;
+}
+
+static char *
+ngx_http_graphite_add_default_data(ngx_conf_t *cf, ngx_array_t *datas, const ngx_str_t *location, const ngx_str_t *server_name, const ngx_array_t *template, const ngx_array_t *params, const ngx_http_complex_value_t *filter) {
+
+    if (template->nelts == 0)
+        return NGX_CONF_OK;
+
+    const ngx_str_t *variables[] = DEFAULT_DATA_VARIABLES(location, server_name);
+
+    ngx_str_t split;
+    split.len = ngx_http_graphite_template_len(template, variables);
+    if (split.len == 0)
+        return NGX_CONF_ERROR;
+
+    split.data = ngx_palloc(cf->pool, split.len);
+    if (!split.data)
+        return NGX_CONF_ERROR;
+
+    ngx_http_graphite_template_execute(split.data, split.len, template, variables);
+
+    return ngx_http_graphite_add_data(cf, datas, &split, params, filter, 0, 1);
+}
+
+static char *
+ngx_http_graphite_add_data(ngx_conf_t *cf, ngx_array_t *datas, const ngx_str_t *split, const ngx_array_t *params, const ngx_http_complex_value_t *filter, ngx_uint_t rollup, ngx_uint_t sample) {
+
+    ngx_http_graphite_context_t context = ngx_http_graphite_context_from_config(cf);
+    ngx_http_graphite_main_conf_t *gmcf = context.gmcf;
+
+    ngx_uint_t s = ngx_http_graphite_add_split(cf, split);
+    if (s == SPLIT_EMPTY)
+        return NGX_CONF_ERROR;
+
+    ngx_http_graphite_data_t *data = ngx_array_push(datas);
+    if (!data) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite can't alloc memory");
+        return NGX_CONF_ERROR;
+    }
+    if (ngx_http_graphite_init_data(&context, data) == NGX_ERROR)
+        return NGX_CONF_ERROR;
+
+    ngx_http_graphite_array_t **statistics = ngx_array_push(gmcf->data_statistics);
+    if (!statistics) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite can't alloc memory");
+        return NGX_CONF_ERROR;
+    }
+    *statistics = data->statistics;
+
+    if (params->nelts == 0)
+        params = gmcf->default_params;
+
+    ngx_uint_t i;
+    for (i = 0; i < params->nelts; i++) {
+        ngx_uint_t p = ((ngx_uint_t*)params->elts)[i];
+        ngx_http_graphite_param_t *param = &((ngx_http_graphite_param_t*)gmcf->storage->params->elts)[p];
+
+        if (param->source != SOURCE_INTERNAL) {
+            ngx_http_graphite_source_t *source = &((ngx_http_graphite_source_t*)gmcf->sources->elts)[param->source];
+
+            if (source->type != 0) {
+                if ((cf->cmd_type & NGX_HTTP_MAIN_CONF) && !(source->type & NGX_HTTP_MAIN_CONF))
+                    continue;
+                if ((cf->cmd_type & NGX_HTTP_SRV_CONF) && !(source->type & NGX_HTTP_SRV_CONF))
+                    continue;
+                if ((cf->cmd_type & NGX_HTTP_LOC_CONF) && !(source->type & NGX_HTTP_LOC_CONF))
+                    continue;
+            }
+        }
+        ngx_http_graphite_add_param_to_data(&context, s, p, data);
+    }
+
+    data->filter = (ngx_http_complex_value_t*)filter;
+    data->rollup = rollup;
+    data->sample = sample;
+
+    return NGX_CONF_OK;
+}
+
+static ngx_uint_t
+ngx_http_graphite_get_source(ngx_http_graphite_context_t *context, ngx_str_t *name) {
+
+    if (context->phase != PHASE_CONFIG)
+        return NGX_ERROR;
+
+    ngx_http_graphite_main_conf_t *gmcf = context->gmcf;
+
+    ngx_uint_t c;
+    for (c = 0; c < gmcf->sources->nelts; c++) {
+        ngx_http_graphite_source_t *source = &((ngx_http_graphite_source_t*)gmcf->sources->elts)[c];
+        if ((source->name.len == name->len) && !ngx_strncmp(source->name.data, name->data, name->len))
+            return c;
+    }
+
+    for (c = 0; c < SOURCE_COUNT; c++) {
+        const ngx_http_graphite_source_t *source = &ngx_http_graphite_sources[c];
+        if (!source->re) {
+            if ((source->name.len == name->len) && !ngx_strncmp(source->name.data, name->data, name->len)) {
+                break;
+            }
+        }
+        else {
+            ngx_regex_compile_t rc;
+            ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
+            rc.pool = context->pool;
+            rc.pattern = source->name;
+            if (ngx_regex_compile(&rc) != NGX_OK) {
+                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't compile regex");
+                return NGX_ERROR;
+            }
+
+            if (ngx_regex_exec(rc.regex, (ngx_str_t*)name, NULL, 0) >= 0)
+                break;
+        }
+    }
+
+    if (c == SOURCE_COUNT) {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite unknow param %*s", name->len, name->data);
+        return NGX_ERROR;
+    }
+
+    ngx_http_graphite_source_t *new_source = ngx_array_push(gmcf->sources);
+    if (!new_source) {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+        return NGX_ERROR;
+    }
+    *new_source = ngx_http_graphite_sources[c];
+    new_source->name = *name;
+
+    if (new_source->init && new_source->init(new_source) != NGX_OK) {
+        gmcf->sources->nelts--;
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite unknow param %*s", name->len, name->data);
+        return NGX_ERROR;
+    }
+
+    return gmcf->sources->nelts - 1;
+}
+
+static ngx_http_graphite_param_t
+ngx_http_graphite_create_param(ngx_http_graphite_context_t *context, ngx_uint_t c) {
+
+    ngx_http_graphite_main_conf_t *gmcf = context->gmcf;
+
+    ngx_http_graphite_source_t *source = &((ngx_http_graphite_source_t*)gmcf->sources->elts)[c];
+
+    ngx_http_graphite_param_t param;
+    ngx_memzero(&param, sizeof(ngx_http_graphite_param_t));
+
+    param.name = source->name;
+    param.source = c;
+    param.aggregate = source->aggregate;
+
+    return param;
+}
+
+/*
+ * Sources made by param options are copies of a plain source named
+ * <source><suffix>. Returns the index of the source; created is set only
+ * for a new one, which the caller completes.
+ */
+static ngx_uint_t
+ngx_http_graphite_derive_source(ngx_http_graphite_context_t *context, ngx_uint_t base, const ngx_str_t *suffix, ngx_http_graphite_source_t **created) {
+
+    ngx_http_graphite_main_conf_t *gmcf = context->gmcf;
+    const ngx_str_t *base_name = &((ngx_http_graphite_source_t*)gmcf->sources->elts)[base].name;
+
+    *created = NULL;
+
+    ngx_str_t name;
+    name.len = base_name->len + suffix->len;
+    name.data = ngx_http_graphite_allocator_alloc(context->storage->allocator, name.len);
+    if (name.data == NULL) {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+        return NGX_ERROR;
+    }
+    ngx_sprintf(name.data, "%V%V", base_name, suffix);
+
+    ngx_uint_t c;
+    for (c = 0; c < gmcf->sources->nelts; c++) {
+        const ngx_http_graphite_source_t *source = &((ngx_http_graphite_source_t*)gmcf->sources->elts)[c];
+        if (source->name.len == name.len && !ngx_strncmp(source->name.data, name.data, name.len)) {
+            ngx_http_graphite_allocator_free(context->storage->allocator, name.data);
+            return c;
+        }
+    }
+
+    ngx_http_graphite_source_t *source = ngx_array_push(gmcf->sources);
+    if (source == NULL) {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+        return NGX_ERROR;
+    }
+
+    /* the base may move when the array grows */
+    *source = ((ngx_http_graphite_source_t*)gmcf->sources->elts)[base];
+    source->name = name;
+    source->re = 0;
+    source->init = NULL;
+    source->integral = 0;
+
+    *created = source;
+
+    return c;
+}
+
+/*
+ * request_time:buckets=50,100,250 makes the request_time_le_xxx vector
+ * source, bounds are separated by commas as | separates the params.
+ */
+static char *
+ngx_http_graphite_param_buckets(ngx_http_graphite_context_t *context, ngx_http_graphite_param_t *param, const ngx_str_t *value) {
+
+    ngx_http_graphite_main_conf_t *gmcf = context->gmcf;
+
+    ngx_uint_t bounds[VECTOR_MAX_CELLS];
+    ngx_uint_t nbounds = 0;
+
+    u_char *p = value->data;
+    u_char *end = value->data + value->len;
+    while (p <= end) {
+        u_char *comma = ngx_strlchr(p, end, ',');
+        if (comma == NULL)
+            comma = end;
+
+        ngx_int_t bound = ngx_atoi(p, comma - p);
+        if (bound == NGX_ERROR || nbounds == VECTOR_MAX_CELLS - 1 || (nbounds > 0 && (ngx_uint_t)bound <= bounds[nbounds - 1])) {
+            ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite bad buckets %V", value);
+            return NGX_CONF_ERROR;
+        }
+
+        bounds[nbounds++] = bound;
+        p = comma + 1;
+    }
+
+    ngx_str_t suffix = ngx_string("_le_xxx");
+    ngx_http_graphite_source_t *source;
+
+    ngx_uint_t c = ngx_http_graphite_derive_source(context, param->source, &suffix, &source);
+    if ((ngx_int_t)c == NGX_ERROR)
+        return NGX_CONF_ERROR;
+
+    if (source == NULL) {
+        source = &((ngx_http_graphite_source_t*)gmcf->sources->elts)[c];
+        if (source->cells != nbounds + 1 || ngx_memcmp(source->bounds, bounds, sizeof(ngx_uint_t) * nbounds) != 0) {
+            ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite param %V with different buckets", &source->name);
+            return NGX_CONF_ERROR;
+        }
+    }
+    else {
+        ngx_uint_t *copy = ngx_http_graphite_allocator_alloc(context->storage->allocator, sizeof(ngx_uint_t) * nbounds);
+        if (copy == NULL) {
+            gmcf->sources->nelts--;
+            ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+            return NGX_CONF_ERROR;
+        }
 
-        size_t host_size = strlen(host);
+        ngx_memcpy(copy, bounds, sizeof(ngx_uint_t) * nbounds);
 
-        gmcf->host.data = ngx_palloc(cf->pool, host_size);
-        if (!gmcf->host.data) {
-            ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite can't alloc memory");
+        source->cells = nbounds + 1;
+        source->label = ngx_http_graphite_buckets_label;
+        source->aggregate = ngx_http_graphite_aggregate_sum;
+        source->cumulative = 1;
+        source->bounds = copy;
+    }
+
+    *param = ngx_http_graphite_create_param(context, c);
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * rps:ewma=5m makes the rps_ewma param sent as rps_ewma_5m, its window
+ * takes the place of the interval. The moving average is folded at flush
+ * from the seconds of the storage planes, so it needs no ring of its own.
+ */
+static char *
+ngx_http_graphite_param_ewma(ngx_http_graphite_context_t *context, ngx_http_graphite_param_t *param, ngx_str_t *window) {
+
+    ngx_http_graphite_main_conf_t *gmcf = context->gmcf;
+    const ngx_http_graphite_source_t *source = &((ngx_http_graphite_source_t*)gmcf->sources->elts)[param->source];
+
+    if (context->cf == NULL) {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite ewma is allowed only in config");
+        return NGX_CONF_ERROR;
+    }
+
+    if (source->aggregate == ngx_http_graphite_aggregate_gauge) {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite ewma of gauge %V", &source->name);
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_http_graphite_interval_t *ewma = &param->ewma;
+
+    if (ngx_http_graphite_parse_time(context, window, &ewma->value) == NGX_CONF_ERROR || ewma->value == 0) {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite bad ewma %V", window);
+        return NGX_CONF_ERROR;
+    }
+
+    ewma->name.data = ngx_http_graphite_allocator_alloc(context->storage->allocator, window->len);
+    u_char *name = ngx_http_graphite_allocator_alloc(context->storage->allocator, source->name.len + sizeof("_ewma") - 1);
+    if (ewma->name.data == NULL || name == NULL) {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memcpy(ewma->name.data, window->data, window->len);
+    ewma->name.len = window->len;
+
+    param->name.len = ngx_sprintf(name, "%V_ewma", &source->name) - name;
+    param->name.data = name;
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * request_time:topk=$uri,10 makes the request_time_topk_uri source,
+ * the values of the variable with the largest sums of the plain source.
+ */
+static char *
+ngx_http_graphite_param_topk(ngx_http_graphite_context_t *context, ngx_http_graphite_param_t *param, ngx_str_t *variable) {
+
+    ngx_http_graphite_main_conf_t *gmcf = context->gmcf;
+
+    if (context->cf == NULL) {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite topk is allowed only in config");
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_int_t topk = TOPK_DEFAULT;
+
+    u_char *comma = ngx_strlchr(variable->data, variable->data + variable->len, ',');
+    if (comma != NULL) {
+        topk = ngx_atoi(comma + 1, variable->data + variable->len - comma - 1);
+        if (topk == NGX_ERROR || topk == 0 || topk > TOPK_COUNTERS) {
+            ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite bad topk size %V", variable);
             return NGX_CONF_ERROR;
         }
+        variable->len = comma - variable->data;
+    }
 
-        ngx_memcpy(gmcf->host.data, host, host_size);
-        gmcf->host.len = host_size;
+    if (variable->len + sizeof("_topk_") > VECTOR_MAX_NAME) {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite too long topk variable %V", variable);
+        return NGX_CONF_ERROR;
     }
 
-    if (gmcf->server.name.len == 0) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite config server not set");
+    ngx_int_t index = ngx_http_get_variable_index(context->cf, variable);
+    if (index == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite bad topk variable %V", variable);
         return NGX_CONF_ERROR;
     }
-    if (gmcf->protocol.len == 0) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite config protocol is not specified");
+
+    u_char buffer[VECTOR_MAX_NAME];
+    ngx_str_t suffix;
+    suffix.data = buffer;
+    suffix.len = ngx_snprintf(buffer, sizeof(buffer), "_topk_%V", variable) - buffer;
+
+    ngx_http_graphite_source_t *source;
+
+    ngx_uint_t c = ngx_http_graphite_derive_source(context, param->source, &suffix, &source);
+    if ((ngx_int_t)c == NGX_ERROR)
         return NGX_CONF_ERROR;
+
+    if (source == NULL) {
+        source = &((ngx_http_graphite_source_t*)gmcf->sources->elts)[c];
+        if (source->topk != (ngx_uint_t)topk) {
+            ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite param %V with different topk", &source->name);
+            return NGX_CONF_ERROR;
+        }
     }
-    else if (ngx_strncmp(gmcf->protocol.data, "udp", 3) != 0 && ngx_strncmp(gmcf->protocol.data, "tcp", 3) != 0) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite config invalid protocol");
+    else {
+        source->base = source->get;
+        source->cells = TOPK_CELLS;
+        source->add = ngx_http_graphite_source_topk;
+        source->aggregate = ngx_http_graphite_aggregate_sum;
+        source->topk = topk;
+        source->variable = index;
+    }
+
+    *param = ngx_http_graphite_create_param(context, c);
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * rps:unique=$binary_remote_addr makes the rps_unique_binary_remote_addr
+ * source, the number of distinct values of the variable among the
+ * requests counted by the plain source.
+ */
+static char *
+ngx_http_graphite_param_unique(ngx_http_graphite_context_t *context, ngx_http_graphite_param_t *param, ngx_str_t *variable) {
+
+    if (context->cf == NULL) {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite unique is allowed only in config");
         return NGX_CONF_ERROR;
     }
 
-    if (gmcf->port < 1 || gmcf->port > 65535) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite config port must be in range form 1 to 65535");
+    if (variable->len + sizeof("_unique_") > VECTOR_MAX_NAME) {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite too long unique variable %V", variable);
         return NGX_CONF_ERROR;
     }
 
-    if (gmcf->frequency < 1 || gmcf->frequency > 65535) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite config frequency must be in range form 1 to 65535");
+    ngx_int_t index = ngx_http_get_variable_index(context->cf, variable);
+    if (index == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite bad unique variable %V", variable);
         return NGX_CONF_ERROR;
     }
 
-    if (gmcf->intervals->nelts == 0) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite config intervals not set");
+    u_char buffer[VECTOR_MAX_NAME];
+    ngx_str_t suffix;
+    suffix.data = buffer;
+    suffix.len = ngx_snprintf(buffer, sizeof(buffer), "_unique_%V", variable) - buffer;
+
+    ngx_http_graphite_source_t *source;
+
+    ngx_uint_t c = ngx_http_graphite_derive_source(context, param->source, &suffix, &source);
+    if ((ngx_int_t)c == NGX_ERROR)
         return NGX_CONF_ERROR;
+
+    if (source != NULL) {
+        /* counters like rps and response_2xx_rps are the ones summed per second */
+        source->counter = (source->aggregate == ngx_http_graphite_aggregate_persec);
+        source->base = source->get;
+        source->cells = UNIQUE_CELLS;
+        source->add = ngx_http_graphite_source_unique;
+        source->aggregate = ngx_http_graphite_aggregate_sum;
+        source->unique = 1;
+        source->variable = index;
     }
 
-    if (gmcf->default_params->nelts == 0) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite config params not set");
+    *param = ngx_http_graphite_create_param(context, c);
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * request_time:apdex=500 makes the request_time_apdex source. It returns 2
+ * for a satisfied request (value not greater than T), 1 for a tolerating
+ * one (not greater than 4T) and 0 otherwise, so the score is one integral
+ * sum divided by the doubled count.
+ */
+static char *
+ngx_http_graphite_param_apdex(ngx_http_graphite_context_t *context, ngx_http_graphite_param_t *param, const ngx_str_t *value) {
+
+    ngx_http_graphite_main_conf_t *gmcf = context->gmcf;
+
+    ngx_int_t threshold = ngx_atoi(value->data, value->len);
+    if (threshold == NGX_ERROR || threshold == 0) {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite bad apdex %V", value);
         return NGX_CONF_ERROR;
     }
 
-    if (gmcf->shared_size == 0 || gmcf->buffer_size == 0) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite config shared must be positive value");
+    ngx_str_t suffix = ngx_string("_apdex");
+    ngx_http_graphite_source_t *source;
+
+    ngx_uint_t c = ngx_http_graphite_derive_source(context, param->source, &suffix, &source);
+    if ((ngx_int_t)c == NGX_ERROR)
         return NGX_CONF_ERROR;
+
+    if (source == NULL) {
+        source = &((ngx_http_graphite_source_t*)gmcf->sources->elts)[c];
+        if (source->threshold != (ngx_uint_t)threshold) {
+            ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite param %V with different apdex", &source->name);
+            return NGX_CONF_ERROR;
+        }
+    }
+    else {
+        source->base = source->get;
+        source->get = ngx_http_graphite_source_apdex;
+        source->aggregate = ngx_http_graphite_aggregate_apdex;
+        source->integral = 1;
+        source->threshold = threshold;
     }
 
-    if (gmcf->buffer_size == 0) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite config buffer must be positive value");
+    *param = ngx_http_graphite_create_param(context, c);
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * A param of the list may be followed by an option, like request_time:max.
+ * The option makes a param of its own, named <source>_<option>.
+ */
+static char *
+ngx_http_graphite_param_option(ngx_http_graphite_context_t *context, ngx_http_graphite_param_t *param, const ngx_str_t *option) {
+
+    ngx_http_graphite_main_conf_t *gmcf = context->gmcf;
+    const ngx_http_graphite_source_t *source = &((ngx_http_graphite_source_t*)gmcf->sources->elts)[param->source];
+
+    if (source->cells != 0)
+        return NGX_CONF_ERROR;
+
+    if (option->len > sizeof("buckets=") - 1 && ngx_strncmp(option->data, "buckets=", sizeof("buckets=") - 1) == 0) {
+        ngx_str_t bounds;
+        bounds.data = option->data + sizeof("buckets=") - 1;
+        bounds.len = option->len - (sizeof("buckets=") - 1);
+        return ngx_http_graphite_param_buckets(context, param, &bounds);
+    }
+
+    if (option->len > sizeof("topk=$") - 1 && ngx_strncmp(option->data, "topk=$", sizeof("topk=$") - 1) == 0) {
+        ngx_str_t variable;
+        variable.data = option->data + sizeof("topk=$") - 1;
+        variable.len = option->len - (sizeof("topk=$") - 1);
+        return ngx_http_graphite_param_topk(context, param, &variable);
+    }
+
+    if (option->len > sizeof("unique=$") - 1 && ngx_strncmp(option->data, "unique=$", sizeof("unique=$") - 1) == 0) {
+        ngx_str_t variable;
+        variable.data = option->data + sizeof("unique=$") - 1;
+        variable.len = option->len - (sizeof("unique=$") - 1);
+        return ngx_http_graphite_param_unique(context, param, &variable);
+    }
+
+    if (option->len > sizeof("ewma=") - 1 && ngx_strncmp(option->data, "ewma=", sizeof("ewma=") - 1) == 0) {
+        ngx_str_t window;
+        window.data = option->data + sizeof("ewma=") - 1;
+        window.len = option->len - (sizeof("ewma=") - 1);
+        return ngx_http_graphite_param_ewma(context, param, &window);
+    }
+
+    if (option->len > sizeof("apdex=") - 1 && ngx_strncmp(option->data, "apdex=", sizeof("apdex=") - 1) == 0) {
+        ngx_str_t threshold;
+        threshold.data = option->data + sizeof("apdex=") - 1;
+        threshold.len = option->len - (sizeof("apdex=") - 1);
+        return ngx_http_graphite_param_apdex(context, param, &threshold);
+    }
+
+    ngx_uint_t a;
+    for (a = 0; a < AGGREGATE_COUNT; a++) {
+        if ((ngx_http_graphite_aggregates[a].name.len == option->len) && !ngx_strncmp(ngx_http_graphite_aggregates[a].name.data, option->data, option->len))
+            break;
+    }
+
+    if (a == AGGREGATE_COUNT || ngx_http_graphite_aggregates[a].get == ngx_http_graphite_aggregate_gauge)
+        return NGX_CONF_ERROR;
+
+    param->aggregate = ngx_http_graphite_aggregates[a].get;
+
+    u_char *name = ngx_http_graphite_allocator_alloc(context->storage->allocator, source->name.len + 1 + option->len);
+    if (name == NULL) {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+        return NGX_CONF_ERROR;
+    }
+
+    param->name.len = ngx_sprintf(name, "%V_%V", &source->name, option) - name;
+    param->name.data = name;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_graphite_parse_params(ngx_http_graphite_context_t *context, const ngx_str_t *value, ngx_array_t *params) {
+
+    ngx_http_graphite_main_conf_t *gmcf = context->gmcf;
+
+    ngx_uint_t i = 0;
+    ngx_uint_t s = 0;
+    ngx_uint_t q = NGX_CONF_UNSET_UINT;
+    ngx_uint_t o = NGX_CONF_UNSET_UINT;
+    for (i = 0; i <= value->len; i++) {
+        if (i == value->len || value->data[i] == '|') {
+
+            if (i == s) {
+                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite params is empty");
+                return NGX_CONF_ERROR;
+            }
+
+            if (i - s == 1 && value->data[s] == '*') {
+                if (params == gmcf->default_params) {
+                    ngx_str_t default_params = ngx_string(DEFAULT_PARAMS);
+                    if (ngx_http_graphite_parse_params(context, &default_params, params) == NGX_CONF_ERROR)
+                        return NGX_CONF_ERROR;
+                }
+                else {
+                    ngx_uint_t p;
+                    for (p = 0; p < gmcf->default_params->nelts; p++) {
+                        ngx_uint_t param = ((ngx_uint_t*)gmcf->default_params->elts)[p];
+                        if (ngx_http_graphite_add_param_to_params(context, param, params) != NGX_CONF_OK)
+                            return NGX_CONF_ERROR;
+                    }
+                }
+            }
+            else {
+                if (q == NGX_CONF_UNSET_UINT)
+                    q = i;
+
+                if (o != NGX_CONF_UNSET_UINT && q != i) {
+                    ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite bad param %*s", i - s, &value->data[s]);
+                    return NGX_CONF_ERROR;
+                }
+
+                ngx_str_t name;
+                name.data = &value->data[s];
+                name.len = ((o != NGX_CONF_UNSET_UINT) ? o : q) - s;
+                ngx_uint_t c = ngx_http_graphite_get_source(context, &name);
+                if ((ngx_int_t)c == NGX_ERROR)
+                    return NGX_CONF_ERROR;
+
+                ngx_http_graphite_param_t param = ngx_http_graphite_create_param(context, c);
+
+                if (o != NGX_CONF_UNSET_UINT) {
+                    ngx_str_t option;
+                    option.data = &value->data[o + 1];
+                    option.len = i - o - 1;
+                    if (ngx_http_graphite_param_option(context, &param, &option) != NGX_CONF_OK) {
+                        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite bad param %*s", i - s, &value->data[s]);
+                        return NGX_CONF_ERROR;
+                    }
+                }
+
+                if (q != i) {
+                    if (((ngx_http_graphite_source_t*)gmcf->sources->elts)[c].cells != 0) {
+                        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite bad param %*s", i - s, &value->data[s]);
+                        return NGX_CONF_ERROR;
+                    }
+
+                    ngx_int_t percentile = ngx_atofp(&value->data[q + 1], i - q - 1, 3);
+                    if (percentile == NGX_ERROR || percentile <= 0 || percentile > 100000) {
+                        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite bad param %*s", i - s, &value->data[s]);
+                        return NGX_CONF_ERROR;
+                    }
+
+                    param.percentile = percentile;
+                }
+
+                ngx_uint_t p = ngx_http_graphite_add_param_to_config(context, &param, NULL);
+                if ((ngx_int_t)p == NGX_ERROR)
+                    return NGX_CONF_ERROR;
+
+                if (ngx_http_graphite_add_param_to_params(context, p, params) != NGX_CONF_OK)
+                    return NGX_CONF_ERROR;
+            }
+
+            s = i + 1;
+            q = NGX_CONF_UNSET_UINT;
+            o = NGX_CONF_UNSET_UINT;
+        }
+        if (value->data[i] == '/')
+            q = i;
+        if (value->data[i] == ':' && o == NGX_CONF_UNSET_UINT)
+            o = i;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_graphite_parse_string(ngx_http_graphite_context_t *context, ngx_str_t *value, ngx_str_t *result) {
+
+    ngx_http_graphite_allocator_t *allocator = context->storage->allocator;
+
+    result->data = ngx_http_graphite_allocator_alloc(allocator, value->len);
+    if (!result->data) {
+        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
         return NGX_CONF_ERROR;
     }
 
-    if (gmcf->package_size == 0) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite config package must be positive value");
+    ngx_memcpy(result->data, value->data, value->len);
+    result->len = value->len;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_graphite_parse_size(ngx_http_graphite_context_t *context, ngx_str_t *value, ngx_uint_t *result) {
+
+    if (!result)
+        return NGX_CONF_ERROR;
+
+    size_t len = 0;
+    while (len < value->len && value->data[len] >= '0' && value->data[len] <= '9')
+        len++;
+
+    *result = ngx_atoi(value->data, len);
+    if (*result == (ngx_uint_t)-1)
         return NGX_CONF_ERROR;
+
+    if (len + 1 == value->len) {
+        if (value->data[len] == 'b')
+            *result *= 1;
+        else if (value->data[len] == 'k')
+            *result *= 1024;
+        else if (value->data[len] == 'm')
+            *result *= 1024 * 1024;
+        else
+            return NGX_CONF_ERROR;
+
+        len++;
     }
 
-    if (gmcf->shared_size < sizeof(ngx_slab_pool_t)) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite too small shared memory");
+    if (len != value->len)
         return NGX_CONF_ERROR;
-    }
 
-    ngx_url_t u;
-    ngx_memzero(&u, sizeof(ngx_url_t));
+    return NGX_CONF_OK;
+}
 
-    u.url = gmcf->server.name;
-    u.default_port = gmcf->port;
+static char *
+ngx_http_graphite_parse_time(ngx_http_graphite_context_t *context, ngx_str_t *value, ngx_uint_t *result) {
 
-    if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
-        if (u.err)
-            ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "%s in resolver \"%V\"", u.err, &u.url);
+    if (!result)
         return NGX_CONF_ERROR;
-    }
 
-    gmcf->server.sockaddr = u.addrs[0].sockaddr;
-    gmcf->server.socklen = u.addrs[0].socklen;
+    size_t len = 0;
+    while (len < value->len && value->data[len] >= '0' && value->data[len] <= '9')
+        len++;
 
-    ngx_str_t graphite_shared_id;
-    graphite_shared_id.len = graphite_shared_name.len + 32;
-    graphite_shared_id.data = ngx_palloc(cf->pool, graphite_shared_id.len);
-    if (!graphite_shared_id.data) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite can't alloc memory");
+    *result = ngx_atoi(value->data, len);
+    if (*result == (ngx_uint_t)-1)
         return NGX_CONF_ERROR;
-    }
-    ngx_snprintf(graphite_shared_id.data, graphite_shared_id.len, "%V.%T", &graphite_shared_name, ngx_time());
 
-    gmcf->shared = ngx_shared_memory_add(cf, &graphite_shared_id, gmcf->shared_size, &ngx_http_graphite_module);
-    if (!gmcf->shared) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite can't alloc shared memory");
-        return NGX_CONF_ERROR;
-    }
-    if (gmcf->shared->data) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite shared memory is used");
-        return NGX_CONF_ERROR;
-    }
-    gmcf->shared->init = ngx_http_graphite_shared_init;
-    gmcf->shared->data = gmcf;
+    if (len + 1 == value->len) {
+        if (value->data[len] == 's')
+            *result *= 1;
+        else if (value->data[len] == 'm')
+            *result *= 60;
+        else
+            return NGX_CONF_ERROR;
 
-    gmcf->buffer.start = ngx_palloc(cf->pool, gmcf->buffer_size);
-    if (!gmcf->buffer.start) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite can't alloc memory");
-        return NGX_CONF_ERROR;
+        len++;
     }
-    gmcf->buffer.end = gmcf->buffer.start + gmcf->buffer_size;
 
-    gmcf->enable = 1;
+    if (len != value->len)
+        return NGX_CONF_ERROR;
 
     return NGX_CONF_OK;
 }
 
 static char *
-ngx_http_graphite_default_data(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+ngx_http_graphite_parse_flag(ngx_http_graphite_context_t *context, ngx_str_t *value, ngx_uint_t *result) {
 
-    ngx_http_graphite_context_t context = ngx_http_graphite_context_from_config(cf);
-
-    ngx_http_graphite_main_conf_t *gmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_graphite_module);
-    ngx_http_graphite_srv_conf_t *gscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_graphite_module);
+    if (!result)
+        return NGX_CONF_ERROR;
 
-    if (!gmcf->enable) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite config not set");
+    if (value->len == 2 && ngx_strncmp(value->data, "on", 2) == 0)
+        *result = 1;
+    else if (value->len == 3 && ngx_strncmp(value->data, "off", 3) == 0)
+        *result = 0;
+    else
         return NGX_CONF_ERROR;
-    }
 
-    ngx_str_t *args = cf->args->elts;
+    return NGX_CONF_OK;
+}
 
-    ngx_array_t *template = NULL;
-    ngx_array_t *params = NULL;
-    ngx_http_complex_value_t **filter;
+/*
+ * sample=1/N, N is at least 1.
+ */
+static char *
+ngx_http_graphite_parse_sample(ngx_http_graphite_context_t *context, ngx_str_t *value, ngx_uint_t *result) {
 
-    if (cf->cmd_type == NGX_HTTP_MAIN_CONF) {
-        template = gmcf->default_data_template;
-        params = gmcf->default_data_params;
-        filter = &gmcf->default_data_filter;
-    }
-    else if (cf->cmd_type == NGX_HTTP_SRV_CONF) {
-        template = gscf->default_data_template;
-        params = gscf->default_data_params;
-        filter = &gscf->default_data_filter;
-    }
-    else
+    if (!result)
         return NGX_CONF_ERROR;
 
-    if (ngx_http_graphite_template_compile(&context, template, ngx_http_graphite_default_data_args, DEFAULT_DATA_ARG_COUNT, &args[1]) != NGX_CONF_OK)
+    if (value->len < 3 || ngx_strncmp(value->data, "1/", 2) != 0)
         return NGX_CONF_ERROR;
 
-    if (cf->args->nelts >= 3) {
-        ngx_uint_t i;
-        for (i = 2; i < cf->args->nelts; i++) {
-            if (ngx_strncmp(args[i].data, "params=", 7) == 0) {
-                ngx_str_t value;
-                value.len = args[i].len - 7;
-                value.data = args[i].data + 7;
-                if (ngx_http_graphite_parse_params(&context, &value, params) != NGX_CONF_OK)
-                    return NGX_CONF_ERROR;
-            }
-            else if (ngx_strncmp(args[i].data, "if=", 3) == 0) {
-                ngx_str_t value;
-                value.len = args[i].len - 3;
-                value.data = args[i].data + 3;
+    ngx_int_t n = ngx_atoi(value->data + 2, value->len - 2);
+    if (n == NGX_ERROR || n == 0)
+        return NGX_CONF_ERROR;
 
-                *filter = ngx_http_graphite_complex_compile(cf, &value);
-                if (!*filter)
-                    return NGX_CONF_ERROR;
-            }
-            else {
-                ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite unknown option %V", &args[i]);
-                return NGX_CONF_ERROR;
-            }
-        }
-    }
+    *result = n;
 
     return NGX_CONF_OK;
 }
 
 static char *
-ngx_http_graphite_data(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+ngx_http_graphite_template_compile(ngx_http_graphite_context_t *context, ngx_array_t *template, const ngx_http_graphite_template_arg_t *args, size_t nargs, const ngx_str_t *value) {
 
-    ngx_http_graphite_context_t context = ngx_http_graphite_context_from_config(cf);
+    ngx_http_graphite_allocator_t *allocator = context->storage->allocator;
 
-    ngx_http_graphite_main_conf_t *gmcf = context.gmcf;
-    ngx_http_graphite_srv_conf_t *gscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_graphite_module);
-    ngx_http_graphite_loc_conf_t *glcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_graphite_module);
+    ngx_uint_t i = 0;
+    ngx_uint_t s = 0;
 
-    if (!gmcf->enable)
-        return NGX_CONF_OK;
+    typedef enum {
+        TEMPLATE_STATE_ERROR = -1,
+        TEMPLATE_STATE_NONE,
+        TEMPLATE_STATE_VAR,
+        TEMPLATE_STATE_BRACKET_VAR,
+        TEMPLATE_STATE_VAR_START,
+        TEMPLATE_STATE_BRACKET_VAR_START,
+        TEMPLATE_STATE_BRACKET_VAR_END,
+        TEMPLATE_STATE_NOP,
+    } ngx_http_graphite_template_parser_state_t;
 
-    ngx_str_t *args = cf->args->elts;
+    typedef enum {
+        TEMPLATE_LEXEM_ERROR = -1,
+        TEMPLATE_LEXEM_VAR,
+        TEMPLATE_LEXEM_BRACKET_OPEN,
+        TEMPLATE_LEXEM_BRACKET_CLOSE,
+        TEMPLATE_LEXEM_ALNUM,
+        TEMPLATE_LEXEM_OTHER,
+        TEMPLATE_LEXEM_END,
+    } ngx_http_graphite_template_parser_lexem_t;
 
-    ngx_str_t *split = &args[1];
-    ngx_array_t *params = ngx_array_create(cf->pool, 1, sizeof(ngx_uint_t));
-    if (!params) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite can't alloc memory");
-        return NULL;
-    }
-    ngx_http_complex_value_t *filter = NULL;
+    ngx_http_graphite_template_parser_state_t state = TEMPLATE_STATE_NONE;
+    ngx_http_graphite_template_parser_lexem_t lexem;
 
-    if (cf->args->nelts >= 3) {
-        ngx_uint_t i;
-        for (i = 2; i < cf->args->nelts; i++) {
-            if (ngx_strncmp(args[i].data, "params=", 7) == 0) {
-                ngx_str_t value;
-                value.len = args[i].len - 7;
-                value.data = args[i].data + 7;
-                if (ngx_http_graphite_parse_params(&context, &value, params) != NGX_CONF_OK)
-                    return NGX_CONF_ERROR;
-            }
-            else if (ngx_strncmp(args[i].data, "if=", 3) == 0) {
-                ngx_str_t value;
-                value.len = args[i].len - 3;
-                value.data = args[i].data + 3;
+    ngx_http_graphite_template_parser_state_t parser[TEMPLATE_STATE_BRACKET_VAR_END + 1][TEMPLATE_LEXEM_END + 1] = {
+        { 1,  6,  6,  6,  6,  0},
+        { 0,  2, -1,  3, -1, -1},
+        {-1, -1, -1,  4, -1, -1},
+        { 0,  0,  0,  6,  0,  0},
+        {-1, -1,  5,  6, -1, -1},
+        { 0,  0,  0,  0,  0,  0},
+    };
 
-                filter = ngx_http_graphite_complex_compile(cf, &value);
-                if (!filter)
+    for (i = 0; i <= value->len; i++) {
+        if (i == value->len)
+            lexem = TEMPLATE_LEXEM_END;
+        else if (value->data[i] == '$')
+            lexem = TEMPLATE_LEXEM_VAR;
+        else if (value->data[i] == '(')
+            lexem = TEMPLATE_LEXEM_BRACKET_OPEN;
+        else if (value->data[i] == ')')
+            lexem = TEMPLATE_LEXEM_BRACKET_CLOSE;
+        else if (isalnum(value->data[i]))
+            lexem = TEMPLATE_LEXEM_ALNUM;
+        else
+            lexem = TEMPLATE_LEXEM_OTHER;
+
+        ngx_int_t new_state = parser[state][lexem];
+
+        if (new_state == TEMPLATE_LEXEM_ERROR)
+            return NGX_CONF_ERROR;
+
+        if (new_state != TEMPLATE_STATE_NOP) {
+
+            if (i != s && (state == TEMPLATE_STATE_NONE || state == TEMPLATE_STATE_VAR_START || state == TEMPLATE_STATE_BRACKET_VAR_START)) {
+
+                ngx_http_graphite_template_t *arg = ngx_array_push(template);
+                if (!arg) {
+                    ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
                     return NGX_CONF_ERROR;
-            }
-            else {
-                ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite unknown option %V", &args[i]);
-                return NGX_CONF_ERROR;
-            }
-        }
-    }
+                }
 
-    ngx_array_t *datas;
+                if (state == TEMPLATE_STATE_NONE) {
+                    arg->data.data = ngx_http_graphite_allocator_alloc(allocator, i - s);
+                    if (!arg->data.data) {
+                        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+                        return NGX_CONF_ERROR;
+                    }
+                    ngx_memcpy(arg->data.data, value->data + s, i - s);
+                    arg->data.len = i - s;
+                    arg->variable = 0;
+                }
+                else if (state == TEMPLATE_STATE_VAR_START || state == TEMPLATE_STATE_BRACKET_VAR_START) {
+                    ngx_uint_t found = 0;
+                    size_t a;
+                    for (a = 0; a < nargs; a++) {
+                        if ((args[a].name.len == i - s) && !ngx_strncmp(args[a].name.data, &value->data[s], i - s)) {
+                            found = 1;
+                            arg->variable = args[a].variable;
+                            arg->data.data = NULL;
+                            arg->data.len = 0;
+                        }
+                    }
 
-    if (cf->cmd_type & NGX_HTTP_MAIN_CONF)
-        datas = gmcf->datas;
-    else if (cf->cmd_type & NGX_HTTP_SRV_CONF)
-        datas = gscf->datas;
-    else
-        datas = glcf->datas;
+                    if (!found) {
+                        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite unknow template arg %*s", i - s, &value->data[s]);
+                        return NGX_CONF_ERROR;
+                    }
+                }
+            }
 
-    if (ngx_http_graphite_add_data(cf, datas, split, params, filter) != NGX_CONF_OK)
-        return NGX_CONF_ERROR;
+            s = i;
+            state = new_state;
+        }
+    }
 
     return NGX_CONF_OK;
 }
 
-static int
-ngx_http_graphite_search_param_compare(const void *name_, const void *pinternal_)
-{
-    const ngx_str_t *name = name_;
-    const ngx_http_graphite_internal_t * const *pinternal = pinternal_;
-    const ngx_http_graphite_internal_t *internal = *pinternal;
+static u_char *
+ngx_http_graphite_template_execute(u_char* buffer, size_t buffer_size, const ngx_array_t *template, const ngx_str_t *variables[]) {
 
-    if (name->len < internal->name.len)
-        return -1;
-    if (name->len > internal->name.len)
-        return 1;
-    return ngx_strncmp(name->data, internal->name.data, name->len);
-}
+    u_char *b = buffer;
 
-static ngx_http_graphite_internal_t *
-ngx_http_graphite_search_param(const ngx_http_graphite_array_t *internals, const ngx_str_t *name, ngx_uint_t *idx) {
-    ngx_http_graphite_internal_t **pinternal;
-    int found;
+    ngx_uint_t i;
+    for (i = 0; i < template->nelts; i++) {
+        ngx_http_graphite_template_t *arg = &((ngx_http_graphite_template_t*)template->elts)[i];
+        const ngx_str_t *data = NULL;
 
-    pinternal = ngx_graphite_bsearch(
-        name, internals->elts, internals->nelts, sizeof(*pinternal),
-        ngx_http_graphite_search_param_compare, &found);
+        if (arg->data.len)
+            data = &arg->data;
+        else
+            data = variables[arg->variable];
 
-    if (idx != NULL)
-        *idx = pinternal - (ngx_http_graphite_internal_t**)internals->elts;
+        b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V", data);
+    }
 
-    return found ? *pinternal : NULL;
+    return b;
 }
 
-static ngx_http_graphite_internal_t *
-ngx_http_graphite_link2int(const ngx_http_graphite_link_t *link) {
+static size_t
+ngx_http_graphite_template_len(const ngx_array_t *template, const ngx_str_t *variables[]) {
 
-    return (ngx_http_graphite_internal_t*)link;
-}
+    size_t len = 0;
 
-static const ngx_http_graphite_link_t *
-ngx_http_graphite_int2link(ngx_http_graphite_internal_t *internal) {
+    ngx_uint_t i;
+    for (i = 0; i < template->nelts; i++) {
+        ngx_http_graphite_template_t *arg = &((ngx_http_graphite_template_t*)template->elts)[i];
 
-    return (const ngx_http_graphite_link_t*)internal;
+        if (arg->data.len)
+            len += arg->data.len;
+        else
+            len += variables[arg->variable]->len;
+    }
+
+    return len;
 }
 
-static const ngx_http_graphite_link_t *
-ngx_http_graphite_search_param_link(const ngx_http_graphite_array_t *internals, const ngx_str_t *name) {
+static ngx_http_complex_value_t *
+ngx_http_graphite_complex_compile(ngx_conf_t *cf, ngx_str_t *value) {
 
-    ngx_http_graphite_internal_t *internal;
+    ngx_http_graphite_main_conf_t *gmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_graphite_module);
 
-    internal = ngx_http_graphite_search_param(internals, name, NULL);
-    return ngx_http_graphite_int2link(internal);
-}
+    ngx_uint_t i;
+    for (i = 0; i < gmcf->filters->nelts; i++) {
+        ngx_http_complex_value_t *filter = ((ngx_http_complex_value_t**)gmcf->filters->elts)[i];
+        if (filter->value.len == value->len && ngx_strncmp(filter->value.data, value->data, value->len) == 0)
+            return filter;
+    }
 
-static void
-ngx_http_graphite_clear_param_args(ngx_http_graphite_context_t *context, ngx_http_graphite_param_t *param) {
+    ngx_http_complex_value_t **filter = ngx_array_push(gmcf->filters);
+    if (filter == NULL)
+        return NULL;
 
-    ngx_http_graphite_allocator_t *allocator = context->storage->allocator;
+    ngx_http_compile_complex_value_t ccv;
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
 
-    ngx_http_graphite_allocator_free(allocator, param->name.data);
-    ngx_http_graphite_allocator_free(allocator, param->interval.name.data);
-    ngx_http_graphite_array_destroy(param->percentiles);
-}
+    ccv.cf = cf;
+    ccv.value = value;
+    ccv.complex_value = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+    if (ccv.complex_value == NULL)
+        return NULL;
 
-static ngx_int_t
-ngx_http_graphite_parse_param_args(ngx_http_graphite_context_t *context, const ngx_array_t *args, ngx_http_graphite_param_t *param) {
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        gmcf->filters->nelts--;
+        return NULL;
+    }
 
-    ngx_http_graphite_allocator_t *allocator = context->storage->allocator;
+    *filter = ccv.complex_value;
 
-    ngx_memzero(param, sizeof(ngx_http_graphite_param_t));
+    return ccv.complex_value;
+}
 
-    param->percentiles = ngx_http_graphite_array_create(allocator, 1, sizeof(ngx_uint_t));
-    if (!param->percentiles) {
-        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
+static ngx_int_t
+ngx_http_graphite_shared_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_graphite_main_conf_t *gmcf = shm_zone->data;
+
+    if (data) {
+        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0, "graphite shared memory data set");
         return NGX_ERROR;
     }
 
-    ngx_int_t r = NGX_OK;
+    ngx_uint_t metric_stride = ngx_align(gmcf->storage->metrics->nelts, NGX_HTTP_GRAPHITE_REDUCE_STEP);
+    size_t vector_datas_size = 0;
 
-    if (ngx_http_graphite_parse_args(context, args, param, ngx_http_graphite_param_args, PARAM_ARGS_COUNT) == NGX_CONF_ERROR)
-        r = NGX_ERROR;
+    ngx_uint_t v;
+    for (v = 0; v < gmcf->storage->vectors->nelts; v++) {
+        const ngx_http_graphite_vector_t *vector = &((ngx_http_graphite_vector_t*)gmcf->storage->vectors->elts)[v];
+        vector_datas_size += sizeof(uint32_t) * vector->cells * (gmcf->storage->max_interval + 1);
+    }
 
-    param->source = SOURCE_INTERNAL;
+    /* percentiles of a group share the estimator of its leader */
+    ngx_uint_t statistic_groups = 0;
 
-    if (r == NGX_OK && !param->name.data) {
-        r = NGX_ERROR;
-        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite param name not set");
+    ngx_uint_t s;
+    for (s = 0; s < gmcf->storage->statistics->nelts; s++) {
+        if (((ngx_http_graphite_statistic_t*)gmcf->storage->statistics->elts)[s].group == s)
+            statistic_groups++;
     }
 
-    if (r == NGX_OK && (param->aggregate && param->aggregate != ngx_http_graphite_aggregate_gauge && !param->interval.value)) {
-        r = NGX_ERROR;
-        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite param must contain interval with aggregate avg, persec or sum");
-    }
+    size_t shared_required_size =
+        2 *
+        (sizeof(ngx_slab_pool_t) +
+        sizeof(ngx_http_graphite_storage_t) +
+        sizeof(ngx_array_t) * 5 +
+        sizeof(ngx_http_graphite_metric_t) * (gmcf->storage->metrics->nelts) +
+        sizeof(ngx_http_graphite_gauge_t) * (gmcf->storage->gauges->nelts) +
+        sizeof(ngx_http_graphite_statistic_t) * (gmcf->storage->statistics->nelts) +
+        sizeof(ngx_http_graphite_vector_t) * (gmcf->storage->vectors->nelts) +
+        sizeof(ngx_http_graphite_param_t) * (gmcf->storage->params->nelts) +
+        sizeof(ngx_http_graphite_hash_t) +
+        sizeof(ngx_http_graphite_hash_table_t) +
+        sizeof(ngx_http_graphite_hash_elt_t) * (gmcf->storage->internals->table->nalloc) +
+        sizeof(ngx_http_graphite_internal_t) * (gmcf->storage->internals->nelts) +
+        (sizeof(double) * 2 + sizeof(ngx_uint_t) + sizeof(ngx_atomic_t)) * (gmcf->storage->max_interval + 1) * metric_stride + NGX_CPU_CACHE_LINE * 4 +
+        gmcf->storage->metrics->nelts * gmcf->intervals->nelts +
+        sizeof(double) * gmcf->storage->metrics->nelts +
+        sizeof(ngx_http_graphite_gauge_data_t) * gmcf->storage->gauges->nelts +
+        sizeof(ngx_http_graphite_statistic_data_t) * statistic_groups +
+        ((gmcf->percentile_mode == PERCENTILE_RESERVOIR) ? sizeof(double) * RESERVOIR_SIZE * statistic_groups : 0) +
+        vector_datas_size);
 
-    if (r == NGX_OK && ((!param->aggregate || param->aggregate == ngx_http_graphite_aggregate_gauge) && param->interval.value)) {
-        r = NGX_ERROR;
-        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite param must contain aggregate avg, persec or sum with interval or aggregate gauge");
+    if (shared_required_size > shm_zone->shm.size) {
+        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0, "graphite too small shared memory (minimum size is %uzb)", shared_required_size);
+        return NGX_ERROR;
     }
 
-    if (r == NGX_OK && (param->aggregate == ngx_http_graphite_aggregate_gauge && param->percentiles->nelts != 0)) {
-        r = NGX_ERROR;
-        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite param must contain aggregate gauge or percentile only");
-    }
+    ngx_slab_pool_t *shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
 
-    if (r == NGX_OK && (!param->aggregate && !param->interval.value && param->percentiles->nelts == 0)) {
-        r = NGX_ERROR;
-        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite param must contain aggregate avg, perse or sum and interval, aggregate gauge or percentile");
+    if (shm_zone->shm.exists) {
+        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0, "graphite shared memory exists");
+        return NGX_ERROR;
     }
 
-    if (r == NGX_OK && (param->interval.value > context->storage->max_interval)) {
-        r = NGX_ERROR;
-        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite param interval value is greather than max interval");
+    ngx_http_graphite_storage_t *storage = ngx_slab_alloc(shpool, sizeof(ngx_http_graphite_storage_t));
+    if (!storage) {
+        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0, "graphite can't slab alloc in shared memory");
+        return NGX_ERROR;
     }
 
-    if (r != NGX_OK)
-        ngx_http_graphite_clear_param_args(context, param);
-
-    return r;
-}
+    shpool->data = storage;
 
-static ngx_http_graphite_internal_t *
-ngx_http_graphite_add_internal(ngx_http_graphite_context_t *context, const ngx_http_graphite_param_t *param) {
+    ngx_memzero(storage, sizeof(ngx_http_graphite_storage_t));
 
-    ngx_http_graphite_storage_t *storage = context->storage;
+    storage->max_interval = gmcf->storage->max_interval;
+    storage->lock_profiling = gmcf->lock_profiling;
 
-    ngx_uint_t i;
-    ngx_http_graphite_internal_t *internal;
-    internal = ngx_http_graphite_search_param(storage->internals, &param->name, &i);
+    time_t ts = ngx_time();
+    storage->start_time = ts;
+    storage->last_time = ts;
+    storage->event_time = ts;
+    storage->ewma_time = ts - 1;
 
-    ngx_http_graphite_data_t data;
-    if (internal == NULL) {
-        if (ngx_http_graphite_init_data(context, &data) == NGX_ERROR)
-            return NULL;
+    ngx_http_graphite_allocator_t *allocator = ngx_slab_alloc(shpool, sizeof(ngx_http_graphite_allocator_t));
+    if (allocator == NULL) {
+        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0, "graphite can't slab alloc in shared memory");
+        return NGX_ERROR;
     }
-    else
-        data = internal->data;
+    ngx_http_graphite_allocator_init(allocator, shpool, ngx_http_graphite_allocator_slab_alloc, ngx_http_graphite_allocator_slab_free);
 
-    ngx_http_graphite_param_t new_param = *param;
+    storage->allocator = allocator;
+    storage->metrics = ngx_http_graphite_array_copy(storage->allocator, gmcf->storage->metrics);
+    storage->gauges = ngx_http_graphite_array_copy(storage->allocator, gmcf->storage->gauges);
+    storage->statistics = ngx_http_graphite_array_copy(storage->allocator, gmcf->storage->statistics);
+    storage->vectors = ngx_http_graphite_array_copy(storage->allocator, gmcf->storage->vectors);
+    storage->params = ngx_http_graphite_array_copy(storage->allocator, gmcf->storage->params);
+    storage->internals = ngx_http_graphite_hash_copy(storage->allocator, gmcf->storage->internals);
 
-    size_t n;
-    for (n = 0; n < param->percentiles->nelts + 1; n++) {
-        if (n == 0) {
-            if (!new_param.aggregate)
-                continue;
-        }
-        else
-            new_param.percentile = ((ngx_uint_t*)new_param.percentiles->elts)[n - 1];
+    if (storage->metrics == NULL || storage->gauges == NULL || storage->statistics == NULL || storage->vectors == NULL || storage->params == NULL || storage->internals == NULL) {
+        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0, "graphite can't slab alloc in shared memory");
+        return NGX_ERROR;
+    }
 
-        ngx_uint_t created;
-        ngx_uint_t p = ngx_http_graphite_add_param_to_config(context, &new_param, &created);
-        if ((ngx_int_t)p == NGX_ERROR)
-            return NULL;
+    size_t plane_size = sizeof(double) * (gmcf->storage->max_interval + 1) * metric_stride;
 
-        if (created && ngx_http_graphite_add_param_to_data(context, SPLIT_INTERNAL, p, &data) != NGX_CONF_OK)
-            return NULL;
+    u_char *metric_values = ngx_slab_calloc(shpool, plane_size + NGX_CPU_CACHE_LINE);
+    u_char *metric_counts = ngx_slab_calloc(shpool, plane_size + NGX_CPU_CACHE_LINE);
+    u_char *metric_ints = ngx_slab_calloc(shpool, plane_size + NGX_CPU_CACHE_LINE);
+    if (metric_values == NULL || metric_counts == NULL || metric_ints == NULL) {
+        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0, "graphite can't slab alloc in shared memory");
+        return NGX_ERROR;
     }
 
-    if (internal == NULL) {
-        ngx_http_graphite_allocator_t *allocator = storage->allocator;
+    storage->metric_values = (double*)ngx_align_ptr(metric_values, NGX_CPU_CACHE_LINE);
+    storage->metric_counts = (ngx_uint_t*)ngx_align_ptr(metric_counts, NGX_CPU_CACHE_LINE);
+    storage->metric_ints = (ngx_atomic_t*)ngx_align_ptr(metric_ints, NGX_CPU_CACHE_LINE);
 
-        if ((internal = ngx_http_graphite_allocator_alloc(allocator, sizeof(*internal))) == NULL) {
-            ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
-            return NULL;
-        }
+    ngx_uint_t m;
+    for (m = 0; m < storage->metrics->nelts; m++) {
+        if (((ngx_http_graphite_metric_t*)storage->metrics->elts)[m].op == METRIC_STDDEV)
+            break;
+    }
 
-        ngx_http_graphite_internal_t **pinternal = ngx_http_graphite_array_push(storage->internals);
-        if (pinternal == NULL) {
-            ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
-            ngx_http_graphite_allocator_free(allocator, internal);
-            return NULL;
+    /* the squares plane is needed only by stddev metrics */
+    if (m != storage->metrics->nelts) {
+        u_char *metric_squares = ngx_slab_calloc(shpool, plane_size + NGX_CPU_CACHE_LINE);
+        if (metric_squares == NULL) {
+            ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0, "graphite can't slab alloc in shared memory");
+            return NGX_ERROR;
         }
 
-        ngx_memmove(&((ngx_http_graphite_internal_t**)storage->internals->elts)[i + 1], &((ngx_http_graphite_internal_t**)storage->internals->elts)[i], (storage->internals->nelts - i - 1) * sizeof(ngx_http_graphite_internal_t*));
-
-        ((ngx_http_graphite_internal_t**)storage->internals->elts)[i] = internal;
-        internal->name = param->name;
-        internal->data = data;
+        storage->metric_squares = (double*)ngx_align_ptr(metric_squares, NGX_CPU_CACHE_LINE);
     }
+    storage->metric_stride = metric_stride;
+    storage->plane_metrics = gmcf->storage->metrics->nelts;
 
-    return internal;
-}
+    storage->metric_active = ngx_slab_calloc(shpool, ngx_max(storage->plane_metrics * gmcf->intervals->nelts, 1));
+    if (storage->metric_active == NULL) {
+        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0, "graphite can't slab alloc in shared memory");
+        return NGX_ERROR;
+    }
 
-static char *
-ngx_http_graphite_param(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    storage->metric_ewma = ngx_slab_calloc(shpool, sizeof(double) * ngx_max(storage->plane_metrics, 1));
+    if (storage->metric_ewma == NULL) {
+        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0, "graphite can't slab alloc in shared memory");
+        return NGX_ERROR;
+    }
 
-    ngx_http_graphite_context_t context = ngx_http_graphite_context_from_config(cf);
+    u_char *gauge_datas = ngx_slab_calloc(shpool, sizeof(ngx_http_graphite_gauge_data_t) * gmcf->storage->gauges->nelts);
+    if (gauge_datas == NULL) {
+        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0, "graphite can't slab alloc in shared memory");
+        return NGX_ERROR;
+    }
 
-    ngx_http_graphite_main_conf_t *gmcf = context.gmcf;
+    u_char *statistic_datas = ngx_slab_calloc(shpool, sizeof(ngx_http_graphite_statistic_data_t) * ngx_max(statistic_groups, 1));
+    if (statistic_datas == NULL) {
+        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0, "graphite can't slab alloc in shared memory");
+        return NGX_ERROR;
+    }
 
-    if (!gmcf->enable)
-        return NGX_CONF_OK;
+    double *statistic_samples = NULL;
+    if (gmcf->percentile_mode == PERCENTILE_RESERVOIR && statistic_groups != 0) {
+        statistic_samples = ngx_slab_alloc(shpool, sizeof(double) * RESERVOIR_SIZE * statistic_groups);
+        if (statistic_samples == NULL) {
+            ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0, "graphite can't slab alloc in shared memory");
+            return NGX_ERROR;
+        }
+    }
 
-    ngx_http_graphite_param_t param;
-    if (ngx_http_graphite_parse_param_args(&context, cf->args, &param) != NGX_OK)
-        return NGX_CONF_ERROR;
+    u_char *vector_datas = ngx_slab_calloc(shpool, vector_datas_size ? vector_datas_size : 1);
+    if (vector_datas == NULL) {
+        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0, "graphite can't slab alloc in shared memory");
+        return NGX_ERROR;
+    }
 
-    if (ngx_http_graphite_add_internal(&context, &param) == NULL)
-        return NGX_CONF_ERROR;
+    for (m = 0; m < storage->metrics->nelts; m++) {
+        ngx_http_graphite_metric_t *metric = &(((ngx_http_graphite_metric_t*)storage->metrics->elts)[m]);
+        metric->values = storage->metric_values + m;
+        metric->counts = storage->metric_counts + m;
+        metric->ints = storage->metric_ints + m;
+        metric->squares = (metric->op == METRIC_STDDEV) ? storage->metric_squares + m : NULL;
+        metric->stride = metric_stride;
+    }
 
-    return NGX_CONF_OK;
-}
+    ngx_uint_t g;
+    for (g = 0; g < storage->gauges->nelts; g++) {
+        ngx_http_graphite_gauge_t *gauge = &(((ngx_http_graphite_gauge_t*)storage->gauges->elts)[g]);
+        gauge->data = (ngx_http_graphite_gauge_data_t*)(gauge_datas + sizeof(ngx_http_graphite_gauge_data_t) * g);
+    }
 
-static char *
-ngx_http_graphite_config_arg_prefix(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+    ngx_uint_t slot = 0;
+    for (s = 0; s < storage->statistics->nelts; s++) {
+        ngx_http_graphite_statistic_t *statistic = &(((ngx_http_graphite_statistic_t*)storage->statistics->elts)[s]);
 
-    ngx_http_graphite_main_conf_t *gmcf = data;
-    return ngx_http_graphite_parse_string(context, value, &gmcf->prefix);
-}
+        if (statistic->group != s) {
+            statistic->data = ((ngx_http_graphite_statistic_t*)storage->statistics->elts)[statistic->group].data;
+            continue;
+        }
 
-static char *
-ngx_http_graphite_config_arg_host(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+        statistic->data = (ngx_http_graphite_statistic_data_t*)(statistic_datas + sizeof(ngx_http_graphite_statistic_data_t) * slot);
 
-    ngx_http_graphite_main_conf_t *gmcf = data;
-    return ngx_http_graphite_parse_string(context, value, &gmcf->host);
-}
+        ngx_uint_t percentiles[P2_MAX_QUANTILES];
+        ngx_uint_t j, m = 0;
+        for (j = s; j < storage->statistics->nelts; j++) {
+            const ngx_http_graphite_statistic_t *member = &(((ngx_http_graphite_statistic_t*)storage->statistics->elts)[j]);
+            if (member->group != s)
+                continue;
 
-static char *
-ngx_http_graphite_config_arg_protocol(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+            ngx_uint_t percentile = ((ngx_http_graphite_param_t*)storage->params->elts)[member->param].percentile;
 
-    ngx_http_graphite_main_conf_t *gmcf = data;
-    return ngx_http_graphite_parse_string(context, value, &gmcf->protocol);
-}
+            ngx_uint_t k = m++;
+            while (k > 0 && percentiles[k - 1] > percentile) {
+                percentiles[k] = percentiles[k - 1];
+                k--;
+            }
+            percentiles[k] = percentile;
+        }
 
-static char *
-ngx_http_graphite_config_arg_timeout(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+        for (j = s; j < storage->statistics->nelts; j++) {
+            ngx_http_graphite_statistic_t *member = &(((ngx_http_graphite_statistic_t*)storage->statistics->elts)[j]);
+            if (member->group != s)
+                continue;
 
-    ngx_http_graphite_main_conf_t *gmcf = data;
-    gmcf->timeout = ngx_atoi(value->data, value->len) * 1000;
+            ngx_uint_t percentile = ((ngx_http_graphite_param_t*)storage->params->elts)[member->param].percentile;
 
-    return NGX_CONF_OK;
-}
+            ngx_uint_t k;
+            for (k = 0; percentiles[k] != percentile; k++)
+                ;
+            member->marker = 2 * k + 2;
+        }
 
-#ifdef NGX_LOG_LIMIT_ENABLED
-static char *
-ngx_http_graphite_config_arg_error_log(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+        ngx_http_graphite_statistic_init(statistic->data, percentiles, m);
+        if (statistic_samples != NULL)
+            statistic->data->samples = statistic_samples + RESERVOIR_SIZE * slot;
 
-    ngx_http_graphite_main_conf_t *gmcf = data;
-    return ngx_http_graphite_parse_string(context, value, &gmcf->error_log);
-}
-#endif
+        slot++;
+    }
 
-static char *
-ngx_http_graphite_config_arg_server(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+    for (v = 0; v < storage->vectors->nelts; v++) {
+        ngx_http_graphite_vector_t *vector = &(((ngx_http_graphite_vector_t*)storage->vectors->elts)[v]);
+        vector->data = (uint32_t*)vector_datas;
+        vector_datas += sizeof(uint32_t) * vector->cells * (storage->max_interval + 1);
+    }
 
-    ngx_http_graphite_main_conf_t *gmcf = data;
-    return ngx_http_graphite_parse_string(context, value, &gmcf->server.name);
+    return NGX_OK;
 }
 
-static char *
-ngx_http_graphite_config_arg_port(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+ngx_http_graphite_reqctx_t *
+ngx_http_graphite_get_reqctx(ngx_http_request_t *r) {
 
-    ngx_http_graphite_main_conf_t *gmcf = data;
-    gmcf->port = ngx_atoi(value->data, value->len);
+    ngx_http_graphite_reqctx_t *reqctx;
 
-    return NGX_CONF_OK;
-}
+    reqctx = ngx_http_get_module_ctx(r->main, ngx_http_graphite_module);
+    if (reqctx)
+        return reqctx;
 
-static char *
-ngx_http_graphite_config_arg_frequency(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+    reqctx = ngx_pcalloc(r->main->pool, sizeof(ngx_http_graphite_reqctx_t));
+    if (reqctx == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "graphite can't alloc memory");
+        return NULL;
+    }
 
-    ngx_http_graphite_main_conf_t *gmcf = data;
-    gmcf->frequency = ngx_atoi(value->data, value->len) * 1000;
+    ngx_http_set_ctx(r->main, reqctx, ngx_http_graphite_module);
 
-    return NGX_CONF_OK;
+    return reqctx;
 }
 
-static char *
-ngx_http_graphite_config_arg_intervals(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
-
-    ngx_http_graphite_main_conf_t *gmcf = data;
-    ngx_http_graphite_allocator_t *allocator = context->storage->allocator;
+static ngx_http_graphite_internal_value_t *
+ngx_http_graphite_reqctx_push(ngx_http_request_t *r, ngx_http_graphite_reqctx_t *reqctx) {
 
-    ngx_uint_t i;
-    ngx_uint_t s = 0;
-    for (i = 0; i <= value->len; i++) {
+    if (reqctx->nvalues < REQCTX_INLINE_VALUES)
+        return &reqctx->values[reqctx->nvalues++];
 
-        if (i == value->len || value->data[i] == '|') {
+    if (reqctx->internal_values == NULL) {
+        reqctx->internal_values = ngx_array_create(r->main->pool, REQCTX_INLINE_VALUES * 2, sizeof(ngx_http_graphite_internal_value_t));
+        if (reqctx->internal_values == NULL)
+            return NULL;
+    }
 
-            if (i == s) {
-                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite config intervals is empty");
-                return NGX_CONF_ERROR;
-            }
+    return ngx_array_push(reqctx->internal_values);
+}
 
-            ngx_http_graphite_interval_t *interval = ngx_array_push(gmcf->intervals);
-            if (!interval) {
-                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
-                return NGX_CONF_ERROR;
-            }
+static double *
+ngx_http_graphite_get_plan_values(ngx_http_graphite_main_conf_t *gmcf, const ngx_http_graphite_plan_t *plan, ngx_http_request_t *r) {
 
-            interval->name.data = ngx_http_graphite_allocator_alloc(allocator, i - s);
-            if (!interval->name.data) {
-                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
-                return NGX_CONF_ERROR;
-            }
+    double *values = gmcf->scratch_values;
 
-            ngx_memcpy(interval->name.data, &value->data[s], i - s);
-            interval->name.len = i - s;
+    ngx_uint_t v;
+    for (v = 0; v < plan->nsources; v++) {
 
-            if (ngx_http_graphite_parse_time(context, &interval->name, &interval->value) == NGX_CONF_ERROR) {
-                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite config interval is invalid");
-                return NGX_CONF_ERROR;
-            }
+        const ngx_http_graphite_source_t *source = &((ngx_http_graphite_source_t*)gmcf->sources->elts)[plan->sources[v]];
+        values[v] = (source->get) ? source->get(source, r) : 0;
+    }
 
-            if (interval->value > gmcf->storage->max_interval)
-                gmcf->storage->max_interval = interval->value;
+    ngx_uint_t k;
+    for (k = 0; k < plan->nkeys; k++) {
 
-            s = i + 1;
-        }
+        const ngx_http_graphite_source_t *source = &((ngx_http_graphite_source_t*)gmcf->sources->elts)[plan->keys[k]];
+        ngx_http_graphite_source_key(source, r, &gmcf->scratch_keys[plan->keys[k]]);
     }
 
-    return NGX_CONF_OK;
+    return values;
 }
 
-static char *
-ngx_http_graphite_config_arg_params(ngx_http_graphite_context_t *context, void *conf, ngx_str_t *value) {
+static u_char *
+ngx_http_graphite_get_plan_filters(ngx_http_graphite_main_conf_t *gmcf, const ngx_http_graphite_plan_t *plan, ngx_http_request_t *r) {
 
-    ngx_http_graphite_main_conf_t *gmcf = conf;
-    return ngx_http_graphite_parse_params(context, value, gmcf->default_params);
+    u_char *filters = gmcf->scratch_filters;
+
+    ngx_uint_t f;
+    for (f = 0; f < plan->nfilters; f++)
+        filters[f] = ngx_http_graphite_filter(r, plan->filters[f]);
+
+    return filters;
 }
 
-static char *
-ngx_http_graphite_config_arg_shared(ngx_http_graphite_context_t *context, void *conf, ngx_str_t *value) {
+static ngx_inline void
+ngx_http_graphite_fold_value(ngx_uint_t op, double *values, ngx_uint_t *counts, double *squares, double value) {
 
-    ngx_http_graphite_main_conf_t *gmcf = conf;
-    return ngx_http_graphite_parse_size(context, value, &gmcf->shared_size);
+    if (op == METRIC_MIN) {
+        if (*counts == 0 || value < *values)
+            *values = value;
+    }
+    else if (op == METRIC_MAX) {
+        if (*counts == 0 || value > *values)
+            *values = value;
+    }
+    else {
+        *values += value;
+        if (squares != NULL)
+            *squares += value * value;
+    }
+
+    (*counts)++;
 }
 
-static char *
-ngx_http_graphite_config_arg_buffer(ngx_http_graphite_context_t *context, void *conf, ngx_str_t *value) {
+static void
+ngx_http_graphite_add_metric(ngx_http_request_t *r, ngx_http_graphite_storage_t *storage, ngx_http_graphite_metric_t *metric, time_t ts, double value) {
 
-    ngx_http_graphite_main_conf_t *gmcf = conf;
-    return ngx_http_graphite_parse_size(context, value, &gmcf->buffer_size);
+    ngx_uint_t a = ((ts - storage->start_time) % (storage->max_interval + 1)) * metric->stride;
+
+    ngx_http_graphite_fold_value(metric->op, &metric->values[a], &metric->counts[a], metric->squares ? &metric->squares[a] : NULL, value);
 }
 
-static char *
-ngx_http_graphite_config_arg_package(ngx_http_graphite_context_t *context, void *conf, ngx_str_t *value) {
+static void
+ngx_http_graphite_add_gauge(ngx_http_request_t *r, ngx_http_graphite_storage_t *storage, ngx_http_graphite_gauge_t *gauge, time_t ts, double value) {
 
-    ngx_http_graphite_main_conf_t *gmcf = conf;
-    return ngx_http_graphite_parse_size(context, value, &gmcf->package_size);
+    ngx_http_graphite_gauge_data_t *data = gauge->data;
+
+    data->value += value;
 }
 
-static char *
-ngx_http_graphite_config_arg_template(ngx_http_graphite_context_t *context, void *conf, ngx_str_t *value) {
+static void
+ngx_http_graphite_add_statistic(ngx_http_request_t *r, ngx_http_graphite_storage_t *storage, ngx_http_graphite_statistic_t *statistic, time_t ts, double value, ngx_uint_t percentile) {
 
-    ngx_http_graphite_main_conf_t *gmcf = conf;
-    return ngx_http_graphite_template_compile(context, gmcf->template, ngx_http_graphite_template_args, TEMPLATE_ARG_COUNT, value);
+    ngx_http_graphite_add_statistic_data(statistic->data, value);
 }
 
-static char *
-ngx_http_graphite_param_arg_name(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+static ngx_uint_t
+ngx_http_graphite_filter(ngx_http_request_t *r, ngx_http_complex_value_t *filter) {
 
-    ngx_http_graphite_allocator_t *allocator = context->storage->allocator;
-    ngx_http_graphite_param_t *param = (ngx_http_graphite_param_t*)data;
+    ngx_str_t result;
+    if (ngx_http_complex_value(r, filter, &result) != NGX_OK)
+        return 0;
 
-    param->name.data = ngx_http_graphite_allocator_alloc(allocator, value->len);
-    if (!param->name.data) {
-        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
-        return NGX_CONF_ERROR;
-    }
-    ngx_memcpy(param->name.data, value->data, value->len);
-    param->name.len = value->len;
+    if (result.len == 0 || (result.len == 1 && result.data[0] == '0'))
+        return 0;
 
-    return NGX_CONF_OK;
+    return 1;
 }
 
-static char *
-ngx_http_graphite_param_arg_aggregate(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+/* requests go through their location plan, only the datas of lua params are updated here */
+static void
+ngx_http_graphite_add_data_values(ngx_http_request_t *r, ngx_http_graphite_storage_t *storage, time_t ts, ngx_http_graphite_data_t *data, double value) {
 
-    ngx_http_graphite_param_t *param = (ngx_http_graphite_param_t*)data;
+    ngx_uint_t i;
 
-    ngx_uint_t found = 0;
-    ngx_uint_t a;
-    for (a = 0; a < AGGREGATE_COUNT; a++) {
-        if ((ngx_http_graphite_aggregates[a].name.len == value->len) && !ngx_strncmp(ngx_http_graphite_aggregates[a].name.data, value->data, value->len)) {
-            found = 1;
-            param->aggregate = ngx_http_graphite_aggregates[a].get;
-        }
+    for (i = 0; i < data->metrics->nelts; i++) {
+        ngx_uint_t m = ((ngx_uint_t*)data->metrics->elts)[i];
+        ngx_http_graphite_metric_t *metric = &((ngx_http_graphite_metric_t*)storage->metrics->elts)[m];
+        ngx_http_graphite_add_metric(r, storage, metric, ts, value);
     }
 
-    if (!found) {
-        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite param unknow aggregate %V", value);
-        return NGX_CONF_ERROR;
+    for (i = 0; i < data->gauges->nelts; i++) {
+        ngx_uint_t g = ((ngx_uint_t*)data->gauges->elts)[i];
+        ngx_http_graphite_gauge_t *gauge = &((ngx_http_graphite_gauge_t*)storage->gauges->elts)[g];
+        ngx_http_graphite_add_gauge(r, storage, gauge, ts, value);
     }
 
-    return NGX_CONF_OK;
-}
-
-static char *
-ngx_http_graphite_param_arg_interval(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
-
-    ngx_http_graphite_allocator_t *allocator = context->storage->allocator;
-    ngx_http_graphite_param_t *param = (ngx_http_graphite_param_t*)data;
-    ngx_http_graphite_interval_t *interval = &param->interval;
+    /* values of lua params are not requests, so they are sampled at random */
+    ngx_uint_t sample = data->sample << storage->degradation;
+    ngx_uint_t n = (sample == 1 || (ngx_uint_t)ngx_random() % sample == 0) ? data->statistics->nelts : 0;
 
-    interval->name.data = ngx_http_graphite_allocator_alloc(allocator, value->len);
-    if (!interval->name.data) {
-        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
-        return NGX_CONF_ERROR;
+    for (i = 0; i < n; i++) {
+        ngx_uint_t s = ((ngx_uint_t*)data->statistics->elts)[i];
+        ngx_http_graphite_statistic_t *statistic = &((ngx_http_graphite_statistic_t*)storage->statistics->elts)[s];
+        ngx_http_graphite_param_t *param = &((ngx_http_graphite_param_t*)storage->params->elts)[statistic->param];
+        ngx_http_graphite_add_statistic(r, storage, statistic, ts, value, param->percentile);
     }
+}
 
-    ngx_memcpy(interval->name.data, value->data, value->len);
-    interval->name.len = value->len;
+static ngx_uint_t
+ngx_http_graphite_plan_sampled(const ngx_http_graphite_plan_t *plan, ngx_uint_t sampled, ngx_uint_t degradation) {
 
-    if (ngx_http_graphite_parse_time(context, value, &interval->value) == NGX_CONF_ERROR) {
-        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite param interval is invalid");
-        return NGX_CONF_ERROR;
+    ngx_uint_t i;
+    for (i = 0; i < plan->nentries; i++) {
+        const ngx_http_graphite_plan_entry_t *entry = &plan->entries[i];
+        if (entry->kind == PLAN_STATISTIC && sampled % (entry->sample << degradation) == 0)
+            return 1;
     }
 
-    return NGX_CONF_OK;
+    return 0;
 }
 
-static char *
-ngx_http_graphite_param_arg_percentile(ngx_http_graphite_context_t *context, void *data, ngx_str_t *value) {
+static void
+ngx_http_graphite_add_plan_values(ngx_http_request_t *r, ngx_http_graphite_storage_t *storage, time_t ts, const ngx_http_graphite_plan_t *plan, const double *values, const u_char *filters, const ngx_http_graphite_key_t *keys, ngx_uint_t sampled, ngx_uint_t degradation) {
 
-    ngx_http_graphite_param_t *param = (ngx_http_graphite_param_t*)data;
+    ngx_uint_t a = ((ts - storage->start_time) % (storage->max_interval + 1));
 
-    ngx_uint_t i;
-    ngx_uint_t s = 0;
-    for (i = 0; i <= value->len; i++) {
+    ngx_uint_t g;
+    for (g = 0; g < plan->ngroups; g++) {
+        const ngx_http_graphite_plan_group_t *group = &plan->groups[g];
 
-        if (i == value->len || value->data[i] == '|') {
+        if (group->main && r != r->main)
+            continue;
 
-            if (i == s) {
-                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite param percentile is empty");
-                return NGX_CONF_ERROR;
-            }
+        if (group->filter != FILTER_NONE && !filters[group->filter])
+            continue;
 
-            ngx_int_t p = ngx_atofp(&value->data[s], i - s, 3);
-            if (p == NGX_ERROR || p <= 0 || p > 100000) {
-                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite param percentile is invalid");
-                return NGX_CONF_ERROR;
-            }
+        ngx_uint_t i;
+        for (i = group->start; i < group->counters; i++) {
+            const ngx_http_graphite_plan_entry_t *entry = &plan->entries[i];
+            double value = (entry->kind != PLAN_VECTOR || entry->source->bounds) ? values[entry->value] : 0;
 
-            ngx_uint_t *percentile = ngx_http_graphite_array_push(param->percentiles);
-            if (!percentile) {
-                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
-                return NGX_CONF_ERROR;
+            if (entry->kind == PLAN_METRIC) {
+                ((double*)entry->data)[a * entry->stride] += value;
+                entry->counts[a * entry->stride]++;
             }
-            *percentile = p;
-
-
-            s = i + 1;
+            else if (entry->kind == PLAN_FOLD)
+                ngx_http_graphite_fold_value(entry->op, &((double*)entry->data)[a * entry->stride], &entry->counts[a * entry->stride], entry->squares ? &entry->squares[a * entry->stride] : NULL, value);
+            else if (entry->kind == PLAN_GAUGE)
+                ((ngx_http_graphite_gauge_data_t*)entry->data)->value += value;
+            else if (entry->kind == PLAN_STATISTIC) {
+                ngx_uint_t sample = entry->sample << degradation;
+                if (sample == 1 || sampled % sample == 0)
+                    ngx_http_graphite_add_statistic_data(entry->data, value);
+            }
+            else if (entry->source->add)
+                entry->source->add(entry->source, &keys[entry->value], &((uint32_t*)entry->data)[a * entry->source->cells]);
+            else if (entry->source->bounds)
+                ((uint32_t*)entry->data)[a * entry->source->cells + ngx_http_graphite_buckets_cell(entry->source, value)]++;
+            else
+                entry->source->count(entry->source, r, &((uint32_t*)entry->data)[a * entry->source->cells]);
         }
     }
-
-    return NGX_CONF_OK;
 }
 
-static ngx_uint_t
-ngx_http_graphite_add_split(ngx_conf_t *cf, const ngx_str_t *name) {
-
-    ngx_http_graphite_main_conf_t *gmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_graphite_module);
+static void
+ngx_http_graphite_add_plan_counters(ngx_http_request_t *r, ngx_http_graphite_storage_t *storage, time_t ts, const ngx_http_graphite_plan_t *plan, const double *values, const u_char *filters) {
 
-    ngx_array_t *splits = gmcf->splits;
+    ngx_uint_t a = ((ts - storage->start_time) % (storage->max_interval + 1));
 
-    ngx_uint_t s = SPLIT_EMPTY;
+    ngx_uint_t g;
+    for (g = 0; g < plan->ngroups; g++) {
+        const ngx_http_graphite_plan_group_t *group = &plan->groups[g];
 
-    ngx_uint_t i = 0;
-    for (i = 0; i < splits->nelts; i++) {
-        ngx_str_t *split = &((ngx_str_t*)splits->elts)[i];
-        if ((split->len == name->len) && !ngx_strncmp(split->data, name->data, name->len)) {
-            s = i;
-            break;
-        }
-    }
+        if (group->main && r != r->main)
+            continue;
 
-    if (s == SPLIT_EMPTY) {
+        if (group->filter != FILTER_NONE && !filters[group->filter])
+            continue;
 
-        s = splits->nelts;
+        ngx_uint_t i;
+        for (i = group->counters; i < group->end; i++) {
+            const ngx_http_graphite_plan_entry_t *entry = &plan->entries[i];
 
-        ngx_str_t *split = ngx_array_push(splits);
-        if (!split) {
-            ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite can't alloc memory");
-            return SPLIT_EMPTY;
+            ngx_atomic_fetch_add(&((ngx_atomic_t*)entry->data)[a * entry->stride], (ngx_atomic_int_t)values[entry->value]);
+            ngx_atomic_fetch_add((ngx_atomic_t*)&entry->counts[a * entry->stride], 1);
         }
+    }
+}
 
-        split->data = ngx_pstrdup(cf->pool, (ngx_str_t*)name);
-        if (!split->data) {
-            ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite can't alloc memory");
-            return SPLIT_EMPTY;
-        }
+static void
+ngx_http_graphite_add_internal_values(ngx_http_request_t *r, ngx_http_graphite_storage_t *storage, const ngx_http_graphite_internal_value_t *internal_values, ngx_uint_t n) {
 
-        split->len = name->len;
+    ngx_uint_t i;
+    for (i = 0; i < n; i++) {
+        const ngx_http_graphite_internal_value_t *internal_value = &internal_values[i];
+        ngx_http_graphite_internal_t *internal = internal_value->internal;
+        ngx_http_graphite_add_data_values(r, storage, internal_value->ts, &internal->data, internal_value->value);
     }
-
-    return s;
 }
 
-static char *
-ngx_http_graphite_add_default_data(ngx_conf_t *cf, ngx_array_t *datas, const ngx_str_t *location, const ngx_str_t *server_name, const ngx_array_t *template, const ngx_array_t *params, const ngx_http_complex_value_t *filter) {
-
-    if (template->nelts == 0)
-        return NGX_CONF_OK;
+static ngx_uint_t ngx_http_graphite_budget_time = 0;
+static ngx_uint_t ngx_http_graphite_budget_samples = 0;
 
-    const ngx_str_t *variables[] = DEFAULT_DATA_VARIABLES(location, server_name);
+/*
+ * Every BUDGET_SAMPLES measured requests of the worker the average handler
+ * time, lock wait included, is compared with the budget. Over the budget
+ * the degradation is raised, and statistics are updated with 1/2^level of
+ * the requests, under the half of it the degradation is lowered again.
+ */
+static void
+ngx_http_graphite_check_budget(ngx_http_graphite_main_conf_t *gmcf, ngx_http_graphite_storage_t *storage, ngx_uint_t time) {
 
-    ngx_str_t split;
-    split.len = ngx_http_graphite_template_len(template, variables);
-    if (split.len == 0)
-        return NGX_CONF_ERROR;
+    ngx_http_graphite_budget_time += time;
+    if (++ngx_http_graphite_budget_samples < BUDGET_SAMPLES)
+        return;
 
-    split.data = ngx_palloc(cf->pool, split.len);
-    if (!split.data)
-        return NGX_CONF_ERROR;
+    ngx_uint_t average = ngx_http_graphite_budget_time / ngx_http_graphite_budget_samples;
+    ngx_http_graphite_budget_time = 0;
+    ngx_http_graphite_budget_samples = 0;
 
-    ngx_http_graphite_template_execute(split.data, split.len, template, variables);
+    ngx_atomic_uint_t degradation = storage->degradation;
 
-    return ngx_http_graphite_add_data(cf, datas, &split, params, filter);
+    if (average > gmcf->budget && degradation < DEGRADATION_MAX)
+        ngx_atomic_cmp_set(&storage->degradation, degradation, degradation + 1);
+    else if (average * 2 < gmcf->budget && degradation > 0)
+        ngx_atomic_cmp_set(&storage->degradation, degradation, degradation - 1);
 }
 
-static char *
-ngx_http_graphite_add_data(ngx_conf_t *cf, ngx_array_t *datas, const ngx_str_t *split, const ngx_array_t *params, const ngx_http_complex_value_t *filter) {
+static ngx_int_t
+ngx_http_graphite_handler(ngx_http_request_t *r) {
 
-    ngx_http_graphite_context_t context = ngx_http_graphite_context_from_config(cf);
-    ngx_http_graphite_main_conf_t *gmcf = context.gmcf;
+    ngx_http_graphite_main_conf_t *gmcf = ngx_http_get_module_main_conf(r, ngx_http_graphite_module);
 
-    ngx_uint_t s = ngx_http_graphite_add_split(cf, split);
-    if (s == SPLIT_EMPTY)
-        return NGX_CONF_ERROR;
+    /*
+     * Requests are measured at random: a counter would move in step with
+     * the sampling counters of a busy location and always measure requests
+     * that update its statistics or never, hiding what degradation saves.
+     */
+    if (!gmcf->enable || !(gmcf->self || gmcf->budget) || (ngx_uint_t)ngx_random() % HANDLER_SAMPLE_RATE != 0)
+        return ngx_http_graphite_handler2(r);
 
-    ngx_http_graphite_data_t *data = ngx_array_push(datas);
-    if (!data) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "graphite can't alloc memory");
-        return NGX_CONF_ERROR;
-    }
-    if (ngx_http_graphite_init_data(&context, data) == NGX_ERROR)
-        return NGX_CONF_ERROR;
+    ngx_uint_t start = ngx_http_graphite_usec();
 
-    if (params->nelts == 0)
-        params = gmcf->default_params;
+    ngx_int_t rc = ngx_http_graphite_handler2(r);
 
-    ngx_uint_t i;
-    for (i = 0; i < params->nelts; i++) {
-        ngx_uint_t p = ((ngx_uint_t*)params->elts)[i];
-        ngx_http_graphite_param_t *param = &((ngx_http_graphite_param_t*)gmcf->storage->params->elts)[p];
+    ngx_uint_t time = ngx_http_graphite_usec() - start;
 
-        if (param->source != SOURCE_INTERNAL) {
-            ngx_http_graphite_source_t *source = &((ngx_http_graphite_source_t*)gmcf->sources->elts)[param->source];
+    ngx_slab_pool_t *shpool = (ngx_slab_pool_t*)gmcf->shared->shm.addr;
+    ngx_http_graphite_storage_t *storage = (ngx_http_graphite_storage_t*)shpool->data;
 
-            if (source->type != 0) {
-                if ((cf->cmd_type & NGX_HTTP_MAIN_CONF) && !(source->type & NGX_HTTP_MAIN_CONF))
-                    continue;
-                if ((cf->cmd_type & NGX_HTTP_SRV_CONF) && !(source->type & NGX_HTTP_SRV_CONF))
-                    continue;
-                if ((cf->cmd_type & NGX_HTTP_LOC_CONF) && !(source->type & NGX_HTTP_LOC_CONF))
-                    continue;
-            }
-        }
-        ngx_http_graphite_add_param_to_data(&context, s, p, data);
+    if (gmcf->self) {
+        ngx_atomic_fetch_add(&storage->stat.handler_time, time);
+        ngx_atomic_fetch_add(&storage->stat.handler_samples, 1);
     }
 
-    data->filter = (ngx_http_complex_value_t*)filter;
+    if (gmcf->budget)
+        ngx_http_graphite_check_budget(gmcf, storage, time);
 
-    return NGX_CONF_OK;
+    return rc;
 }
 
-static ngx_uint_t
-ngx_http_graphite_get_source(ngx_http_graphite_context_t *context, ngx_str_t *name) {
+static ngx_int_t
+ngx_http_graphite_handler2(ngx_http_request_t *r) {
 
-    if (context->phase != PHASE_CONFIG)
-        return NGX_ERROR;
+    ngx_http_graphite_main_conf_t *gmcf = ngx_http_get_module_main_conf(r, ngx_http_graphite_module);
+    ngx_http_graphite_loc_conf_t *glcf = ngx_http_get_module_loc_conf(r, ngx_http_graphite_module);
 
-    ngx_http_graphite_main_conf_t *gmcf = context->gmcf;
+    if (!gmcf->enable)
+        return NGX_OK;
 
-    ngx_uint_t c;
-    for (c = 0; c < gmcf->sources->nelts; c++) {
-        ngx_http_graphite_source_t *source = &((ngx_http_graphite_source_t*)gmcf->sources->elts)[c];
-        if ((source->name.len == name->len) && !ngx_strncmp(source->name.data, name->data, name->len))
-            return c;
-    }
+    ngx_http_graphite_plan_t *plan = glcf->plan;
+    ngx_http_graphite_reqctx_t *reqctx = ngx_http_get_module_ctx(r->main, ngx_http_graphite_module);
 
-    for (c = 0; c < SOURCE_COUNT; c++) {
-        const ngx_http_graphite_source_t *source = &ngx_http_graphite_sources[c];
-        if (!source->re) {
-            if ((source->name.len == name->len) && !ngx_strncmp(source->name.data, name->data, name->len)) {
-                break;
-            }
-        }
-        else {
-            ngx_regex_compile_t rc;
-            ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
-            rc.pool = context->pool;
-            rc.pattern = source->name;
-            if (ngx_regex_compile(&rc) != NGX_OK) {
-                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't compile regex");
-                return NGX_ERROR;
-            }
+    if (plan->nentries == 0 && (reqctx == NULL || reqctx->nvalues == 0) && gmcf->internal_values->nelts == 0)
+        return NGX_OK;
 
-            if (ngx_regex_exec(rc.regex, (ngx_str_t*)name, NULL, 0) >= 0)
-                break;
-        }
-    }
+    ngx_slab_pool_t *shpool = (ngx_slab_pool_t*)gmcf->shared->shm.addr;
+    ngx_http_graphite_storage_t *storage = (ngx_http_graphite_storage_t*)shpool->data;
 
-    if (c == SOURCE_COUNT) {
-        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite unknow param %*s", name->len, name->data);
-        return NGX_ERROR;
-    }
+    time_t ts = ngx_time();
 
-    ngx_http_graphite_source_t *new_source = ngx_array_push(gmcf->sources);
-    if (!new_source) {
-        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
-        return NGX_ERROR;
+    /* the worker handles one request at a time, so values are kept in its scratch space */
+    double *values = ngx_http_graphite_get_plan_values(gmcf, plan, r);
+    u_char *filters = ngx_http_graphite_get_plan_filters(gmcf, plan, r);
+    ngx_uint_t degradation = storage->degradation;
+
+    /* the requests of every location are sampled on their own */
+    ngx_uint_t sampled = plan->requests++;
+    ngx_uint_t statistics = (plan->nstatistics != 0) ? ngx_http_graphite_plan_sampled(plan, sampled, degradation) : 0;
+
+    /* a plan of counters and skipped statistics only takes the lock to clear the seconds that are over */
+    if (plan->nlocked == (statistics ? 0 : plan->nstatistics) && (r != r->main || reqctx == NULL || reqctx->nvalues == 0) && gmcf->internal_values->nelts == 0
+        && (ngx_uint_t)storage->last_time + storage->max_interval >= (ngx_uint_t)ts)
+    {
+        ngx_http_graphite_add_plan_counters(r, storage, ts, plan, values, filters);
+        return NGX_OK;
     }
-    *new_source = ngx_http_graphite_sources[c];
-    new_source->name = *name;
 
-    return gmcf->sources->nelts - 1;
-}
+    ngx_uint_t locked = ngx_http_graphite_lock(shpool, LOCK_SITE_HANDLER);
 
-static ngx_http_graphite_param_t
-ngx_http_graphite_create_param(ngx_http_graphite_context_t *context, ngx_uint_t c) {
+    ngx_http_graphite_del_old_records(gmcf, ts);
 
-    ngx_http_graphite_main_conf_t *gmcf = context->gmcf;
+    ngx_http_graphite_add_plan_values(r, storage, ts, plan, values, filters, gmcf->scratch_keys, sampled, degradation);
 
-    ngx_http_graphite_source_t *source = &((ngx_http_graphite_source_t*)gmcf->sources->elts)[c];
+    if (r == r->main && reqctx != NULL) {
+        ngx_http_graphite_add_internal_values(r, storage, reqctx->values, ngx_min(reqctx->nvalues, REQCTX_INLINE_VALUES));
+        if (reqctx->internal_values != NULL)
+            ngx_http_graphite_add_internal_values(r, storage, reqctx->internal_values->elts, reqctx->internal_values->nelts);
+    }
 
-    ngx_http_graphite_param_t param;
-    ngx_memzero(&param, sizeof(ngx_http_graphite_param_t));
+    ngx_http_graphite_add_internal_values(r, storage, gmcf->internal_values->elts, gmcf->internal_values->nelts);
+    gmcf->internal_values->nelts = 0;
 
-    param.name = source->name;
-    param.source = c;
-    param.aggregate = source->aggregate;
+    ngx_http_graphite_unlock(shpool, LOCK_SITE_HANDLER, locked);
 
-    return param;
+    ngx_http_graphite_add_plan_counters(r, storage, ts, plan, values, filters);
+
+    return NGX_OK;
 }
 
-static char *
-ngx_http_graphite_parse_params(ngx_http_graphite_context_t *context, const ngx_str_t *value, ngx_array_t *params) {
+static ngx_int_t
+ngx_http_graphite_by_link2(ngx_http_request_t *r, ngx_http_graphite_main_conf_t *gmcf, const ngx_http_graphite_link_t *link, double value) {
 
-    ngx_http_graphite_main_conf_t *gmcf = context->gmcf;
+    if (link == NULL)
+        return NGX_OK;
 
-    ngx_uint_t i = 0;
-    ngx_uint_t s = 0;
-    ngx_uint_t q = NGX_CONF_UNSET_UINT;
-    for (i = 0; i <= value->len; i++) {
-        if (i == value->len || value->data[i] == '|') {
+    ngx_http_graphite_internal_value_t *internal_value = NULL;
+    if (r->connection->fd != (ngx_socket_t)-1) {
+        ngx_http_graphite_reqctx_t *reqctx = ngx_http_graphite_get_reqctx(r);
+        if (!reqctx)
+            return NGX_ERROR;
 
-            if (i == s) {
-                ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite params is empty");
-                return NGX_CONF_ERROR;
-            }
+        internal_value = ngx_http_graphite_reqctx_push(r, reqctx);
+    }
+    else {
+        internal_value = ngx_array_push(gmcf->internal_values);
+    }
 
-            if (i - s == 1 && value->data[s] == '*') {
-                if (params == gmcf->default_params) {
-                    ngx_str_t default_params = ngx_string(DEFAULT_PARAMS);
-                    if (ngx_http_graphite_parse_params(context, &default_params, params) == NGX_CONF_ERROR)
-                        return NGX_CONF_ERROR;
-                }
-                else {
-                    ngx_uint_t p;
-                    for (p = 0; p < gmcf->default_params->nelts; p++) {
-                        ngx_uint_t param = ((ngx_uint_t*)gmcf->default_params->elts)[p];
-                        if (ngx_http_graphite_add_param_to_params(context, param, params) != NGX_CONF_OK)
-                            return NGX_CONF_ERROR;
-                    }
-                }
-            }
-            else {
-                if (q == NGX_CONF_UNSET_UINT)
-                    q = i;
+    if (internal_value == NULL)
+        return NGX_ERROR;
 
-                ngx_str_t name;
-                name.data = &value->data[s];
-                name.len = q - s;
-                ngx_uint_t c = ngx_http_graphite_get_source(context, &name);
-                if ((ngx_int_t)c == NGX_ERROR)
-                    return NGX_CONF_ERROR;
+    internal_value->ts = ngx_time();
+    internal_value->internal = ngx_http_graphite_link2int(link);
+    internal_value->value = value;
 
-                ngx_http_graphite_param_t param = ngx_http_graphite_create_param(context, c);
+    return NGX_OK;
+}
 
-                if (q != i) {
-                    ngx_int_t percentile = ngx_atofp(&value->data[q + 1], i - q - 1, 3);
-                    if (percentile == NGX_ERROR || percentile <= 0 || percentile > 100000) {
-                        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite bad param %*s", i - s, &value->data[s]);
-                        return NGX_CONF_ERROR;
-                    }
+static ngx_array_t *
+ngx_http_graphite_create_param_args(ngx_pool_t *pool, const ngx_str_t *name, const ngx_str_t *config) {
 
-                    param.percentile = percentile;
-                }
+    ngx_array_t *args = ngx_array_create(pool, 4, sizeof(ngx_str_t));
+    if (args == NULL)
+        return NULL;
 
-                ngx_uint_t p = ngx_http_graphite_add_param_to_config(context, &param, NULL);
-                if ((ngx_int_t)p == NGX_ERROR)
-                    return NGX_CONF_ERROR;
+    ngx_array_push(args);
 
-                if (ngx_http_graphite_add_param_to_params(context, p, params) != NGX_CONF_OK)
-                    return NGX_CONF_ERROR;
-            }
+    ngx_str_t *n = ngx_array_push(args);
+    if (n == NULL) {
+        ngx_array_destroy(args);
+        return NULL;
+    }
 
-            s = i + 1;
-            q = NGX_CONF_UNSET_UINT;
+    n->data = ngx_palloc(pool, sizeof("name=") - 1 + name->len);
+    if (n->data == NULL) {
+        ngx_array_destroy(args);
+        return NULL;
+    }
+
+    n->len = ngx_sprintf(n->data, "name=%V", name) - n->data;
+
+    const u_char *p = config->data;
+    const u_char *config_end = p + config->len;
+    while (p < config_end) {
+        while (isspace(*p))
+            p++;
+        const u_char *begin = p;
+        while (*p && !isspace(*p))
+            p++;
+        const u_char *end = p;
+
+        if (end - begin != 0) {
+            ngx_str_t *arg = ngx_array_push(args);
+            if (arg == NULL) {
+                ngx_array_destroy(args);
+                return NULL;
+            }
+            arg->data = (u_char*)begin;
+            arg->len = end - begin;
         }
-        if (value->data[i] == '/')
-            q = i;
+        else
+            break;
     }
 
-    return NGX_CONF_OK;
+    return args;
 }
 
-static char *
-ngx_http_graphite_parse_string(ngx_http_graphite_context_t *context, ngx_str_t *value, ngx_str_t *result) {
+static const ngx_http_graphite_link_t *
+ngx_http_graphite_link2(ngx_http_graphite_context_t *context, const ngx_str_t *name, const ngx_str_t *config) {
 
-    ngx_http_graphite_allocator_t *allocator = context->storage->allocator;
+    ngx_http_graphite_main_conf_t *gmcf = context->gmcf;
+    const ngx_http_graphite_link_t *link;
 
-    result->data = ngx_http_graphite_allocator_alloc(allocator, value->len);
-    if (!result->data) {
-        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
-        return NGX_CONF_ERROR;
-    }
+    if (gmcf->links == NULL)
+        return ngx_http_graphite_link_storage(context, name, config);
 
-    ngx_memcpy(result->data, value->data, value->len);
-    result->len = value->len;
+    link = ngx_http_graphite_hash_find(gmcf->links, name);
+    if (link != NULL)
+        return link;
 
-    return NGX_CONF_OK;
+    link = ngx_http_graphite_link_storage(context, name, config);
+    if (link != NULL) {
+        ngx_http_graphite_internal_t *internal = ngx_http_graphite_link2int(link);
+        /* the cache is only an optimization, so a failed insert isn't an error */
+        ngx_http_graphite_hash_add(gmcf->links, &internal->name, internal);
+    }
+
+    return link;
 }
 
-static char *
-ngx_http_graphite_parse_size(ngx_http_graphite_context_t *context, ngx_str_t *value, ngx_uint_t *result) {
+static const ngx_http_graphite_link_t *
+ngx_http_graphite_link_storage(ngx_http_graphite_context_t *context, const ngx_str_t *name, const ngx_str_t *config) {
 
-    if (!result)
-        return NGX_CONF_ERROR;
+    ngx_slab_pool_t *shpool = (ngx_slab_pool_t*)context->gmcf->shared->shm.addr;
+    ngx_http_graphite_storage_t *storage = (ngx_http_graphite_storage_t*)shpool->data;
+    const ngx_http_graphite_link_t *link;
 
-    size_t len = 0;
-    while (len < value->len && value->data[len] >= '0' && value->data[len] <= '9')
-        len++;
+    link = ngx_http_graphite_search_param_link(storage->internals, name);
 
-    *result = ngx_atoi(value->data, len);
-    if (*result == (ngx_uint_t)-1)
-        return NGX_CONF_ERROR;
+    if (link != NULL || config == NULL || config->len == 0)
+        return link;
 
-    if (len + 1 == value->len) {
-        if (value->data[len] == 'b')
-            *result *= 1;
-        else if (value->data[len] == 'k')
-            *result *= 1024;
-        else if (value->data[len] == 'm')
-            *result *= 1024 * 1024;
-        else
-            return NGX_CONF_ERROR;
+    if (storage->allocator->nomemory) {
+        /*
+         * Note that at this moment the parameter may already be present in the
+         * pool, if it have just been added by another writer. The
+         * storage->allocator->nomemory may occur after successfull adding.
+         * We allow that inconsistence here.
+         */
+        return NULL;
+    }
 
-        len++;
+    /* will add a new internal */
+    ngx_uint_t locked = ngx_http_graphite_wlock(storage, LOCK_SITE_PARAM);
+    link = ngx_http_graphite_search_param_link(storage->internals, name);
+    if (link != NULL) {
+        /* another writer have added a new internal for us; we won't add it then */
+        ngx_http_graphite_wunlock(storage, LOCK_SITE_PARAM, locked);
+        return link;
     }
 
-    if (len != value->len)
-        return NGX_CONF_ERROR;
+    /* we'll do really add a new internal */
+    ngx_array_t *args = ngx_http_graphite_create_param_args(context->pool, name, config);
+    if (args == NULL)
+        goto fail_locked;
+    ngx_http_graphite_param_t param;
+    if (ngx_http_graphite_parse_param_args(context, args, &param) != NGX_OK)
+        goto fail_locked;
 
-    return NGX_CONF_OK;
+    ngx_http_graphite_internal_t *internal = ngx_http_graphite_add_internal(context, &param);
+    if (internal == NULL)
+        goto fail_locked_param;
+
+    ngx_http_graphite_wunlock(storage, LOCK_SITE_PARAM, locked);
+    return link;
+
+fail_locked_param:
+    #if 0
+    /*
+     * ngx_http_graphite_add_internal() now doesn't always restore the original
+     * state on errors. So, to not crash, we cannot clear param here.
+     */
+    ngx_http_graphite_clear_param_args(context, &param);
+    #endif
+fail_locked:
+    ngx_http_graphite_wunlock(storage, LOCK_SITE_PARAM, locked);
+    return NULL;
 }
 
-static char *
-ngx_http_graphite_parse_time(ngx_http_graphite_context_t *context, ngx_str_t *value, ngx_uint_t *result) {
+ngx_int_t
+ngx_http_graphite(ngx_http_request_t *r, const ngx_str_t *name, double value, const ngx_str_t *config) {
 
-    if (!result)
-        return NGX_CONF_ERROR;
+    ngx_http_graphite_context_t context = ngx_http_graphite_context_from_request(r);
+    ngx_http_graphite_main_conf_t *gmcf = context.gmcf;
 
-    size_t len = 0;
-    while (len < value->len && value->data[len] >= '0' && value->data[len] <= '9')
-        len++;
+    if (!gmcf->enable)
+        return NGX_OK;
 
-    *result = ngx_atoi(value->data, len);
-    if (*result == (ngx_uint_t)-1)
-        return NGX_CONF_ERROR;
+    const ngx_http_graphite_link_t *link = ngx_http_graphite_link2(&context, name, config);
 
-    if (len + 1 == value->len) {
-        if (value->data[len] == 's')
-            *result *= 1;
-        else if (value->data[len] == 'm')
-            *result *= 60;
-        else
-            return NGX_CONF_ERROR;
+    return ngx_http_graphite_by_link2(r, gmcf, link, value);
+}
 
-        len++;
-    }
+ngx_int_t
+ngx_http_graphite_by_link(ngx_http_request_t *r, const ngx_http_graphite_link_t *link, double value) {
 
-    if (len != value->len)
-        return NGX_CONF_ERROR;
+    ngx_http_graphite_context_t context = ngx_http_graphite_context_from_request(r);
+    ngx_http_graphite_main_conf_t *gmcf = context.gmcf;
 
-    return NGX_CONF_OK;
+    if (!gmcf->enable)
+        return NGX_OK;
+
+    return ngx_http_graphite_by_link2(r, gmcf, link, value);
 }
 
-static char *
-ngx_http_graphite_template_compile(ngx_http_graphite_context_t *context, ngx_array_t *template, const ngx_http_graphite_template_arg_t *args, size_t nargs, const ngx_str_t *value) {
+ngx_slab_pool_t *
+ngx_http_graphite_shpool(ngx_http_request_t *r) {
 
-    ngx_http_graphite_allocator_t *allocator = context->storage->allocator;
+    ngx_http_graphite_context_t context = ngx_http_graphite_context_from_request(r);
+    ngx_http_graphite_main_conf_t *gmcf = context.gmcf;
 
-    ngx_uint_t i = 0;
-    ngx_uint_t s = 0;
+    if (!gmcf->enable)
+        return NULL;
+    return (ngx_slab_pool_t*)gmcf->shared->shm.addr;
+}
 
-    typedef enum {
-        TEMPLATE_STATE_ERROR = -1,
-        TEMPLATE_STATE_NONE,
-        TEMPLATE_STATE_VAR,
-        TEMPLATE_STATE_BRACKET_VAR,
-        TEMPLATE_STATE_VAR_START,
-        TEMPLATE_STATE_BRACKET_VAR_START,
-        TEMPLATE_STATE_BRACKET_VAR_END,
-        TEMPLATE_STATE_NOP,
-    } ngx_http_graphite_template_parser_state_t;
+const ngx_http_graphite_link_t *
+ngx_http_graphite_link(ngx_http_request_t *r, const ngx_str_t *name, const ngx_str_t *config) {
 
-    typedef enum {
-        TEMPLATE_LEXEM_ERROR = -1,
-        TEMPLATE_LEXEM_VAR,
-        TEMPLATE_LEXEM_BRACKET_OPEN,
-        TEMPLATE_LEXEM_BRACKET_CLOSE,
-        TEMPLATE_LEXEM_ALNUM,
-        TEMPLATE_LEXEM_OTHER,
-        TEMPLATE_LEXEM_END,
-    } ngx_http_graphite_template_parser_lexem_t;
+    ngx_http_graphite_context_t context = ngx_http_graphite_context_from_request(r);
+    ngx_http_graphite_main_conf_t *gmcf = context.gmcf;
 
-    ngx_http_graphite_template_parser_state_t state = TEMPLATE_STATE_NONE;
-    ngx_http_graphite_template_parser_lexem_t lexem;
+    if (!gmcf->enable)
+        return NULL;
 
-    ngx_http_graphite_template_parser_state_t parser[TEMPLATE_STATE_BRACKET_VAR_END + 1][TEMPLATE_LEXEM_END + 1] = {
-        { 1,  6,  6,  6,  6,  0},
-        { 0,  2, -1,  3, -1, -1},
-        {-1, -1, -1,  4, -1, -1},
-        { 0,  0,  0,  6,  0,  0},
-        {-1, -1,  5,  6, -1, -1},
-        { 0,  0,  0,  0,  0,  0},
-    };
+    const ngx_http_graphite_link_t *link = ngx_http_graphite_link2(&context, name, config);
 
-    for (i = 0; i <= value->len; i++) {
-        if (i == value->len)
-            lexem = TEMPLATE_LEXEM_END;
-        else if (value->data[i] == '$')
-            lexem = TEMPLATE_LEXEM_VAR;
-        else if (value->data[i] == '(')
-            lexem = TEMPLATE_LEXEM_BRACKET_OPEN;
-        else if (value->data[i] == ')')
-            lexem = TEMPLATE_LEXEM_BRACKET_CLOSE;
-        else if (isalnum(value->data[i]))
-            lexem = TEMPLATE_LEXEM_ALNUM;
-        else
-            lexem = TEMPLATE_LEXEM_OTHER;
+    return link;
+}
 
-        ngx_int_t new_state = parser[state][lexem];
+static double
+ngx_http_graphite_get_by_link2(ngx_slab_pool_t *shpool, const ngx_http_graphite_link_t *link) {
 
-        if (new_state == TEMPLATE_LEXEM_ERROR)
-            return NGX_CONF_ERROR;
+    if (link == NULL)
+        return 0;
 
-        if (new_state != TEMPLATE_STATE_NOP) {
+    ngx_http_graphite_storage_t *storage = shpool->data;
+    ngx_http_graphite_internal_t *internal = ngx_http_graphite_link2int(link);
+    double value = 0;
 
-            if (i != s && (state == TEMPLATE_STATE_NONE || state == TEMPLATE_STATE_VAR_START || state == TEMPLATE_STATE_BRACKET_VAR_START)) {
+    ngx_uint_t locked = ngx_http_graphite_lock(shpool, LOCK_SITE_GET);
 
-                ngx_http_graphite_template_t *arg = ngx_array_push(template);
-                if (!arg) {
-                    ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
-                    return NGX_CONF_ERROR;
-                }
+    ngx_http_graphite_data_t *data = &internal->data;
+    if (data->gauges->nelts) {
+        ngx_uint_t g = ((ngx_uint_t*)data->gauges->elts)[0];
+        ngx_http_graphite_gauge_t *gauge = &((ngx_http_graphite_gauge_t*)storage->gauges->elts)[g];
+        ngx_http_graphite_gauge_data_t *gauge_data = gauge->data;
+        value = gauge_data->value;
+    }
+    ngx_http_graphite_unlock(shpool, LOCK_SITE_GET, locked);
+    return value;
+}
 
-                if (state == TEMPLATE_STATE_NONE) {
-                    arg->data.data = ngx_http_graphite_allocator_alloc(allocator, i - s);
-                    if (!arg->data.data) {
-                        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite can't alloc memory");
-                        return NGX_CONF_ERROR;
-                    }
-                    ngx_memcpy(arg->data.data, value->data + s, i - s);
-                    arg->data.len = i - s;
-                    arg->variable = 0;
-                }
-                else if (state == TEMPLATE_STATE_VAR_START || state == TEMPLATE_STATE_BRACKET_VAR_START) {
-                    ngx_uint_t found = 0;
-                    size_t a;
-                    for (a = 0; a < nargs; a++) {
-                        if ((args[a].name.len == i - s) && !ngx_strncmp(args[a].name.data, &value->data[s], i - s)) {
-                            found = 1;
-                            arg->variable = args[a].variable;
-                            arg->data.data = NULL;
-                            arg->data.len = 0;
-                        }
-                    }
+double
+ngx_http_graphite_get(ngx_http_request_t *r, const ngx_str_t *name) {
 
-                    if (!found) {
-                        ngx_log_error(NGX_LOG_ERR, context->log, 0, "graphite unknow template arg %*s", i - s, &value->data[s]);
-                        return NGX_CONF_ERROR;
-                    }
-                }
-            }
+    ngx_http_graphite_context_t context = ngx_http_graphite_context_from_request(r);
+    ngx_http_graphite_main_conf_t *gmcf = context.gmcf;
+
+    if (!gmcf->enable)
+        return 0;
 
-            s = i;
-            state = new_state;
-        }
-    }
+    ngx_slab_pool_t *shpool = (ngx_slab_pool_t*)gmcf->shared->shm.addr;
+    const ngx_http_graphite_link_t *link = ngx_http_graphite_link2(&context, name, NULL);
 
-    return NGX_CONF_OK;
+    return ngx_http_graphite_get_by_link2(shpool, link);
 }
 
-static u_char *
-ngx_http_graphite_template_execute(u_char* buffer, size_t buffer_size, const ngx_array_t *template, const ngx_str_t *variables[]) {
+double
+ngx_http_graphite_get_by_link(ngx_http_request_t *r, const ngx_http_graphite_link_t *link) {
 
-    u_char *b = buffer;
+    if (link == NULL)
+        return 0;
 
-    ngx_uint_t i;
-    for (i = 0; i < template->nelts; i++) {
-        ngx_http_graphite_template_t *arg = &((ngx_http_graphite_template_t*)template->elts)[i];
-        const ngx_str_t *data = NULL;
+    ngx_http_graphite_context_t context = ngx_http_graphite_context_from_request(r);
+    ngx_http_graphite_main_conf_t *gmcf = context.gmcf;
 
-        if (arg->data.len)
-            data = &arg->data;
-        else
-            data = variables[arg->variable];
+    if (!gmcf->enable)
+        return 0;
 
-        b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V", data);
-    }
+    ngx_slab_pool_t *shpool = (ngx_slab_pool_t*)gmcf->shared->shm.addr;
 
-    return b;
+    return ngx_http_graphite_get_by_link2(shpool, link);
 }
 
-static size_t
-ngx_http_graphite_template_len(const ngx_array_t *template, const ngx_str_t *variables[]) {
+ngx_int_t
+ngx_http_graphite_set_by_link2(ngx_slab_pool_t *shpool, const ngx_http_graphite_link_t *link, double value) {
 
-    size_t len = 0;
+    if (link == NULL)
+        return NGX_ERROR;
 
-    ngx_uint_t i;
-    for (i = 0; i < template->nelts; i++) {
-        ngx_http_graphite_template_t *arg = &((ngx_http_graphite_template_t*)template->elts)[i];
+    ngx_http_graphite_storage_t *storage = shpool->data;
+    ngx_http_graphite_internal_t *internal = ngx_http_graphite_link2int(link);
 
-        if (arg->data.len)
-            len += arg->data.len;
-        else
-            len += variables[arg->variable]->len;
-    }
+    ngx_uint_t locked = ngx_http_graphite_lock(shpool, LOCK_SITE_SET);
 
-    return len;
+    ngx_http_graphite_data_t *data = &internal->data;
+    if (data->gauges->nelts) {
+        ngx_uint_t g = ((ngx_uint_t*)data->gauges->elts)[0];
+        ngx_http_graphite_gauge_t *gauge = &((ngx_http_graphite_gauge_t*)storage->gauges->elts)[g];
+        ngx_http_graphite_gauge_data_t *gauge_data = gauge->data;
+        gauge_data->value = value;
+    }
+    else {
+        ngx_http_graphite_unlock(shpool, LOCK_SITE_SET, locked);
+        return NGX_ERROR;
+    }
+    ngx_http_graphite_unlock(shpool, LOCK_SITE_SET, locked);
+    return NGX_OK;
 }
 
-static ngx_http_complex_value_t *
-ngx_http_graphite_complex_compile(ngx_conf_t *cf, ngx_str_t *value) {
+ngx_int_t
+ngx_http_graphite_set(ngx_http_request_t *r, const ngx_str_t *name, double value) {
 
-    ngx_http_compile_complex_value_t ccv;
-    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+    ngx_http_graphite_context_t context = ngx_http_graphite_context_from_request(r);
+    ngx_http_graphite_main_conf_t *gmcf = context.gmcf;
 
-    ccv.cf = cf;
-    ccv.value = value;
-    ccv.complex_value = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
-    if (ccv.complex_value == NULL)
-        return NULL;
+    if (!gmcf->enable)
+        return NGX_OK;
 
-    if (ngx_http_compile_complex_value(&ccv) != NGX_OK)
-        return NULL;
+    ngx_slab_pool_t *shpool = (ngx_slab_pool_t*)gmcf->shared->shm.addr;
+    const ngx_http_graphite_link_t *link = ngx_http_graphite_link2(&context, name, NULL);
 
-    return ccv.complex_value;
+    return ngx_http_graphite_set_by_link2(shpool, link, value);
 }
 
-static void
-ngx_http_graphite_statistic_init(ngx_http_graphite_statistic_data_t *data, ngx_uint_t percentile) {
+ngx_int_t
+ngx_http_graphite_set_by_link(ngx_http_request_t *r, const ngx_http_graphite_link_t *link, double value) {
+
+    ngx_http_graphite_context_t context = ngx_http_graphite_context_from_request(r);
+    ngx_http_graphite_main_conf_t *gmcf = context.gmcf;
 
-    ngx_memzero(data, sizeof(ngx_http_graphite_statistic_data_t));
+    if (!gmcf->enable)
+        return NGX_OK;
 
-    double p = (double)percentile / 100000;
+    ngx_slab_pool_t *shpool = (ngx_slab_pool_t*)gmcf->shared->shm.addr;
 
-    data->dn[P2_METRIC_COUNT - 1] = 1;
-    data->dn[P2_METRIC_COUNT / 2] = p;
+    return ngx_http_graphite_set_by_link2(shpool, link, value);
+}
 
-    size_t i;
-    for (i = 1; i < P2_METRIC_COUNT / 2; i++)
-        data->dn[i] = (p / (P2_METRIC_COUNT / 2)) * i;
-    for (i = P2_METRIC_COUNT / 2 + 1; i < P2_METRIC_COUNT - 1; i++)
-        data->dn[i] = p + ((1 - p) / (P2_METRIC_COUNT - 1 - P2_METRIC_COUNT / 2)) * (i - P2_METRIC_COUNT / 2);
+static void
+ngx_http_graphite_reduce_metrics(ngx_http_graphite_main_conf_t *gmcf, ngx_http_graphite_storage_t *storage, const ngx_http_graphite_interval_t *interval, time_t ts) {
 
-    for (i = 0; i < P2_METRIC_COUNT; i++) {
-        data->np[i] = (P2_METRIC_COUNT - 1) * data->dn[i] + 1;
-        data->n[i] = i + 1;
+    ngx_memzero(gmcf->reduce_values, sizeof(double) * storage->metric_stride);
+    ngx_memzero(gmcf->reduce_counts, sizeof(ngx_uint_t) * storage->metric_stride);
+    ngx_memzero(gmcf->reduce_ints, sizeof(ngx_atomic_uint_t) * storage->metric_stride);
+
+    unsigned l;
+    for (l = 0; l < interval->value; l++) {
+        if ((time_t)(ts - l - 1) >= storage->start_time) {
+            ngx_uint_t a = ((ts - l - 1 - storage->start_time) % (storage->max_interval + 1)) * storage->metric_stride;
+            ngx_http_graphite_reduce_add(gmcf->reduce_values, gmcf->reduce_counts, &storage->metric_values[a], &storage->metric_counts[a], storage->metric_stride);
+            ngx_http_graphite_reduce_add_ints(gmcf->reduce_ints, &storage->metric_ints[a], storage->metric_stride);
+        }
+    }
+
+    /* a child is never a parent, so one pass adds whole subtrees */
+    ngx_uint_t i;
+    for (i = 0; i < gmcf->rollups->nelts; i++) {
+        const ngx_http_graphite_rollup_t *rollup = &((ngx_http_graphite_rollup_t*)gmcf->rollups->elts)[i];
+        gmcf->reduce_values[rollup->parent] += gmcf->reduce_values[rollup->child];
+        gmcf->reduce_counts[rollup->parent] += gmcf->reduce_counts[rollup->child];
+        gmcf->reduce_ints[rollup->parent] += gmcf->reduce_ints[rollup->child];
     }
 }
 
-static ngx_int_t
-ngx_http_graphite_shared_init(ngx_shm_zone_t *shm_zone, void *data)
-{
-    ngx_http_graphite_main_conf_t *gmcf = shm_zone->data;
+static void
+ngx_http_graphite_fold_metric(ngx_http_graphite_storage_t *storage, const ngx_http_graphite_metric_t *metric, const ngx_http_graphite_interval_t *interval, time_t ts, ngx_http_graphite_metric_data_t *aggregate) {
 
-    if (data) {
-        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0, "graphite shared memory data set");
-        return NGX_ERROR;
-    }
+    aggregate->value = 0;
+    aggregate->count = 0;
+    aggregate->squares = 0;
 
-    size_t shared_required_size =
-        2 *
-        (sizeof(ngx_slab_pool_t) +
-        sizeof(ngx_http_graphite_storage_t) +
-        sizeof(ngx_array_t) * 4 +
-        sizeof(ngx_http_graphite_metric_t) * (gmcf->storage->metrics->nelts) +
-        sizeof(ngx_http_graphite_gauge_t) * (gmcf->storage->gauges->nelts) +
-        sizeof(ngx_http_graphite_statistic_t) * (gmcf->storage->statistics->nelts) +
-        sizeof(ngx_http_graphite_param_t) * (gmcf->storage->params->nelts) +
-        (sizeof(ngx_http_graphite_internal_t*) + sizeof(ngx_http_graphite_internal_t)) * (gmcf->storage->internals->nelts) +
-        sizeof(ngx_http_graphite_metric_data_t) * (gmcf->storage->max_interval + 1) * gmcf->storage->metrics->nelts +
-        sizeof(ngx_http_graphite_gauge_data_t) * gmcf->storage->gauges->nelts +
-        sizeof(ngx_http_graphite_statistic_data_t) * gmcf->storage->statistics->nelts);
+    unsigned l;
+    for (l = 0; l < interval->value; l++) {
+        if ((time_t)(ts - l - 1) >= storage->start_time) {
+            ngx_uint_t a = ((ts - l - 1 - storage->start_time) % (storage->max_interval + 1)) * metric->stride;
+            if (metric->counts[a] == 0)
+                continue;
 
-    if (shared_required_size > shm_zone->shm.size) {
-        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0, "graphite too small shared memory (minimum size is %uzb)", shared_required_size);
-        return NGX_ERROR;
-    }
+            double value = metric->values[a];
+            if (metric->ints)
+                value += (ngx_atomic_int_t)metric->ints[a];
 
-    // 128 is the approximate size of the one record
-    size_t buffer_required_size = (gmcf->intervals->nelts * gmcf->storage->metrics->nelts + gmcf->storage->gauges->nelts + gmcf->storage->statistics->nelts) * 128;
-    if (buffer_required_size > gmcf->buffer_size) {
-        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0, "graphite too small buffer size (minimum size is %uzb)", buffer_required_size);
-        return NGX_ERROR;
-    }
+            if (metric->op == METRIC_MIN)
+                aggregate->value = (aggregate->count == 0) ? value : ngx_min(aggregate->value, value);
+            else if (metric->op == METRIC_MAX)
+                aggregate->value = (aggregate->count == 0) ? value : ngx_max(aggregate->value, value);
+            else
+                aggregate->value += value;
 
-    ngx_slab_pool_t *shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+            if (metric->squares)
+                aggregate->squares += metric->squares[a];
 
-    if (shm_zone->shm.exists) {
-        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0, "graphite shared memory exists");
-        return NGX_ERROR;
+            aggregate->count += metric->counts[a];
+        }
     }
+}
 
-    ngx_http_graphite_storage_t *storage = ngx_slab_alloc(shpool, sizeof(ngx_http_graphite_storage_t));
-    if (!storage) {
-        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0, "graphite can't slab alloc in shared memory");
-        return NGX_ERROR;
-    }
+/*
+ * Every flush folds the seconds completed since the last one into the
+ * moving averages, as a one second interval reduced like any other.
+ * Seconds without requests decay rates to zero and keep averages.
+ */
+static void
+ngx_http_graphite_update_ewma(ngx_http_graphite_main_conf_t *gmcf, ngx_http_graphite_storage_t *storage, time_t ts) {
 
-    shpool->data = storage;
+    ngx_http_graphite_interval_t second;
+    ngx_str_set(&second.name, "1s");
+    second.value = 1;
 
-    ngx_memzero(storage, sizeof(ngx_http_graphite_storage_t));
+    time_t t = ngx_max(storage->ewma_time + 1, ts - (time_t)storage->max_interval);
+    storage->ewma_time = ts - 1;
 
-    storage->max_interval = gmcf->storage->max_interval;
+    for (; t < ts; t++) {
+        ngx_http_graphite_reduce_metrics(gmcf, storage, &second, t + 1);
 
-    time_t ts = ngx_time();
-    storage->start_time = ts;
-    storage->last_time = ts;
-    storage->event_time = ts;
+        ngx_uint_t m;
+        for (m = 0; m < storage->plane_metrics; m++) {
+            const ngx_http_graphite_metric_t *metric = &(((ngx_http_graphite_metric_t*)storage->metrics->elts)[m]);
+            const ngx_http_graphite_param_t *param = &((ngx_http_graphite_param_t*)storage->params->elts)[metric->param];
 
-    ngx_http_graphite_allocator_t *allocator = ngx_slab_alloc(shpool, sizeof(ngx_http_graphite_allocator_t));
-    if (allocator == NULL) {
-        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0, "graphite can't slab alloc in shared memory");
-        return NGX_ERROR;
-    }
-    ngx_http_graphite_allocator_init(allocator, shpool, ngx_http_graphite_allocator_slab_alloc, ngx_http_graphite_allocator_slab_free);
+            if (param->ewma.value == 0 || metric->split == SPLIT_INTERNAL)
+                continue;
 
-    storage->allocator = allocator;
-    storage->metrics = ngx_http_graphite_array_copy(storage->allocator, gmcf->storage->metrics);
-    storage->gauges = ngx_http_graphite_array_copy(storage->allocator, gmcf->storage->gauges);
-    storage->statistics = ngx_http_graphite_array_copy(storage->allocator, gmcf->storage->statistics);
-    storage->params = ngx_http_graphite_array_copy(storage->allocator, gmcf->storage->params);
-    storage->internals = ngx_http_graphite_array_copy(storage->allocator, gmcf->storage->internals);
+            if (gmcf->reduce_counts[m] == 0 && param->aggregate != ngx_http_graphite_aggregate_persec)
+                continue;
 
-    if (storage->metrics == NULL || storage->gauges == NULL || storage->statistics == NULL || storage->params == NULL || storage->internals == NULL) {
-        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0, "graphite can't slab alloc in shared memory");
-        return NGX_ERROR;
-    }
+            ngx_http_graphite_metric_data_t aggregate;
+            aggregate.value = gmcf->reduce_values[m] + (ngx_atomic_int_t)gmcf->reduce_ints[m];
+            aggregate.count = gmcf->reduce_counts[m];
+            aggregate.squares = 0;
 
-    u_char *metric_datas = ngx_slab_calloc(shpool, sizeof(ngx_http_graphite_metric_data_t) * (gmcf->storage->max_interval + 1) * gmcf->storage->metrics->nelts);
-    if (metric_datas == NULL) {
-        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0, "graphite can't slab alloc in shared memory");
-        return NGX_ERROR;
+            double decay = exp(-1.0 / param->ewma.value);
+            storage->metric_ewma[m] = storage->metric_ewma[m] * decay + param->aggregate(&second, &aggregate) * (1 - decay);
+        }
     }
+}
 
-    u_char *gauge_datas = ngx_slab_calloc(shpool, sizeof(ngx_http_graphite_gauge_data_t) * gmcf->storage->gauges->nelts);
-    if (gauge_datas == NULL) {
-        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0, "graphite can't slab alloc in shared memory");
-        return NGX_ERROR;
-    }
+/*
+ * A metric of the planes is idle in an interval when nothing was counted
+ * in it, the counts reduced for the interval tell this for free. With
+ * idle=trail one zero is still sent after the last active flush.
+ */
+static ngx_uint_t
+ngx_http_graphite_idle_metric(ngx_http_graphite_main_conf_t *gmcf, ngx_http_graphite_storage_t *storage, ngx_uint_t m, ngx_uint_t i, ngx_uint_t full) {
 
-    u_char *statistic_datas = ngx_slab_calloc(shpool, sizeof(ngx_http_graphite_statistic_data_t) * gmcf->storage->statistics->nelts);
-    if (statistic_datas == NULL) {
-        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0, "graphite can't slab alloc in shared memory");
-        return NGX_ERROR;
-    }
+    if (gmcf->idle == IDLE_SEND || m >= storage->plane_metrics)
+        return 0;
 
-    ngx_uint_t m;
-    for (m = 0; m < storage->metrics->nelts; m++) {
-        ngx_http_graphite_metric_t *metric = &(((ngx_http_graphite_metric_t*)storage->metrics->elts)[m]);
-        metric->data = (ngx_http_graphite_metric_data_t*)(metric_datas + sizeof(ngx_http_graphite_metric_data_t) * (gmcf->storage->max_interval + 1) * m);
-    }
+    u_char *active = &storage->metric_active[i * storage->plane_metrics + m];
 
-    ngx_uint_t g;
-    for (g = 0; g < storage->gauges->nelts; g++) {
-        ngx_http_graphite_gauge_t *gauge = &(((ngx_http_graphite_gauge_t*)storage->gauges->elts)[g]);
-        gauge->data = (ngx_http_graphite_gauge_data_t*)(gauge_datas + sizeof(ngx_http_graphite_gauge_data_t) * g);
+    if (gmcf->reduce_counts[m] != 0) {
+        *active = 1;
+        return 0;
     }
 
-    ngx_uint_t s;
-    for (s = 0; s < storage->statistics->nelts; s++) {
-        ngx_http_graphite_statistic_t *statistic = &(((ngx_http_graphite_statistic_t*)storage->statistics->elts)[s]);
-        ngx_http_graphite_param_t *param = &((ngx_http_graphite_param_t*)gmcf->storage->params)[statistic->param];
-        statistic->data = (ngx_http_graphite_statistic_data_t*)(statistic_datas + sizeof(ngx_http_graphite_statistic_data_t) * s);
-        ngx_http_graphite_statistic_init(statistic->data, param->percentile);
-    }
+    ngx_uint_t trail = (gmcf->idle == IDLE_TRAIL && *active);
+    *active = 0;
 
-    return NGX_OK;
+    return !(full || trail);
 }
 
-ngx_http_graphite_reqctx_t *
-ngx_http_graphite_get_reqctx(ngx_http_request_t *r) {
+static u_char*
+ngx_http_graphite_print_metric(ngx_http_graphite_main_conf_t *gmcf, ngx_http_graphite_storage_t *storage, ngx_uint_t m, const ngx_http_graphite_interval_t *interval, time_t ts, u_char *buffer, size_t buffer_size) {
 
-    ngx_http_graphite_reqctx_t *reqctx;
+    const ngx_http_graphite_metric_t *metric = &(((ngx_http_graphite_metric_t*)storage->metrics->elts)[m]);
+    const ngx_http_graphite_param_t *param = &((ngx_http_graphite_param_t*)storage->params->elts)[metric->param];
 
-    reqctx = ngx_http_get_module_ctx(r->main, ngx_http_graphite_module);
-    if (reqctx)
-        return reqctx;
+    if (metric->values == NULL)
+        return buffer;
 
-    reqctx = ngx_pcalloc(r->main->pool, sizeof(ngx_http_graphite_reqctx_t));
-    if (reqctx == NULL) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "graphite can't alloc memory");
-        return NULL;
+    ngx_http_graphite_metric_data_t aggregate;
+
+    /* summed metrics of the planes are reduced by ngx_http_graphite_reduce_metrics for the common intervals */
+    if (m < storage->plane_metrics && metric->split != SPLIT_INTERNAL && metric->op == METRIC_SUM) {
+        aggregate.value = gmcf->reduce_values[m] + (ngx_atomic_int_t)gmcf->reduce_ints[m];
+        aggregate.count = gmcf->reduce_counts[m];
+        aggregate.squares = 0;
     }
+    else
+        ngx_http_graphite_fold_metric(storage, metric, interval, ts, &aggregate);
 
-    reqctx->internal_values = ngx_array_create(r->main->pool, 16, sizeof(ngx_http_graphite_internal_value_t));
-    if (reqctx->internal_values == NULL) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "graphite can't alloc memory");
-        return NULL;
+    double value = param->aggregate(interval, &aggregate);
+
+    u_char *b = buffer;
+
+    if (metric->split != SPLIT_INTERNAL) {
+        const ngx_str_t *split = &((ngx_str_t*)gmcf->splits->elts)[metric->split];
+        if (!gmcf->template->nelts) {
+            if (gmcf->prefix.len)
+                b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.", &gmcf->prefix);
+            b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.%V.%V_%V", &gmcf->host, split, &param->name, &interval->name);
+        }
+        else {
+            const ngx_str_t *variables[] = TEMPLATE_VARIABLES(&gmcf->prefix, &gmcf->host, split, &param->name, &interval->name);
+            b = ngx_http_graphite_template_execute(b, buffer_size - (b - buffer), gmcf->template, variables);
+        }
+    }
+    else {
+        if (gmcf->prefix.len)
+            b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.", &gmcf->prefix);
+        b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.%V", &gmcf->host, &param->name);
     }
 
-    ngx_http_set_ctx(r->main, reqctx, ngx_http_graphite_module);
+    b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), " %.3f %T\n", value, ts);
 
-    return reqctx;
+    return b;
 }
 
-static double *
-ngx_http_graphite_get_sources_values(ngx_http_graphite_main_conf_t *gmcf, ngx_http_request_t *r) {
-
-    double *values = ngx_palloc(r->pool, sizeof(double) * gmcf->sources->nelts);
-    if (!values)
-        return NULL;
+static u_char*
+ngx_http_graphite_print_gauge(ngx_http_graphite_main_conf_t *gmcf, ngx_http_graphite_storage_t *storage, ngx_uint_t g, time_t ts, u_char *buffer, size_t buffer_size) {
 
-    ngx_uint_t c;
-    for (c = 0; c < gmcf->sources->nelts; c++) {
+    const ngx_http_graphite_gauge_t *gauge = &(((ngx_http_graphite_gauge_t*)storage->gauges->elts)[g]);
+    const ngx_http_graphite_param_t *param = &((ngx_http_graphite_param_t*)storage->params->elts)[gauge->param];
 
-        const ngx_http_graphite_source_t *source = &((ngx_http_graphite_source_t*)gmcf->sources->elts)[c];
-        if (source->get)
-            values[c] = source->get(source, r);
-    }
+    if (gauge->data == NULL)
+        return buffer;
 
-    return values;
-}
+    double value = param->aggregate(NULL, gauge->data);
 
-static void
-ngx_http_graphite_add_metric(ngx_http_request_t *r, ngx_http_graphite_storage_t *storage, ngx_http_graphite_metric_t *metric, time_t ts, double value) {
+    u_char *b = buffer;
 
-    ngx_uint_t a = ((ts - storage->start_time) % (storage->max_interval + 1));
-    ngx_http_graphite_metric_data_t *data = &metric->data[a];
+    if (gmcf->prefix.len)
+        b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.", &gmcf->prefix);
+    b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.%V", &gmcf->host, &param->name);
 
-    data->count++;
-    data->value += value;
+    b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), " %.3f %T\n", value, ts);
+
+    return b;
 }
 
-static void
-ngx_http_graphite_add_gauge(ngx_http_request_t *r, ngx_http_graphite_storage_t *storage, ngx_http_graphite_gauge_t *gauge, time_t ts, double value) {
+static u_char*
+ngx_http_graphite_print_statistic(ngx_http_graphite_main_conf_t *gmcf, ngx_http_graphite_storage_t *storage, ngx_uint_t s, time_t ts, u_char *buffer, size_t buffer_size) {
 
-    ngx_http_graphite_gauge_data_t *data = gauge->data;
+    const ngx_http_graphite_statistic_t *statistic = &(((ngx_http_graphite_statistic_t*)storage->statistics->elts)[s]);
+    const ngx_http_graphite_param_t *param = &((ngx_http_graphite_param_t*)storage->params->elts)[statistic->param];
 
-    data->value += value;
-}
+    if (statistic->data == NULL)
+        return buffer;
 
-static void
-ngx_http_graphite_add_statistic(ngx_http_request_t *r, ngx_http_graphite_storage_t *storage, ngx_http_graphite_statistic_t *statistic, time_t ts, double value, ngx_uint_t percentile) {
+    u_char p[8];
+    ngx_str_t percentile;
+    percentile.data = p;
+    percentile.len = ngx_snprintf(p, sizeof(p), "p%ui_%d", param->percentile / 1000, param->percentile % 1000) - p;
+
+    while (percentile.len && p[percentile.len - 1] == '0')
+        percentile.len--;
+    if (percentile.len && p[percentile.len - 1] == '_')
+        percentile.len--;
 
     ngx_http_graphite_statistic_data_t *data = statistic->data;
 
-    if (data->count >= P2_METRIC_COUNT) {
+    u_char *b = buffer;
 
-        size_t k;
-        for (k = 0; k < P2_METRIC_COUNT; k++) {
-            if (value < data->q[k])
-                break;
-        }
-        if (k == 0) {
-            k = 1;
-            data->q[0] = value;
-        }
-        else if (k == P2_METRIC_COUNT) {
-            k = 4;
-            data->q[P2_METRIC_COUNT - 1] = value;
+    if (statistic->split != SPLIT_INTERNAL) {
+        const ngx_str_t *split = &((ngx_str_t*)gmcf->splits->elts)[statistic->split];
+        if (!gmcf->template->nelts) {
+            if (gmcf->prefix.len)
+                b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.", &gmcf->prefix);
+            b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.%V.%V_%V", &gmcf->host, split, &param->name, &percentile);
         }
-
-        size_t i;
-        for (i = 0; i < P2_METRIC_COUNT; i++) {
-            if (i >= k)
-                data->n[i]++;
-            data->np[i] += data->dn[i];
-        }
-
-        for (i = 1; i < P2_METRIC_COUNT - 1; i++) {
-            double d = data->np[i] - data->n[i];
-            int s = (d >= 0.0) ? 1 : -1;
-            if((d >= 1.0 && data->n[i + 1] - data->n[i] > 1) || (d <= -1.0 && data->n[i - 1] - data->n[i] < -1)) {
-                double a = data->q[i] + (double)s * ((data->n[i] - data->n[i - 1] + s) * (data->q[i + 1] - data->q[i]) / (data->n[i + 1] - data->n[i]) + (data->n[i + 1] - data->n[i] - s) * (data->q[i] - data->q[i - 1]) / (data->n[i] - data->n[i - 1])) / (data->n[i + 1] - data->n[i - 1]);
-                if (a <= data->q[i - 1] || data->q[i + 1] <= a)
-                    a = data->q[i] + (double)s * (data->q[i + s] - data->q[i]) / (data->n[i + s] - data->n[i]);
-                data->q[i] = a;
-                data->n[i] += s;
-            }
+        else {
+            const ngx_str_t *variables[] = TEMPLATE_VARIABLES(&gmcf->prefix, &gmcf->host, split, &param->name, &percentile);
+            b = ngx_http_graphite_template_execute(b, buffer_size - (b - buffer), gmcf->template, variables);
         }
     }
     else {
-        size_t i = 0;
-        for (i = 0; i < data->count; i++) {
-            if (value < data->q[i])
-                break;
-        }
-        if (data->count != 0 && i < P2_METRIC_COUNT - 1)
-            memmove(&data->q[i + 1], &data->q[i], (data->count - i) * sizeof(*data->q));
-        data->q[i] = value;
-        data->count++;
+        if (gmcf->prefix.len)
+            b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.", &gmcf->prefix);
+        b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.%V_%V", &gmcf->host, &param->name, &percentile);
     }
-}
 
-static void
-ngx_http_graphite_add_data_values(ngx_http_request_t *r, ngx_http_graphite_storage_t *storage, time_t ts, ngx_http_graphite_data_t *data, const double *values) {
+    double value = ngx_http_graphite_statistic_value(data, statistic->marker, param->percentile);
 
-    if (data->filter) {
-        ngx_str_t result;
-        if (ngx_http_complex_value(r, data->filter, &result) != NGX_OK)
-            return;
+    b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), " %.3f %T\n", value, ts);
 
-        if (result.len == 0 || (result.len == 1 && result.data[0] == '0'))
-            return;
-    }
+    return b;
+}
 
-    ngx_uint_t i;
+static ngx_uint_t
+ngx_http_graphite_append_series(ngx_http_graphite_main_conf_t *gmcf, const ngx_str_t *split, const ngx_str_t *name, const ngx_http_graphite_interval_t *interval, double value, time_t ts) {
 
-    for (i = 0; i < data->metrics->nelts; i++) {
-        ngx_uint_t m = ((ngx_uint_t*)data->metrics->elts)[i];
-        ngx_http_graphite_metric_t *metric = &((ngx_http_graphite_metric_t*)storage->metrics->elts)[m];
-        ngx_http_graphite_param_t *param = &((ngx_http_graphite_param_t*)storage->params->elts)[metric->param];
-        double value = (param->source != SOURCE_INTERNAL) ? values[param->source] : values[0];
-        ngx_http_graphite_add_metric(r, storage, metric, ts, value);
-    }
+    ngx_http_graphite_buffer_t *buffer = &gmcf->buffer;
+    u_char *b = buffer->record;
+    size_t buffer_size = buffer->size;
 
-    for (i = 0; i < data->gauges->nelts; i++) {
-        ngx_uint_t g = ((ngx_uint_t*)data->gauges->elts)[i];
-        ngx_http_graphite_gauge_t *gauge = &((ngx_http_graphite_gauge_t*)storage->gauges->elts)[g];
-        ngx_http_graphite_param_t *param = &((ngx_http_graphite_param_t*)storage->params->elts)[gauge->param];
-        double value = (param->source != SOURCE_INTERNAL) ? values[param->source] : values[0];
-        ngx_http_graphite_add_gauge(r, storage, gauge, ts, value);
+    if (!gmcf->template->nelts) {
+        if (gmcf->prefix.len)
+            b = ngx_snprintf(b, buffer_size - (b - buffer->record), "%V.", &gmcf->prefix);
+        b = ngx_snprintf(b, buffer_size - (b - buffer->record), "%V.%V.%V_%V", &gmcf->host, split, name, &interval->name);
     }
-
-    for (i = 0; i < data->statistics->nelts; i++) {
-        ngx_uint_t s = ((ngx_uint_t*)data->statistics->elts)[i];
-        ngx_http_graphite_statistic_t *statistic = &((ngx_http_graphite_statistic_t*)storage->statistics->elts)[s];
-        ngx_http_graphite_param_t *param = &((ngx_http_graphite_param_t*)storage->params->elts)[statistic->param];
-        double value = (param->source != SOURCE_INTERNAL) ? values[param->source] : values[0];
-        ngx_http_graphite_add_statistic(r, storage, statistic, ts, value, param->percentile);
+    else {
+        const ngx_str_t *variables[] = TEMPLATE_VARIABLES(&gmcf->prefix, &gmcf->host, split, name, &interval->name);
+        b = ngx_http_graphite_template_execute(b, buffer_size - (b - buffer->record), gmcf->template, variables);
     }
-}
 
-static void
-ngx_http_graphite_add_datas_values(ngx_http_request_t *r, ngx_http_graphite_storage_t *storage, time_t ts, ngx_array_t *datas, const double *values) {
+    b = ngx_snprintf(b, buffer_size - (b - buffer->record), " %.3f %T\n", value, ts);
 
-    ngx_uint_t i;
-    for (i = 0; i < datas->nelts; i++) {
-        ngx_http_graphite_data_t *data = &((ngx_http_graphite_data_t*)datas->elts)[i];
-        ngx_http_graphite_add_data_values(r, storage, ts, data, values);
-    }
+    return ngx_http_graphite_append_record(buffer, b);
 }
 
-static ngx_int_t
-ngx_http_graphite_handler(ngx_http_request_t *r) {
-
-    ngx_http_graphite_main_conf_t *gmcf = ngx_http_get_module_main_conf(r, ngx_http_graphite_module);
-    ngx_http_graphite_srv_conf_t *gscf = ngx_http_get_module_srv_conf(r, ngx_http_graphite_module);
-    ngx_http_graphite_loc_conf_t *glcf = ngx_http_get_module_loc_conf(r, ngx_http_graphite_module);
-
-    if (!gmcf->enable)
-        return NGX_OK;
-
-    ngx_http_graphite_reqctx_t *reqctx = ngx_http_get_module_ctx(r->main, ngx_http_graphite_module);
-
-    if (gmcf->datas->nelts == 0 && gscf->datas->nelts == 0 && glcf->datas->nelts == 0 && (reqctx == NULL || reqctx->internal_values->nelts == 0) && gmcf->internal_values->nelts == 0)
-        return NGX_OK;
-
-    ngx_slab_pool_t *shpool = (ngx_slab_pool_t*)gmcf->shared->shm.addr;
-    ngx_http_graphite_storage_t *storage = (ngx_http_graphite_storage_t*)shpool->data;
-
-    time_t ts = ngx_time();
+static ngx_uint_t
+ngx_http_graphite_append_unique(ngx_http_graphite_main_conf_t *gmcf, ngx_http_graphite_storage_t *storage, const ngx_http_graphite_vector_t *vector, const ngx_http_graphite_interval_t *interval, time_t ts) {
 
-    double *values = ngx_http_graphite_get_sources_values(gmcf, r);
-    if (values == NULL) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "graphite can't get values");
-        return NGX_OK;
-    }
+    const ngx_http_graphite_param_t *param = &((ngx_http_graphite_param_t*)storage->params->elts)[vector->param];
+    const ngx_str_t *split = &((ngx_str_t*)gmcf->splits->elts)[vector->split];
 
-    ngx_shmtx_lock(&shpool->mutex);
+    u_char regs[UNIQUE_REGISTERS];
+    ngx_memzero(regs, sizeof(regs));
 
-    ngx_http_graphite_del_old_records(gmcf, ts);
+    unsigned l;
+    for (l = 0; l < interval->value; l++) {
+        if ((time_t)(ts - l - 1) >= storage->start_time) {
+            ngx_uint_t a = ((ts - l - 1 - storage->start_time) % (storage->max_interval + 1));
+            const u_char *row = (const u_char*)&vector->data[a * vector->cells];
 
-    if (r == r->main) {
-        ngx_http_graphite_add_datas_values(r, storage, ts, gmcf->datas, values);
-        ngx_http_graphite_add_datas_values(r, storage, ts, gscf->datas, values);
-        if (reqctx != NULL) {
-            size_t i;
-            for (i = 0; i < reqctx->internal_values->nelts; i++) {
-                const ngx_http_graphite_internal_value_t *internal_value = &(((ngx_http_graphite_internal_value_t*)reqctx->internal_values->elts)[i]);
-                ngx_http_graphite_internal_t *internal = internal_value->internal;
-                ngx_http_graphite_add_data_values(r, storage, internal_value->ts, &internal->data, &internal_value->value);
+            ngx_uint_t j;
+            for (j = 0; j < UNIQUE_REGISTERS; j++) {
+                u_char rank = (row[j >> 1] >> ((j & 1) * 4)) & 0xf;
+                if (regs[j] < rank)
+                    regs[j] = rank;
             }
         }
     }
-    ngx_http_graphite_add_datas_values(r, storage, ts, glcf->datas, values);
 
-    size_t i;
-    for (i = 0; i < gmcf->internal_values->nelts; i++) {
-        const ngx_http_graphite_internal_value_t *internal_value = &(((ngx_http_graphite_internal_value_t*)gmcf->internal_values->elts)[i]);
-        ngx_http_graphite_internal_t *internal = internal_value->internal;
-        ngx_http_graphite_add_data_values(r, storage, internal_value->ts, &internal->data, &internal_value->value);
+    double sum = 0;
+    ngx_uint_t zeros = 0;
+
+    ngx_uint_t j;
+    for (j = 0; j < UNIQUE_REGISTERS; j++) {
+        sum += 1.0 / (1 << regs[j]);
+        if (regs[j] == 0)
+            zeros++;
     }
-    gmcf->internal_values->nelts = 0;
 
-    ngx_shmtx_unlock(&shpool->mutex);
+    if (zeros == UNIQUE_REGISTERS)
+        return 0;
 
-    return NGX_OK;
+    double m = UNIQUE_REGISTERS;
+    double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+
+    /* linear counting is more accurate for small cardinalities */
+    if (estimate <= 2.5 * m && zeros != 0)
+        estimate = m * log(m / zeros);
+
+    return ngx_http_graphite_append_series(gmcf, split, &param->name, interval, estimate, ts);
 }
 
-static ngx_int_t
-ngx_http_graphite_by_link2(ngx_http_request_t *r, ngx_http_graphite_main_conf_t *gmcf, const ngx_http_graphite_link_t *link, double value) {
+static ngx_uint_t
+ngx_http_graphite_append_topk(ngx_http_graphite_main_conf_t *gmcf, ngx_http_graphite_storage_t *storage, const ngx_http_graphite_vector_t *vector, ngx_uint_t topk, const ngx_http_graphite_interval_t *interval, time_t ts) {
 
-    if (link == NULL)
-        return NGX_OK;
+    const ngx_http_graphite_param_t *param = &((ngx_http_graphite_param_t*)storage->params->elts)[vector->param];
+    const ngx_str_t *split = &((ngx_str_t*)gmcf->splits->elts)[vector->split];
+    ngx_uint_t skipped = 0;
 
-    ngx_http_graphite_internal_value_t *internal_value = NULL;
-    if (r->connection->fd != (ngx_socket_t)-1) {
-        ngx_http_graphite_reqctx_t *reqctx = ngx_http_graphite_get_reqctx(r);
-        if (!reqctx)
-            return NGX_ERROR;
+    ngx_http_graphite_topk_merge_t entries[TOPK_MERGE];
+    ngx_memzero(entries, sizeof(entries));
+
+    unsigned l;
+    for (l = 0; l < interval->value; l++) {
+        if ((time_t)(ts - l - 1) >= storage->start_time) {
+            ngx_uint_t a = ((ts - l - 1 - storage->start_time) % (storage->max_interval + 1));
+            const ngx_http_graphite_topk_entry_t *row = (const ngx_http_graphite_topk_entry_t*)&vector->data[a * vector->cells];
 
-        internal_value = ngx_array_push(reqctx->internal_values);
+            ngx_uint_t i;
+            for (i = 0; i < TOPK_COUNTERS; i++) {
+                if (row[i].weight != 0)
+                    ngx_http_graphite_topk_merge(entries, &row[i]);
+            }
+        }
     }
-    else {
-        internal_value = ngx_array_push(gmcf->internal_values);
+
+    /* keys with the same prefix get the same series name, which is sent once with their sum */
+    ngx_uint_t i, j;
+    for (i = 0; i < TOPK_MERGE; i++) {
+        for (j = 0; j < entries[i].len; j++) {
+            u_char ch = entries[i].key[j];
+            entries[i].key[j] = (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '-' ? ch : '_';
+        }
     }
 
-    if (internal_value == NULL)
-        return NGX_ERROR;
+    for (i = 0; i < TOPK_MERGE; i++) {
+        if (entries[i].weight == 0)
+            continue;
 
-    internal_value->ts = ngx_time();
-    internal_value->internal = ngx_http_graphite_link2int(link);
-    internal_value->value = value;
+        for (j = i + 1; j < TOPK_MERGE; j++) {
+            if (entries[j].weight != 0 && entries[j].len == entries[i].len && ngx_memcmp(entries[j].key, entries[i].key, entries[i].len) == 0) {
+                entries[i].weight += entries[j].weight;
+                entries[j].weight = 0;
+            }
+        }
+    }
 
-    return NGX_OK;
-}
+    ngx_uint_t k;
+    for (k = 0; k < topk; k++) {
+        ngx_http_graphite_topk_merge_t *max = &entries[0];
 
-static ngx_array_t *
-ngx_http_graphite_create_param_args(ngx_pool_t *pool, const ngx_str_t *name, const ngx_str_t *config) {
+        for (i = 1; i < TOPK_MERGE; i++) {
+            if (entries[i].weight > max->weight)
+                max = &entries[i];
+        }
 
-    ngx_array_t *args = ngx_array_create(pool, 4, sizeof(ngx_str_t));
-    if (args == NULL)
-        return NULL;
+        if (max->weight == 0)
+            break;
 
-    ngx_array_push(args);
+        u_char n[VECTOR_MAX_NAME + TOPK_KEY + 1];
+        u_char *b = ngx_snprintf(n, sizeof(n) - TOPK_KEY, "%V.", &param->name);
+        b = ngx_cpymem(b, max->key, max->len);
 
-    ngx_str_t *n = ngx_array_push(args);
-    if (n == NULL) {
-        ngx_array_destroy(args);
-        return NULL;
-    }
+        ngx_str_t name;
+        name.data = n;
+        name.len = b - n;
 
-    n->data = ngx_palloc(pool, sizeof("name=") - 1 + name->len);
-    if (n->data == NULL) {
-        ngx_array_destroy(args);
-        return NULL;
+        skipped += ngx_http_graphite_append_series(gmcf, split, &name, interval, max->weight, ts);
+
+        max->weight = 0;
     }
 
-    n->len = ngx_sprintf(n->data, "name=%V", name) - n->data;
+    return skipped;
+}
 
-    const u_char *p = config->data;
-    const u_char *config_end = p + config->len;
-    while (p < config_end) {
-        while (isspace(*p))
-            p++;
-        const u_char *begin = p;
-        while (*p && !isspace(*p))
-            p++;
-        const u_char *end = p;
+static ngx_uint_t
+ngx_http_graphite_append_vector(ngx_http_graphite_main_conf_t *gmcf, ngx_http_graphite_storage_t *storage, ngx_uint_t v, const ngx_http_graphite_interval_t *interval, time_t ts) {
 
-        if (end - begin != 0) {
-            ngx_str_t *arg = ngx_array_push(args);
-            if (arg == NULL) {
-                ngx_array_destroy(args);
-                return NULL;
-            }
-            arg->data = (u_char*)begin;
-            arg->len = end - begin;
-        }
-        else
-            break;
-    }
+    const ngx_http_graphite_vector_t *vector = &(((ngx_http_graphite_vector_t*)storage->vectors->elts)[v]);
+    const ngx_http_graphite_param_t *param = &((ngx_http_graphite_param_t*)storage->params->elts)[vector->param];
+    const ngx_http_graphite_source_t *source = &((ngx_http_graphite_source_t*)gmcf->sources->elts)[param->source];
+    const ngx_str_t *split = &((ngx_str_t*)gmcf->splits->elts)[vector->split];
+    ngx_uint_t skipped = 0;
 
-    return args;
-}
+    if (vector->data == NULL || vector->cells > VECTOR_MAX_CELLS)
+        return 0;
 
-static const ngx_http_graphite_link_t *
-ngx_http_graphite_link2(ngx_http_graphite_context_t *context, const ngx_str_t *name, const ngx_str_t *config) {
+    if (source->unique)
+        return ngx_http_graphite_append_unique(gmcf, storage, vector, interval, ts);
 
-    ngx_slab_pool_t *shpool = (ngx_slab_pool_t*)context->gmcf->shared->shm.addr;
-    ngx_http_graphite_storage_t *storage = (ngx_http_graphite_storage_t*)shpool->data;
-    const ngx_http_graphite_link_t *link;
+    if (source->topk)
+        return ngx_http_graphite_append_topk(gmcf, storage, vector, source->topk, interval, ts);
 
-    ngx_rwlock_rlock(&storage->rwlock);
-    link = ngx_http_graphite_search_param_link(storage->internals, name);
-    ngx_rwlock_unlock(&storage->rwlock);
+    ngx_uint_t sums[VECTOR_MAX_CELLS];
+    ngx_memzero(sums, sizeof(ngx_uint_t) * vector->cells);
 
-    if (link != NULL || config == NULL || config->len == 0)
-        return link;
+    unsigned l;
+    for (l = 0; l < interval->value; l++) {
+        if ((time_t)(ts - l - 1) >= storage->start_time) {
+            ngx_uint_t a = ((ts - l - 1 - storage->start_time) % (storage->max_interval + 1));
+            const uint32_t *row = &vector->data[a * vector->cells];
 
-    if (storage->allocator->nomemory) {
-        /*
-         * Note that at this moment the parameter may already be present in the
-         * pool, if it have just been added by another writer. The
-         * storage->allocator->nomemory may occur after successfull adding.
-         * We allow that inconsistence here.
-         */
-        return NULL;
+            ngx_uint_t c;
+            for (c = 0; c < vector->cells; c++)
+                sums[c] += row[c];
+        }
     }
 
-    /* will add a new internal */
-    ngx_rwlock_wlock(&storage->rwlock);
-    link = ngx_http_graphite_search_param_link(storage->internals, name);
-    if (link != NULL) {
-        /* another writer have added a new internal for us; we won't add it then */
-        ngx_rwlock_unlock(&storage->rwlock);
-        return link;
+    if (source->cumulative) {
+        ngx_uint_t c;
+        for (c = 1; c < vector->cells; c++)
+            sums[c] += sums[c - 1];
     }
 
-    /* we'll do really add a new internal */
-    ngx_array_t *args = ngx_http_graphite_create_param_args(context->pool, name, config);
-    if (args == NULL)
-        goto fail_locked;
-    ngx_http_graphite_param_t param;
-    if (ngx_http_graphite_parse_param_args(context, args, &param) != NGX_OK)
-        goto fail_locked;
-
-    ngx_http_graphite_internal_t *internal = ngx_http_graphite_add_internal(context, &param);
-    if (internal == NULL)
-        goto fail_locked_param;
-
-    ngx_rwlock_unlock(&storage->rwlock);
-    return link;
+    u_char *x = ngx_strnstr(param->name.data, "xxx", param->name.len);
+    if (x == NULL)
+        return 0;
 
-fail_locked_param:
-    #if 0
-    /*
-     * ngx_http_graphite_add_internal() now doesn't always restore the original
-     * state on errors. So, to not crash, we cannot clear param here.
-     */
-    ngx_http_graphite_clear_param_args(context, &param);
-    #endif
-fail_locked:
-    ngx_rwlock_unlock(&storage->rwlock);
-    return NULL;
-}
+    u_char n[VECTOR_MAX_NAME];
+    ngx_str_t name;
+    name.data = n;
 
-ngx_int_t
-ngx_http_graphite(ngx_http_request_t *r, const ngx_str_t *name, double value, const ngx_str_t *config) {
+    ngx_uint_t c;
+    for (c = 0; c < vector->cells; c++) {
 
-    ngx_http_graphite_context_t context = ngx_http_graphite_context_from_request(r);
-    ngx_http_graphite_main_conf_t *gmcf = context.gmcf;
+        /* cumulative cells are sent all together, if anything was counted */
+        if ((source->cumulative) ? sums[vector->cells - 1] == 0 : sums[c] == 0)
+            continue;
 
-    if (!gmcf->enable)
-        return NGX_OK;
+        u_char *b = ngx_snprintf(n, sizeof(n), "%*s", x - param->name.data, param->name.data);
+        b = source->label(source, c, b, sizeof(n) - (b - n));
+        b = ngx_snprintf(b, sizeof(n) - (b - n), "%*s", param->name.len - (x + 3 - param->name.data), x + 3);
+        name.len = b - n;
 
-    const ngx_http_graphite_link_t *link = ngx_http_graphite_link2(&context, name, config);
+        ngx_http_graphite_metric_data_t aggregate;
+        aggregate.value = sums[c];
+        aggregate.count = sums[c];
 
-    return ngx_http_graphite_by_link2(r, gmcf, link, value);
+        skipped += ngx_http_graphite_append_series(gmcf, split, &name, interval, param->aggregate(interval, &aggregate), ts);
+    }
+
+    return skipped;
 }
 
-ngx_int_t
-ngx_http_graphite_by_link(ngx_http_request_t *r, const ngx_http_graphite_link_t *link, double value) {
+#ifdef NGX_LOG_LIMIT_ENABLED
+static u_char*
+ngx_http_graphite_print_log(
+    ngx_http_graphite_main_conf_t *gmcf, ngx_http_graphite_log_t *gl,
+    time_t ts, u_char *buffer, size_t buffer_size)
+{
+    size_t total = 0;
+    size_t skipped = 0;
+    u_char *b = buffer;
+    ngx_uint_t i;
 
-    ngx_http_graphite_context_t context = ngx_http_graphite_context_from_request(r);
-    ngx_http_graphite_main_conf_t *gmcf = context.gmcf;
+    for (i = 0; i != gl->error_logs->nelts; i++) {
+        ngx_log_t *log = ((ngx_log_t**)gl->error_logs->elts)[i];
+        ngx_log_grow_t *grow = &log->shared->grow;
 
-    if (!gmcf->enable)
-        return NGX_OK;
+        skipped += grow->total_bytes_skipped;
+        total += grow->total_bytes;
+    }
+    if (gmcf->prefix.len)
+        b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.", &gmcf->prefix);
+    b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.%V.%V.total %uz %T\n", &gmcf->host, &gmcf->error_log, &gl->name, total, ts);
 
-    return ngx_http_graphite_by_link2(r, gmcf, link, value);
+    if (gmcf->prefix.len)
+        b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.", &gmcf->prefix);
+    b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.%V.%V.skipped %uz %T\n", &gmcf->host, &gmcf->error_log, &gl->name, skipped, ts);
+
+    return b;
 }
+#endif
 
-ngx_slab_pool_t *
-ngx_http_graphite_shpool(ngx_http_request_t *r) {
+static u_char*
+ngx_http_graphite_print_self(ngx_http_graphite_main_conf_t *gmcf, const char *name, double value, time_t ts, u_char *buffer, size_t buffer_size) {
 
-    ngx_http_graphite_context_t context = ngx_http_graphite_context_from_request(r);
-    ngx_http_graphite_main_conf_t *gmcf = context.gmcf;
+    u_char *b = buffer;
 
-    if (!gmcf->enable)
-        return NULL;
-    return (ngx_slab_pool_t*)gmcf->shared->shm.addr;
+    if (gmcf->prefix.len)
+        b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.", &gmcf->prefix);
+    b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.graphite.%s %.3f %T\n", &gmcf->host, name, value, ts);
+
+    return b;
 }
 
-const ngx_http_graphite_link_t *
-ngx_http_graphite_link(ngx_http_request_t *r, const ngx_str_t *name, const ngx_str_t *config) {
+static ngx_uint_t
+ngx_http_graphite_append_self(ngx_http_graphite_main_conf_t *gmcf, ngx_slab_pool_t *shpool, time_t ts) {
 
-    ngx_http_graphite_context_t context = ngx_http_graphite_context_from_request(r);
-    ngx_http_graphite_main_conf_t *gmcf = context.gmcf;
+    ngx_http_graphite_storage_t *storage = (ngx_http_graphite_storage_t*)shpool->data;
+    ngx_http_graphite_stat_t *stat = &storage->stat;
+    ngx_http_graphite_buffer_t *buffer = &gmcf->buffer;
+    u_char *record = buffer->record;
+    ngx_uint_t skipped = 0;
+
+    ngx_atomic_uint_t handler_time = ngx_http_graphite_stat_take(&stat->handler_time);
+    ngx_atomic_uint_t handler_samples = ngx_http_graphite_stat_take(&stat->handler_samples);
+
+    struct {
+        const char *name;
+        double value;
+    } values[] = {
+        { "flush_lock_time", (double)stat->flush_lock_time / 1000 },
+        { "flush_format_time", (double)stat->flush_format_time / 1000 },
+        { "flush_send_time", (double)stat->flush_send_time / 1000 },
+        { "sent_bytes", (double)ngx_http_graphite_stat_take(&stat->sent_bytes) },
+        { "sent_datagrams", (double)ngx_http_graphite_stat_take(&stat->sent_datagrams) },
+        { "send_errors", (double)ngx_http_graphite_stat_take(&stat->send_errors) },
+        { "dropped_flushes", (double)ngx_http_graphite_stat_take(&stat->dropped_flushes) },
+        { "skipped_records", (double)ngx_http_graphite_stat_take(&stat->skipped_records) },
+        { "handler_time", handler_samples ? (double)handler_time / handler_samples / 1000 : 0 },
+        { "handler_samples", (double)handler_samples },
+        { "degradation", (double)storage->degradation },
+#if nginx_version >= 1011007
+        { "shm_pages_used", (double)((shpool->end - shpool->start) / ngx_pagesize - shpool->pfree) },
+        { "shm_pages_free", (double)shpool->pfree },
+#endif
+        { "nomemory", (double)storage->allocator->nomemory },
+        { "metrics", (double)storage->metrics->nelts },
+        { "statistics", (double)storage->statistics->nelts },
+        { "gauges", (double)storage->gauges->nelts },
+        { "vectors", (double)storage->vectors->nelts },
+        { "internals", (double)storage->internals->nelts },
+    };
 
-    if (!gmcf->enable)
-        return NULL;
+    ngx_uint_t i;
+    for (i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+        skipped += ngx_http_graphite_append_record(buffer, ngx_http_graphite_print_self(gmcf, values[i].name, values[i].value, ts, record, buffer->size));
 
-    const ngx_http_graphite_link_t *link = ngx_http_graphite_link2(&context, name, config);
+    if (storage->lock_profiling)
+        skipped += ngx_http_graphite_append_self_locks(gmcf, storage, ts);
 
-    return link;
+    return skipped;
 }
 
-static double
-ngx_http_graphite_get_by_link2(ngx_slab_pool_t *shpool, const ngx_http_graphite_link_t *link) {
+static ngx_uint_t
+ngx_http_graphite_usec(void) {
 
-    if (link == NULL)
-        return 0;
+    struct timeval tp;
+    ngx_gettimeofday(&tp);
 
-    ngx_http_graphite_storage_t *storage = shpool->data;
-    ngx_http_graphite_internal_t *internal = ngx_http_graphite_link2int(link);
-    double value = 0;
+    return (ngx_uint_t)tp.tv_sec * 1000000 + tp.tv_usec;
+}
 
-    ngx_shmtx_lock(&shpool->mutex);
+static ngx_atomic_uint_t
+ngx_http_graphite_stat_take(ngx_atomic_t *stat) {
+
+    ngx_atomic_uint_t value = *stat;
+    ngx_atomic_fetch_add(stat, -(ngx_atomic_int_t)value);
 
-    ngx_http_graphite_data_t *data = &internal->data;
-    if (data->gauges->nelts) {
-        ngx_uint_t g = ((ngx_uint_t*)data->gauges->elts)[0];
-        ngx_http_graphite_gauge_t *gauge = &((ngx_http_graphite_gauge_t*)storage->gauges->elts)[g];
-        ngx_http_graphite_gauge_data_t *gauge_data = gauge->data;
-        value = gauge_data->value;
-    }
-    ngx_shmtx_unlock(&shpool->mutex);
     return value;
 }
 
-double
-ngx_http_graphite_get(ngx_http_request_t *r, const ngx_str_t *name) {
+static ngx_uint_t
+ngx_http_graphite_lock_bucket(ngx_uint_t usec) {
 
-    ngx_http_graphite_context_t context = ngx_http_graphite_context_from_request(r);
-    ngx_http_graphite_main_conf_t *gmcf = context.gmcf;
+    ngx_uint_t b = 0;
+    while (usec && b < NGX_HTTP_GRAPHITE_LOCK_BUCKETS - 1) {
+        usec >>= 1;
+        b++;
+    }
 
-    if (!gmcf->enable)
-        return 0;
+    return b;
+}
 
-    ngx_slab_pool_t *shpool = (ngx_slab_pool_t*)gmcf->shared->shm.addr;
-    const ngx_http_graphite_link_t *link = ngx_http_graphite_link2(&context, name, NULL);
+static void
+ngx_http_graphite_lock_stat_wait(ngx_http_graphite_storage_t *storage, ngx_uint_t site, ngx_uint_t contended, ngx_uint_t usec) {
 
-    return ngx_http_graphite_get_by_link2(shpool, link);
-}
+    ngx_http_graphite_lock_stat_t *shared = &storage->locks[site];
+    ngx_http_graphite_lock_stat_t *worker = &ngx_http_graphite_worker_locks[site];
+    ngx_uint_t b = ngx_http_graphite_lock_bucket(usec);
 
-double
-ngx_http_graphite_get_by_link(ngx_http_request_t *r, const ngx_http_graphite_link_t *link) {
+    ngx_atomic_fetch_add(&shared->acquires, 1);
+    ngx_atomic_fetch_add(&shared->contended, contended);
+    ngx_atomic_fetch_add(&shared->wait_time, usec);
+    ngx_atomic_fetch_add(&shared->wait[b], 1);
 
-    if (link == NULL)
-        return 0;
+    worker->acquires++;
+    worker->contended += contended;
+    worker->wait_time += usec;
+    worker->wait[b]++;
+}
 
-    ngx_http_graphite_context_t context = ngx_http_graphite_context_from_request(r);
-    ngx_http_graphite_main_conf_t *gmcf = context.gmcf;
+static void
+ngx_http_graphite_lock_stat_hold(ngx_http_graphite_storage_t *storage, ngx_uint_t site, ngx_uint_t usec) {
 
-    if (!gmcf->enable)
-        return 0;
+    ngx_http_graphite_lock_stat_t *shared = &storage->locks[site];
+    ngx_http_graphite_lock_stat_t *worker = &ngx_http_graphite_worker_locks[site];
+    ngx_uint_t b = ngx_http_graphite_lock_bucket(usec);
 
-    ngx_slab_pool_t *shpool = (ngx_slab_pool_t*)gmcf->shared->shm.addr;
+    ngx_atomic_fetch_add(&shared->hold_time, usec);
+    ngx_atomic_fetch_add(&shared->hold[b], 1);
 
-    return ngx_http_graphite_get_by_link2(shpool, link);
+    worker->hold_time += usec;
+    worker->hold[b]++;
 }
 
-ngx_int_t
-ngx_http_graphite_set_by_link2(ngx_slab_pool_t *shpool, const ngx_http_graphite_link_t *link, double value) {
+static ngx_uint_t
+ngx_http_graphite_lock(ngx_slab_pool_t *shpool, ngx_uint_t site) {
 
-    if (link == NULL)
-        return NGX_ERROR;
+    ngx_http_graphite_storage_t *storage = (ngx_http_graphite_storage_t*)shpool->data;
 
-    ngx_http_graphite_storage_t *storage = shpool->data;
-    ngx_http_graphite_internal_t *internal = ngx_http_graphite_link2int(link);
+    if (!storage->lock_profiling) {
+        ngx_shmtx_lock(&shpool->mutex);
+        return 0;
+    }
 
-    ngx_shmtx_lock(&shpool->mutex);
+    ngx_uint_t start = ngx_http_graphite_usec();
+    ngx_uint_t contended = 0;
 
-    ngx_http_graphite_data_t *data = &internal->data;
-    if (data->gauges->nelts) {
-        ngx_uint_t g = ((ngx_uint_t*)data->gauges->elts)[0];
-        ngx_http_graphite_gauge_t *gauge = &((ngx_http_graphite_gauge_t*)storage->gauges->elts)[g];
-        ngx_http_graphite_gauge_data_t *gauge_data = gauge->data;
-        gauge_data->value = value;
+    if (!ngx_shmtx_trylock(&shpool->mutex)) {
+        contended = 1;
+        ngx_shmtx_lock(&shpool->mutex);
     }
-    else {
+
+    ngx_uint_t locked = ngx_http_graphite_usec();
+    ngx_http_graphite_lock_stat_wait(storage, site, contended, locked - start);
+
+    return locked;
+}
+
+static void
+ngx_http_graphite_unlock(ngx_slab_pool_t *shpool, ngx_uint_t site, ngx_uint_t locked) {
+
+    ngx_http_graphite_storage_t *storage = (ngx_http_graphite_storage_t*)shpool->data;
+
+    if (!storage->lock_profiling) {
         ngx_shmtx_unlock(&shpool->mutex);
-        return NGX_ERROR;
+        return;
     }
+
+    ngx_uint_t held = ngx_http_graphite_usec() - locked;
     ngx_shmtx_unlock(&shpool->mutex);
-    return NGX_OK;
+
+    ngx_http_graphite_lock_stat_hold(storage, site, held);
 }
 
-ngx_int_t
-ngx_http_graphite_set(ngx_http_request_t *r, const ngx_str_t *name, double value) {
+static ngx_uint_t
+ngx_http_graphite_wlock(ngx_http_graphite_storage_t *storage, ngx_uint_t site) {
 
-    ngx_http_graphite_context_t context = ngx_http_graphite_context_from_request(r);
-    ngx_http_graphite_main_conf_t *gmcf = context.gmcf;
+    if (!storage->lock_profiling) {
+        ngx_rwlock_wlock(&storage->rwlock);
+        return 0;
+    }
 
-    if (!gmcf->enable)
-        return NGX_OK;
+    ngx_uint_t start = ngx_http_graphite_usec();
+    ngx_uint_t contended = (storage->rwlock != 0);
 
-    ngx_slab_pool_t *shpool = (ngx_slab_pool_t*)gmcf->shared->shm.addr;
-    const ngx_http_graphite_link_t *link = ngx_http_graphite_link2(&context, name, NULL);
+    ngx_rwlock_wlock(&storage->rwlock);
 
-    return ngx_http_graphite_set_by_link2(shpool, link, value);
-}
+    ngx_uint_t locked = ngx_http_graphite_usec();
+    ngx_http_graphite_lock_stat_wait(storage, site, contended, locked - start);
 
-ngx_int_t
-ngx_http_graphite_set_by_link(ngx_http_request_t *r, const ngx_http_graphite_link_t *link, double value) {
+    return locked;
+}
 
-    ngx_http_graphite_context_t context = ngx_http_graphite_context_from_request(r);
-    ngx_http_graphite_main_conf_t *gmcf = context.gmcf;
+static void
+ngx_http_graphite_wunlock(ngx_http_graphite_storage_t *storage, ngx_uint_t site, ngx_uint_t locked) {
 
-    if (!gmcf->enable)
-        return NGX_OK;
+    if (!storage->lock_profiling) {
+        ngx_rwlock_unlock(&storage->rwlock);
+        return;
+    }
 
-    ngx_slab_pool_t *shpool = (ngx_slab_pool_t*)gmcf->shared->shm.addr;
+    ngx_uint_t held = ngx_http_graphite_usec() - locked;
+    ngx_rwlock_unlock(&storage->rwlock);
 
-    return ngx_http_graphite_set_by_link2(shpool, link, value);
+    ngx_http_graphite_lock_stat_hold(storage, site, held);
 }
 
-static u_char*
-ngx_http_graphite_print_metric(ngx_http_graphite_main_conf_t *gmcf, ngx_http_graphite_storage_t *storage, ngx_uint_t m, const ngx_http_graphite_interval_t *interval, time_t ts, u_char *buffer, size_t buffer_size) {
+/*
+ * The upper bound of the bucket with the 99th percentile. The last bucket
+ * is open, so for it the bound below it is returned and overflow is set:
+ * the percentile is only known to be above it.
+ */
+static double
+ngx_http_graphite_lock_p99(const ngx_atomic_t *hist, const ngx_atomic_t *sent, ngx_uint_t *overflow) {
 
-    const ngx_http_graphite_metric_t *metric = &(((ngx_http_graphite_metric_t*)storage->metrics->elts)[m]);
-    const ngx_http_graphite_param_t *param = &((ngx_http_graphite_param_t*)storage->params->elts)[metric->param];
+    *overflow = 0;
 
-    if (metric->data == NULL)
-        return buffer;
+    ngx_uint_t total = 0;
+    ngx_uint_t b;
+    for (b = 0; b < NGX_HTTP_GRAPHITE_LOCK_BUCKETS; b++)
+        total += hist[b] - sent[b];
 
-    ngx_http_graphite_metric_data_t aggregate;
-    aggregate.value = 0;
-    aggregate.count = 0;
+    if (total == 0)
+        return 0;
 
-    unsigned l;
-    for (l = 0; l < interval->value; l++) {
-        if ((time_t)(ts - l - 1) >= storage->start_time) {
-            ngx_uint_t a = ((ts - l - 1 - storage->start_time) % (storage->max_interval + 1));
-            ngx_http_graphite_metric_data_t *data = &metric->data[a];
-            aggregate.value += data->value;
-            aggregate.count += data->count;
-        }
+    ngx_uint_t rank = total - total / 100;
+    ngx_uint_t count = 0;
+    for (b = 0; b < NGX_HTTP_GRAPHITE_LOCK_BUCKETS - 1; b++) {
+        count += hist[b] - sent[b];
+        if (count >= rank)
+            break;
     }
 
-    double value = param->aggregate(interval, &aggregate);
+    if (b == NGX_HTTP_GRAPHITE_LOCK_BUCKETS - 1) {
+        *overflow = 1;
+        b--;
+    }
 
-    u_char *b = buffer;
+    return (double)((ngx_uint_t)1 << b) / 1000;
+}
+
+static ngx_uint_t
+ngx_http_graphite_append_self_locks(ngx_http_graphite_main_conf_t *gmcf, ngx_http_graphite_storage_t *storage, time_t ts) {
+
+    ngx_http_graphite_buffer_t *buffer = &gmcf->buffer;
+    u_char *record = buffer->record;
+    ngx_uint_t skipped = 0;
+
+    ngx_uint_t site;
+    for (site = 0; site < NGX_HTTP_GRAPHITE_LOCK_SITES; site++) {
+        ngx_http_graphite_lock_stat_t stat = storage->locks[site];
+        ngx_http_graphite_lock_stat_t *sent = &storage->locks_sent[site];
+
+        ngx_uint_t acquires = stat.acquires - sent->acquires;
+        ngx_uint_t holds = 0;
+        ngx_uint_t b;
+        for (b = 0; b < NGX_HTTP_GRAPHITE_LOCK_BUCKETS; b++)
+            holds += stat.hold[b] - sent->hold[b];
+
+        ngx_uint_t wait_overflow, hold_overflow;
+        double wait_p99 = ngx_http_graphite_lock_p99(stat.wait, sent->wait, &wait_overflow);
+        double hold_p99 = ngx_http_graphite_lock_p99(stat.hold, sent->hold, &hold_overflow);
+
+        struct {
+            const char *name;
+            double value;
+        } values[] = {
+            { "acquires", (double)acquires },
+            { "contended", (double)(stat.contended - sent->contended) },
+            { "wait_time", acquires ? (double)(stat.wait_time - sent->wait_time) / acquires / 1000 : 0 },
+            { "hold_time", holds ? (double)(stat.hold_time - sent->hold_time) / holds / 1000 : 0 },
+            { "wait_p99", wait_p99 },
+            { "wait_p99_overflow", (double)wait_overflow },
+            { "hold_p99", hold_p99 },
+            { "hold_p99_overflow", (double)hold_overflow },
+        };
+
+        ngx_uint_t i;
+        for (i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+            u_char *b = record;
 
-    if (metric->split != SPLIT_INTERNAL) {
-        const ngx_str_t *split = &((ngx_str_t*)gmcf->splits->elts)[metric->split];
-        if (!gmcf->template->nelts) {
             if (gmcf->prefix.len)
-                b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.", &gmcf->prefix);
-            b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.%V.%V_%V", &gmcf->host, split, &param->name, &interval->name);
-        }
-        else {
-            const ngx_str_t *variables[] = TEMPLATE_VARIABLES(&gmcf->prefix, &gmcf->host, split, &param->name, &interval->name);
-            b = ngx_http_graphite_template_execute(b, buffer_size - (b - buffer), gmcf->template, variables);
+                b = ngx_snprintf((u_char*)b, buffer->size - (b - record), "%V.", &gmcf->prefix);
+            b = ngx_snprintf((u_char*)b, buffer->size - (b - record), "%V.graphite.lock.%V.%s %.3f %T\n", &gmcf->host, &ngx_http_graphite_lock_sites[site], values[i].name, values[i].value, ts);
+
+            skipped += ngx_http_graphite_append_record(buffer, b);
         }
-    }
-    else {
-        if (gmcf->prefix.len)
-            b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.", &gmcf->prefix);
-        b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.%V", &gmcf->host, &param->name);
-    }
 
-    b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), " %.3f %T\n", value, ts);
+        *sent = stat;
+    }
 
-    return b;
+    return skipped;
 }
 
-static u_char*
-ngx_http_graphite_print_gauge(ngx_http_graphite_main_conf_t *gmcf, ngx_http_graphite_storage_t *storage, ngx_uint_t g, time_t ts, u_char *buffer, size_t buffer_size) {
+static u_char *
+ngx_http_graphite_print_lock_stat(u_char *b, u_char *end, const char *scope, const ngx_str_t *site, const ngx_http_graphite_lock_stat_t *stat) {
 
-    const ngx_http_graphite_gauge_t *gauge = &(((ngx_http_graphite_gauge_t*)storage->gauges->elts)[g]);
-    const ngx_http_graphite_param_t *param = &((ngx_http_graphite_param_t*)storage->params->elts)[gauge->param];
+    b = ngx_slprintf(b, end, "%s.%V.acquires %uA\n", scope, site, stat->acquires);
+    b = ngx_slprintf(b, end, "%s.%V.contended %uA\n", scope, site, stat->contended);
+    b = ngx_slprintf(b, end, "%s.%V.wait_time_us %uA\n", scope, site, stat->wait_time);
+    b = ngx_slprintf(b, end, "%s.%V.hold_time_us %uA\n", scope, site, stat->hold_time);
 
-    if (gauge->data == NULL)
-        return buffer;
+    ngx_uint_t i;
+    for (i = 0; i < NGX_HTTP_GRAPHITE_LOCK_BUCKETS - 1; i++)
+        b = ngx_slprintf(b, end, "%s.%V.wait_lt_%uius %uA\n", scope, site, (ngx_uint_t)1 << i, stat->wait[i]);
+    b = ngx_slprintf(b, end, "%s.%V.wait_inf %uA\n", scope, site, stat->wait[i]);
 
-    double value = param->aggregate(NULL, gauge->data);
+    for (i = 0; i < NGX_HTTP_GRAPHITE_LOCK_BUCKETS - 1; i++)
+        b = ngx_slprintf(b, end, "%s.%V.hold_lt_%uius %uA\n", scope, site, (ngx_uint_t)1 << i, stat->hold[i]);
+    b = ngx_slprintf(b, end, "%s.%V.hold_inf %uA\n", scope, site, stat->hold[i]);
 
-    u_char *b = buffer;
+    return b;
+}
 
-    if (gmcf->prefix.len)
-        b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.", &gmcf->prefix);
-    b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.%V", &gmcf->host, &param->name);
+static ngx_int_t
+ngx_http_graphite_status_handler(ngx_http_request_t *r) {
 
-    b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), " %.3f %T\n", value, ts);
+    ngx_http_graphite_main_conf_t *gmcf = ngx_http_get_module_main_conf(r, ngx_http_graphite_module);
 
-    return b;
-}
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD)))
+        return NGX_HTTP_NOT_ALLOWED;
 
-static u_char*
-ngx_http_graphite_print_statistic(ngx_http_graphite_main_conf_t *gmcf, ngx_http_graphite_storage_t *storage, ngx_uint_t s, time_t ts, u_char *buffer, size_t buffer_size) {
+    if (!gmcf->enable)
+        return NGX_HTTP_NOT_FOUND;
 
-    const ngx_http_graphite_statistic_t *statistic = &(((ngx_http_graphite_statistic_t*)storage->statistics->elts)[s]);
-    const ngx_http_graphite_param_t *param = &((ngx_http_graphite_param_t*)storage->params->elts)[statistic->param];
+    ngx_int_t rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK)
+        return rc;
 
-    if (statistic->data == NULL)
-        return buffer;
+    ngx_slab_pool_t *shpool = (ngx_slab_pool_t*)gmcf->shared->shm.addr;
+    ngx_http_graphite_storage_t *storage = (ngx_http_graphite_storage_t*)shpool->data;
 
-    u_char p[8];
-    ngx_str_t percentile;
-    percentile.data = p;
-    percentile.len = ngx_snprintf(p, sizeof(p), "p%ui_%d", param->percentile / 1000, param->percentile % 1000) - p;
+    // 64 is the approximate size of the one line
+    size_t size = 64 + 2 * NGX_HTTP_GRAPHITE_LOCK_SITES * (4 + 2 * NGX_HTTP_GRAPHITE_LOCK_BUCKETS) * 64;
 
-    while (percentile.len && p[percentile.len - 1] == '0')
-        percentile.len--;
-    if (percentile.len && p[percentile.len - 1] == '_')
-        percentile.len--;
+    ngx_buf_t *buf = ngx_create_temp_buf(r->pool, size);
+    if (buf == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
 
-    ngx_http_graphite_statistic_data_t *data = statistic->data;
+    buf->last = ngx_slprintf(buf->last, buf->end, "lock_profiling %s\nworker_pid %P\n", storage->lock_profiling ? "on" : "off", ngx_pid);
+
+    ngx_uint_t site;
+    for (site = 0; site < NGX_HTTP_GRAPHITE_LOCK_SITES; site++)
+        buf->last = ngx_http_graphite_print_lock_stat(buf->last, buf->end, "shared", &ngx_http_graphite_lock_sites[site], &storage->locks[site]);
+    for (site = 0; site < NGX_HTTP_GRAPHITE_LOCK_SITES; site++)
+        buf->last = ngx_http_graphite_print_lock_stat(buf->last, buf->end, "worker", &ngx_http_graphite_lock_sites[site], &ngx_http_graphite_worker_locks[site]);
+
+    buf->last_buf = (r == r->main) ? 1 : 0;
+    buf->last_in_chain = 1;
 
-    u_char *b = buffer;
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = buf->last - buf->pos;
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
 
-    if (statistic->split != SPLIT_INTERNAL) {
-        const ngx_str_t *split = &((ngx_str_t*)gmcf->splits->elts)[statistic->split];
-        if (!gmcf->template->nelts) {
-            if (gmcf->prefix.len)
-                b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.", &gmcf->prefix);
-            b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.%V.%V_%V", &gmcf->host, split, &param->name, &percentile);
-        }
-        else {
-            const ngx_str_t *variables[] = TEMPLATE_VARIABLES(&gmcf->prefix, &gmcf->host, split, &param->name, &percentile);
-            b = ngx_http_graphite_template_execute(b, buffer_size - (b - buffer), gmcf->template, variables);
-        }
-    }
-    else {
-        if (gmcf->prefix.len)
-            b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.", &gmcf->prefix);
-        b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.%V_%V", &gmcf->host, &param->name, &percentile);
-    }
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+        return rc;
 
-    b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), " %.3f %T\n", data->q[P2_METRIC_COUNT / 2], ts);
+    ngx_chain_t out;
+    out.buf = buf;
+    out.next = NULL;
 
-    return b;
+    return ngx_http_output_filter(r, &out);
 }
 
-#ifdef NGX_LOG_LIMIT_ENABLED
-static u_char*
-ngx_http_graphite_print_log(
-    ngx_http_graphite_main_conf_t *gmcf, ngx_http_graphite_log_t *gl,
-    time_t ts, u_char *buffer, size_t buffer_size)
-{
-    size_t total = 0;
-    size_t skipped = 0;
-    u_char *b = buffer;
-    ngx_uint_t i;
+/* returns 1 for a record too long for a block, records lost for lack of memory are counted in the buffer */
+static ngx_uint_t
+ngx_http_graphite_append_record(ngx_http_graphite_buffer_t *buffer, u_char *last) {
 
-    for (i = 0; i != gl->error_logs->nelts; i++) {
-        ngx_log_t *log = ((ngx_log_t**)gl->error_logs->elts)[i];
-        ngx_log_grow_t *grow = &log->shared->grow;
+    if (last == buffer->record)
+        return 0;
 
-        skipped += grow->total_bytes_skipped;
-        total += grow->total_bytes;
-    }
-    if (gmcf->prefix.len)
-        b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.", &gmcf->prefix);
-    b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.%V.%V.total %uz %T\n", &gmcf->host, &gmcf->error_log, &gl->name, total, ts);
+    ngx_int_t rc = ngx_http_graphite_buffer_append(buffer, last);
 
-    if (gmcf->prefix.len)
-        b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.", &gmcf->prefix);
-    b = ngx_snprintf((u_char*)b, buffer_size - (b - buffer), "%V.%V.%V.skipped %uz %T\n", &gmcf->host, &gmcf->error_log, &gl->name, skipped, ts);
+    if (rc == NGX_ERROR)
+        buffer->nomemory++;
 
-    return b;
+    return (rc == NGX_DECLINED) ? 1 : 0;
 }
-#endif
 
 static void
 ngx_http_graphite_timer_handler(ngx_event_t *ev) {
@@ -3200,16 +5787,21 @@ ngx_http_graphite_timer_handler(ngx_event_t *ev) {
     ngx_http_graphite_main_conf_t *gmcf;
     gmcf = ev->data;
 
-    ngx_buf_t *buffer = &gmcf->buffer;
-    u_char *b = buffer->start;
+    ngx_http_graphite_buffer_t *buffer = &gmcf->buffer;
+    u_char *record = buffer->record;
+    ngx_uint_t skipped = 0;
 
     ngx_slab_pool_t *shpool = (ngx_slab_pool_t*)gmcf->shared->shm.addr;
     ngx_http_graphite_storage_t *storage = (ngx_http_graphite_storage_t*)shpool->data;
 
-    ngx_shmtx_lock(&shpool->mutex);
+    ngx_uint_t start = ngx_http_graphite_usec();
+
+    ngx_uint_t profiled = ngx_http_graphite_lock(shpool, LOCK_SITE_FLUSH);
+
+    ngx_uint_t locked = ngx_http_graphite_usec();
 
     if ((ts - storage->event_time) * 1000 < (int)gmcf->frequency) {
-        ngx_shmtx_unlock(&shpool->mutex);
+        ngx_http_graphite_unlock(shpool, LOCK_SITE_FLUSH, profiled);
         if (!(ngx_quit || ngx_terminate || ngx_exiting))
             ngx_add_timer(ev, gmcf->frequency);
         return;
@@ -3217,10 +5809,13 @@ ngx_http_graphite_timer_handler(ngx_event_t *ev) {
 
     if (gmcf->connection) {
         ngx_log_error(NGX_LOG_ERR, ev->log, 0, "graphite can't send buffer completely");
+        ngx_atomic_fetch_add(&storage->stat.dropped_flushes, 1);
         ngx_close_connection(gmcf->connection);
         gmcf->connection = NULL;
     }
 
+    ngx_http_graphite_buffer_reset(buffer);
+
     if (storage->allocator->nomemory)
         ngx_log_error(NGX_LOG_ALERT, ev->log, 0, "graphite shared memory is full");
 
@@ -3228,62 +5823,112 @@ ngx_http_graphite_timer_handler(ngx_event_t *ev) {
 
     ngx_http_graphite_del_old_records(gmcf, ts);
 
-    ngx_uint_t m;
-    for (m = 0; m < storage->metrics->nelts; m++) {
+    ngx_uint_t full = 0;
+    if (gmcf->heartbeat && (ngx_uint_t)(ts - storage->heartbeat_time) >= gmcf->heartbeat) {
+        storage->heartbeat_time = ts;
+        full = 1;
+    }
+
+    ngx_uint_t i, m;
+    for (i = 0; i < gmcf->intervals->nelts; i++) {
+        const ngx_http_graphite_interval_t *interval = &((ngx_http_graphite_interval_t*)gmcf->intervals->elts)[i];
+
+        ngx_http_graphite_reduce_metrics(gmcf, storage, interval, ts);
+
+        for (m = 0; m < storage->metrics->nelts; m++) {
+            const ngx_http_graphite_metric_t *metric = &(((ngx_http_graphite_metric_t*)storage->metrics->elts)[m]);
+            const ngx_http_graphite_param_t *param = &((ngx_http_graphite_param_t*)storage->params->elts)[metric->param];
+
+            if (metric->split != SPLIT_INTERNAL && param->ewma.value == 0 && !ngx_http_graphite_idle_metric(gmcf, storage, m, i, full))
+                skipped += ngx_http_graphite_append_record(buffer, ngx_http_graphite_print_metric(gmcf, storage, m, interval, ts, record, buffer->size));
+        }
+    }
+
+    ngx_http_graphite_update_ewma(gmcf, storage, ts);
+
+    for (m = 0; m < storage->plane_metrics; m++) {
         const ngx_http_graphite_metric_t *metric = &(((ngx_http_graphite_metric_t*)storage->metrics->elts)[m]);
         const ngx_http_graphite_param_t *param = &((ngx_http_graphite_param_t*)storage->params->elts)[metric->param];
 
-        if (metric->split != SPLIT_INTERNAL) {
-            ngx_uint_t i;
-            for (i = 0; i < gmcf->intervals->nelts; i++) {
-                const ngx_http_graphite_interval_t *interval = &((ngx_http_graphite_interval_t*)gmcf->intervals->elts)[i];
-                b = ngx_http_graphite_print_metric(gmcf, storage, m, interval, ts, b, gmcf->buffer_size - (b - buffer->start));
-            }
+        if (metric->split != SPLIT_INTERNAL && param->ewma.value != 0) {
+            const ngx_str_t *split = &((ngx_str_t*)gmcf->splits->elts)[metric->split];
+            skipped += ngx_http_graphite_append_series(gmcf, split, &param->name, &param->ewma, storage->metric_ewma[m], ts);
         }
-        else
-            b = ngx_http_graphite_print_metric(gmcf, storage, m, &param->interval, ts, b, gmcf->buffer_size - (b - buffer->start));
+    }
+
+    for (m = 0; m < storage->metrics->nelts; m++) {
+        const ngx_http_graphite_metric_t *metric = &(((ngx_http_graphite_metric_t*)storage->metrics->elts)[m]);
+        const ngx_http_graphite_param_t *param = &((ngx_http_graphite_param_t*)storage->params->elts)[metric->param];
+
+        if (metric->split == SPLIT_INTERNAL)
+            skipped += ngx_http_graphite_append_record(buffer, ngx_http_graphite_print_metric(gmcf, storage, m, &param->interval, ts, record, buffer->size));
     }
 
     ngx_uint_t g;
     for (g = 0; g < storage->gauges->nelts; g++)
-        b = ngx_http_graphite_print_gauge(gmcf, storage, g, ts, b, gmcf->buffer_size - (b - buffer->start));
+        skipped += ngx_http_graphite_append_record(buffer, ngx_http_graphite_print_gauge(gmcf, storage, g, ts, record, buffer->size));
 
     ngx_uint_t s;
     for (s = 0; s < storage->statistics->nelts; s++) {
         const ngx_http_graphite_statistic_t *statistic = &(((ngx_http_graphite_statistic_t*)storage->statistics->elts)[s]);
-        const ngx_http_graphite_param_t *param = &((ngx_http_graphite_param_t*)storage->params->elts)[statistic->param];
+        if (statistic->group == s && statistic->data != NULL)
+            ngx_http_graphite_statistic_sort(statistic->data);
+    }
+
+    for (s = 0; s < storage->statistics->nelts; s++)
+        skipped += ngx_http_graphite_append_record(buffer, ngx_http_graphite_print_statistic(gmcf, storage, s, ts, record, buffer->size));
 
-        b = ngx_http_graphite_print_statistic(gmcf, storage, s, ts, b, gmcf->buffer_size - (b - buffer->start));
+    for (s = 0; s < storage->statistics->nelts; s++) {
+        const ngx_http_graphite_statistic_t *statistic = &(((ngx_http_graphite_statistic_t*)storage->statistics->elts)[s]);
+        if (statistic->group == s && statistic->data != NULL)
+            ngx_http_graphite_statistic_reset(statistic->data);
+    }
 
-        ngx_http_graphite_statistic_data_t *data = statistic->data;
-        ngx_http_graphite_statistic_init(data, param->percentile);
+    ngx_uint_t v;
+    for (v = 0; v < storage->vectors->nelts; v++) {
+        ngx_uint_t i;
+        for (i = 0; i < gmcf->intervals->nelts; i++) {
+            const ngx_http_graphite_interval_t *interval = &((ngx_http_graphite_interval_t*)gmcf->intervals->elts)[i];
+            skipped += ngx_http_graphite_append_vector(gmcf, storage, v, interval, ts);
+        }
     }
 
-    ngx_shmtx_unlock(&shpool->mutex);
+    if (gmcf->self)
+        skipped += ngx_http_graphite_append_self(gmcf, shpool, ts);
+
+    ngx_http_graphite_unlock(shpool, LOCK_SITE_FLUSH, profiled);
 
 #ifdef NGX_LOG_LIMIT_ENABLED
-    ngx_uint_t i;
     for (i = 0; i != gmcf->logs->nelts; i++) {
         ngx_http_graphite_log_t *gl = &((ngx_http_graphite_log_t*)gmcf->logs->elts)[i];
-        b = ngx_http_graphite_print_log(gmcf, gl, ts, b, gmcf->buffer_size - (b - buffer->start));
+        skipped += ngx_http_graphite_append_record(buffer, ngx_http_graphite_print_log(gmcf, gl, ts, record, buffer->size));
     }
 #endif
 
-    *b = '\0';
-
-    if (b == buffer->start + gmcf->buffer_size) {
-        ngx_log_error(NGX_LOG_ALERT, ev->log, 0, "graphite buffer size is too small");
-        if (!(ngx_quit || ngx_terminate || ngx_exiting))
-            ngx_add_timer(ev, gmcf->frequency);
-        return;
+    if (skipped) {
+        ngx_log_error(NGX_LOG_ALERT, ev->log, 0, "graphite buffer size is too small, %ui records skipped", skipped);
+        ngx_atomic_fetch_add(&storage->stat.skipped_records, skipped);
     }
 
-    if (b != buffer->start) {
-        buffer->pos = buffer->start;
-        buffer->last = b;
-        ngx_http_graphite_net_send_buffer(gmcf, ev->log);
+    /* a flush without all of its records is not sent completely */
+    ngx_uint_t dropped = 0;
+    if (buffer->nomemory) {
+        ngx_log_error(NGX_LOG_ALERT, ev->log, 0, "graphite can't alloc buffer, %ui records dropped", buffer->nomemory);
+        dropped = 1;
     }
 
+    ngx_uint_t formatted = ngx_http_graphite_usec();
+
+    if (buffer->out && ngx_http_graphite_net_send_buffer(gmcf, ev->log) != NGX_OK)
+        dropped = 1;
+
+    if (dropped)
+        ngx_atomic_fetch_add(&storage->stat.dropped_flushes, 1);
+
+    storage->stat.flush_lock_time = locked - start;
+    storage->stat.flush_format_time = formatted - locked;
+    storage->stat.flush_send_time = ngx_http_graphite_usec() - formatted;
+
     if (!(ngx_quit || ngx_terminate || ngx_exiting))
         ngx_add_timer(ev, gmcf->frequency);
 }
@@ -3296,15 +5941,29 @@ ngx_http_graphite_del_old_records(ngx_http_graphite_main_conf_t *gmcf, time_t ts
 
     while ((ngx_uint_t)storage->last_time + storage->max_interval < (ngx_uint_t)ts) {
 
+        ngx_uint_t a = ((storage->last_time - storage->start_time) % (storage->max_interval + 1));
+
+        ngx_memzero(&storage->metric_values[a * storage->metric_stride], sizeof(double) * storage->metric_stride);
+        ngx_memzero(&storage->metric_counts[a * storage->metric_stride], sizeof(ngx_uint_t) * storage->metric_stride);
+        ngx_memzero((void*)&storage->metric_ints[a * storage->metric_stride], sizeof(ngx_atomic_t) * storage->metric_stride);
+        if (storage->metric_squares)
+            ngx_memzero(&storage->metric_squares[a * storage->metric_stride], sizeof(double) * storage->metric_stride);
+
         ngx_uint_t m;
-        for (m = 0; m < storage->metrics->nelts; m++) {
+        for (m = storage->plane_metrics; m < storage->metrics->nelts; m++) {
             ngx_http_graphite_metric_t *metric = &(((ngx_http_graphite_metric_t*)storage->metrics->elts)[m]);
 
-            ngx_uint_t a = ((storage->last_time - storage->start_time) % (storage->max_interval + 1));
-            ngx_http_graphite_metric_data_t *data = &metric->data[a];
+            metric->values[a * metric->stride] = 0;
+            metric->counts[a * metric->stride] = 0;
+            if (metric->squares)
+                metric->squares[a * metric->stride] = 0;
+        }
+
+        ngx_uint_t v;
+        for (v = 0; v < storage->vectors->nelts; v++) {
+            ngx_http_graphite_vector_t *vector = &(((ngx_http_graphite_vector_t*)storage->vectors->elts)[v]);
 
-            data->value = 0;
-            data->count = 0;
+            ngx_memzero(&vector->data[a * vector->cells], sizeof(uint32_t) * vector->cells);
         }
 
         storage->last_time++;
@@ -3429,26 +6088,41 @@ ngx_http_graphite_source_response_5xx_rps(const ngx_http_graphite_source_t *sour
 static double
 ngx_http_graphite_source_response_xxx_rps(const ngx_http_graphite_source_t *source, ngx_http_request_t *r) {
 
-    ngx_uint_t status = ngx_atoi(source->name.data + sizeof("response_") - 1, 3);
-    if (r->headers_out.status == status)
+    if (r->headers_out.status == source->arg)
         return 1;
     else
         return 0;
 }
 
-static double
-ngx_http_graphite_source_upstream_cache_status_rps(const ngx_http_graphite_source_t *source, ngx_http_request_t *r) {
-#if NGX_HTTP_CACHE
+static ngx_uint_t
+ngx_http_graphite_status_cell(ngx_uint_t status) {
 
-    if (r->upstream == NULL || r->upstream->cache_status == 0)
+    if (status < 100 || status >= 600)
         return 0;
 
-    ngx_str_t param_status;
-    param_status.data = source->name.data + sizeof("upstream_cache_") - 1;
-    param_status.len = source->name.len - (sizeof("upstream_cache_") - 1) - 4;
+    return ngx_http_graphite_status_cells[status - 100];
+}
+
+static u_char *
+ngx_http_graphite_status_label(const ngx_http_graphite_source_t *source, ngx_uint_t cell, u_char *buffer, size_t buffer_size) {
+
+    if (cell == 0 || cell >= STATUS_CELLS)
+        return ngx_snprintf(buffer, buffer_size, "other");
+
+    return ngx_snprintf(buffer, buffer_size, "%ui", ngx_http_graphite_status_codes[cell - 1]);
+}
+
+static void
+ngx_http_graphite_source_response_codes_rps(const ngx_http_graphite_source_t *source, ngx_http_request_t *r, uint32_t *row) {
+
+    row[ngx_http_graphite_status_cell(r->headers_out.status)]++;
+}
+
+static double
+ngx_http_graphite_source_upstream_cache_status_rps(const ngx_http_graphite_source_t *source, ngx_http_request_t *r) {
+#if NGX_HTTP_CACHE
 
-    ngx_str_t cache_status = ngx_http_cache_status[r->upstream->cache_status - 1];
-    if (cache_status.len == param_status.len && ngx_strncasecmp(cache_status.data, param_status.data, param_status.len) == 0)
+    if (r->upstream != NULL && r->upstream->cache_status == source->arg)
         return 1;
     else
         return 0;
@@ -3457,6 +6131,201 @@ ngx_http_graphite_source_upstream_cache_status_rps(const ngx_http_graphite_sourc
 #endif
 }
 
+static void
+ngx_http_graphite_source_upstream_cache_codes_rps(const ngx_http_graphite_source_t *source, ngx_http_request_t *r, uint32_t *row) {
+#if NGX_HTTP_CACHE
+
+    if (r->upstream == NULL || r->upstream->cache_status == 0)
+        return;
+
+    ngx_uint_t cell = r->upstream->cache_status;
+    row[(cell < CACHE_STATUS_CELLS) ? cell : 0]++;
+#endif
+}
+
+static u_char *
+ngx_http_graphite_cache_status_label(const ngx_http_graphite_source_t *source, ngx_uint_t cell, u_char *buffer, size_t buffer_size) {
+
+    if (cell == 0 || cell >= CACHE_STATUS_CELLS)
+        return ngx_snprintf(buffer, buffer_size, "other");
+
+    return ngx_snprintf(buffer, buffer_size, "%V", &ngx_http_graphite_cache_statuses[cell - 1]);
+}
+
+static double
+ngx_http_graphite_source_apdex(const ngx_http_graphite_source_t *source, ngx_http_request_t *r) {
+
+    double value = source->base(source, r);
+
+    if (value <= source->threshold)
+        return 2;
+    if (value <= source->threshold * 4)
+        return 1;
+
+    return 0;
+}
+
+static void
+ngx_http_graphite_topk_add(ngx_http_graphite_topk_entry_t *entries, ngx_uint_t n, uint32_t hash, const u_char *key, size_t len, uint32_t weight) {
+
+    ngx_http_graphite_topk_entry_t *min = NULL;
+
+    ngx_uint_t i;
+    for (i = 0; i < n; i++) {
+        ngx_http_graphite_topk_entry_t *entry = &entries[i];
+
+        if (entry->weight != 0 && entry->hash == hash) {
+            entry->weight += weight;
+            return;
+        }
+
+        if (min == NULL || entry->weight < min->weight)
+            min = entry;
+    }
+
+    /* the lightest key is evicted, its weight is the error of the new one */
+    min->weight += weight;
+    min->hash = hash;
+    min->len = ngx_min(len, TOPK_KEY);
+    ngx_memcpy(min->key, key, min->len);
+}
+
+static void
+ngx_http_graphite_topk_merge(ngx_http_graphite_topk_merge_t *entries, const ngx_http_graphite_topk_entry_t *row) {
+
+    ngx_http_graphite_topk_merge_t *min = NULL;
+
+    ngx_uint_t i;
+    for (i = 0; i < TOPK_MERGE; i++) {
+        ngx_http_graphite_topk_merge_t *entry = &entries[i];
+
+        if (entry->weight != 0 && entry->hash == row->hash) {
+            entry->weight += row->weight;
+            return;
+        }
+
+        if (min == NULL || entry->weight < min->weight)
+            min = entry;
+    }
+
+    min->weight += row->weight;
+    min->hash = row->hash;
+    min->len = row->len;
+    ngx_memcpy(min->key, row->key, row->len);
+}
+
+static void
+ngx_http_graphite_source_key(const ngx_http_graphite_source_t *source, ngx_http_request_t *r, ngx_http_graphite_key_t *key) {
+
+    key->weight = 0;
+
+    /* a topk key is weighted by the rounded base, a unique one is counted once */
+    double value = source->base(source, r);
+    if (source->topk ? value < 0.5 : (source->counter && value == 0))
+        return;
+
+    ngx_http_variable_value_t *v = ngx_http_get_indexed_variable(r, source->variable);
+    if (v == NULL || v->not_found || v->len == 0)
+        return;
+
+    key->value.data = v->data;
+    key->value.len = v->len;
+    key->hash = ngx_murmur_hash2(v->data, v->len);
+    key->weight = source->topk ? (uint32_t)(value + 0.5) : 1;
+}
+
+static void
+ngx_http_graphite_source_topk(const ngx_http_graphite_source_t *source, const ngx_http_graphite_key_t *key, uint32_t *row) {
+
+    if (key->weight == 0)
+        return;
+
+    ngx_http_graphite_topk_add((ngx_http_graphite_topk_entry_t*)row, TOPK_COUNTERS, key->hash, key->value.data, key->value.len, key->weight);
+}
+
+static void
+ngx_http_graphite_source_unique(const ngx_http_graphite_source_t *source, const ngx_http_graphite_key_t *key, uint32_t *row) {
+
+    if (key->weight == 0)
+        return;
+
+    uint32_t hash = key->hash;
+
+    /* the high bits choose the register, the rank is counted in the rest */
+    ngx_uint_t reg = hash >> 24;
+    uint32_t rest = hash << 8;
+
+    ngx_uint_t rank = 1;
+    while (rank < UNIQUE_MAX_RANK && !(rest & 0x80000000)) {
+        rank++;
+        rest <<= 1;
+    }
+
+    u_char *regs = (u_char*)row;
+    ngx_uint_t shift = (reg & 1) * 4;
+
+    if (((regs[reg >> 1] >> shift) & 0xf) < rank)
+        regs[reg >> 1] = (regs[reg >> 1] & ~(0xf << shift)) | (rank << shift);
+}
+
+static ngx_uint_t
+ngx_http_graphite_buckets_cell(const ngx_http_graphite_source_t *source, double value) {
+
+    /* the last cell is for values above all bounds */
+    ngx_uint_t lo = 0;
+    ngx_uint_t hi = source->cells - 1;
+    while (lo < hi) {
+        ngx_uint_t mid = (lo + hi) / 2;
+        if (value <= source->bounds[mid])
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return lo;
+}
+
+static u_char *
+ngx_http_graphite_buckets_label(const ngx_http_graphite_source_t *source, ngx_uint_t cell, u_char *buffer, size_t buffer_size) {
+
+    if (cell >= source->cells - 1)
+        return ngx_snprintf(buffer, buffer_size, "inf");
+
+    return ngx_snprintf(buffer, buffer_size, "%ui", source->bounds[cell]);
+}
+
+static ngx_int_t
+ngx_http_graphite_source_init_status(ngx_http_graphite_source_t *source) {
+
+    /* name ends with NNN_rps */
+    ngx_int_t status = ngx_atoi(source->name.data + source->name.len - (sizeof("NNN_rps") - 1), 3);
+    if (status == NGX_ERROR)
+        return NGX_ERROR;
+
+    source->arg = status;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_graphite_source_init_cache_status(ngx_http_graphite_source_t *source) {
+
+    ngx_str_t status;
+    status.data = source->name.data + sizeof("upstream_cache_") - 1;
+    status.len = source->name.len - (sizeof("upstream_cache_") - 1) - (sizeof("_rps") - 1);
+
+    ngx_uint_t i;
+    for (i = 0; i < CACHE_STATUS_CELLS - 1; i++) {
+        const ngx_str_t *name = &ngx_http_graphite_cache_statuses[i];
+        if (name->len == status.len && ngx_strncmp(name->data, status.data, status.len) == 0) {
+            source->arg = i + 1;
+            return NGX_OK;
+        }
+    }
+
+    return NGX_ERROR;
+}
+
 #ifdef NGX_GRAPHITE_PATCH
 
 static double
@@ -3669,17 +6538,16 @@ ngx_http_graphite_source_upstream_response_5xx_rps(const ngx_http_graphite_sourc
 static double
 ngx_http_graphite_source_upstream_response_xxx_rps(const ngx_http_graphite_source_t *source, ngx_http_request_t *r) {
 #if nginx_version >= 1009001
-    ngx_uint_t i, status, counter = 0;
+    ngx_uint_t i, counter = 0;
     ngx_http_upstream_state_t *state;
 
     if (r->upstream_states == NULL)
         return 0;
 
-    status = ngx_atoi(source->name.data + sizeof("upstream_response_") - 1, 3);
     state = r->upstream_states->elts;
 
     for (i = 0; i < r->upstream_states->nelts; i++) {
-        if (state[i].header_time != (ngx_msec_t)-1 && state[i].status == status)
+        if (state[i].header_time != (ngx_msec_t)-1 && state[i].status == source->arg)
             counter++;
     }
 
@@ -3689,6 +6557,24 @@ ngx_http_graphite_source_upstream_response_xxx_rps(const ngx_http_graphite_sourc
 #endif
 }
 
+static void
+ngx_http_graphite_source_upstream_response_codes_rps(const ngx_http_graphite_source_t *source, ngx_http_request_t *r, uint32_t *row) {
+#if nginx_version >= 1009001
+    ngx_uint_t i;
+    ngx_http_upstream_state_t *state;
+
+    if (r->upstream_states == NULL)
+        return;
+
+    state = r->upstream_states->elts;
+
+    for (i = 0; i < r->upstream_states->nelts; i++) {
+        if (state[i].header_time != (ngx_msec_t)-1)
+            row[ngx_http_graphite_status_cell(state[i].status)]++;
+    }
+#endif
+}
+
 static double
 ngx_http_graphite_aggregate_avg(const ngx_http_graphite_interval_t *interval, const void *data) {
 
@@ -3716,3 +6602,44 @@ ngx_http_graphite_aggregate_gauge(const ngx_http_graphite_interval_t *interval,
     ngx_http_graphite_gauge_data_t *gauge_data = (ngx_http_graphite_gauge_data_t*)data;
     return gauge_data->value;
 }
+
+static double
+ngx_http_graphite_aggregate_min(const ngx_http_graphite_interval_t *interval, const void *data) {
+
+    ngx_http_graphite_metric_data_t *metric_data = (ngx_http_graphite_metric_data_t*)data;
+    return (metric_data->count != 0) ? metric_data->value : 0;
+}
+
+static double
+ngx_http_graphite_aggregate_max(const ngx_http_graphite_interval_t *interval, const void *data) {
+
+    ngx_http_graphite_metric_data_t *metric_data = (ngx_http_graphite_metric_data_t*)data;
+    return (metric_data->count != 0) ? metric_data->value : 0;
+}
+
+static double
+ngx_http_graphite_aggregate_count(const ngx_http_graphite_interval_t *interval, const void *data) {
+
+    ngx_http_graphite_metric_data_t *metric_data = (ngx_http_graphite_metric_data_t*)data;
+    return metric_data->count;
+}
+
+static double
+ngx_http_graphite_aggregate_stddev(const ngx_http_graphite_interval_t *interval, const void *data) {
+
+    ngx_http_graphite_metric_data_t *metric_data = (ngx_http_graphite_metric_data_t*)data;
+    if (metric_data->count == 0)
+        return 0;
+
+    double avg = metric_data->value / metric_data->count;
+    double variance = metric_data->squares / metric_data->count - avg * avg;
+
+    return (variance > 0) ? sqrt(variance) : 0;
+}
+
+static double
+ngx_http_graphite_aggregate_apdex(const ngx_http_graphite_interval_t *interval, const void *data) {
+
+    ngx_http_graphite_metric_data_t *metric_data = (ngx_http_graphite_metric_data_t*)data;
+    return (metric_data->count != 0) ? metric_data->value / (2 * metric_data->count) : 0;
+}
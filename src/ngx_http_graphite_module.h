@@ -8,13 +8,45 @@
 
 #include "ngx_http_graphite_allocator.h"
 #include "ngx_http_graphite_array.h"
+#include "ngx_http_graphite_buffer.h"
+#include "ngx_http_graphite_hash.h"
+
+typedef struct {
+    ngx_atomic_t flush_lock_time;
+    ngx_atomic_t flush_format_time;
+    ngx_atomic_t flush_send_time;
+
+    ngx_atomic_t sent_bytes;
+    ngx_atomic_t sent_datagrams;
+    ngx_atomic_t send_errors;
+    ngx_atomic_t dropped_flushes;
+    ngx_atomic_t skipped_records;
+
+    ngx_atomic_t handler_time;
+    ngx_atomic_t handler_samples;
+} ngx_http_graphite_stat_t;
+
+#define NGX_HTTP_GRAPHITE_LOCK_SITES 5
+#define NGX_HTTP_GRAPHITE_LOCK_BUCKETS 16
+
+typedef struct {
+    ngx_atomic_t acquires;
+    ngx_atomic_t contended;
+    ngx_atomic_t wait_time;
+    ngx_atomic_t hold_time;
+    ngx_atomic_t wait[NGX_HTTP_GRAPHITE_LOCK_BUCKETS];
+    ngx_atomic_t hold[NGX_HTTP_GRAPHITE_LOCK_BUCKETS];
+} ngx_http_graphite_lock_stat_t;
 
 typedef struct ngx_http_graphite_storage_s {
     time_t start_time;
     time_t last_time;
     time_t event_time;
+    time_t heartbeat_time;
+    time_t ewma_time;
 
     ngx_atomic_t rwlock;
+    ngx_atomic_t degradation;
 
     ngx_uint_t max_interval;
 
@@ -23,9 +55,25 @@ typedef struct ngx_http_graphite_storage_s {
     ngx_http_graphite_array_t *metrics;
     ngx_http_graphite_array_t *gauges;
     ngx_http_graphite_array_t *statistics;
+    ngx_http_graphite_array_t *vectors;
+
+    double *metric_values;
+    ngx_uint_t *metric_counts;
+    ngx_atomic_t *metric_ints;
+    double *metric_squares;
+    ngx_uint_t metric_stride;
+    ngx_uint_t plane_metrics;
+    u_char *metric_active;
+    double *metric_ewma;
 
     ngx_http_graphite_array_t *params;
-    ngx_http_graphite_array_t *internals;
+    ngx_http_graphite_hash_t *internals;
+
+    ngx_http_graphite_stat_t stat;
+
+    ngx_uint_t lock_profiling;
+    ngx_http_graphite_lock_stat_t locks[NGX_HTTP_GRAPHITE_LOCK_SITES];
+    ngx_http_graphite_lock_stat_t locks_sent[NGX_HTTP_GRAPHITE_LOCK_SITES];
 
 } ngx_http_graphite_storage_t;
 
@@ -35,6 +83,8 @@ typedef struct {
     ngx_str_t name;
 } ngx_http_graphite_server_t;
 
+typedef struct ngx_http_graphite_key_s ngx_http_graphite_key_t;
+
 typedef struct {
 
     ngx_uint_t enable;
@@ -45,7 +95,7 @@ typedef struct {
     ngx_str_t error_log;
 #endif
     ngx_shm_zone_t *shared;
-    ngx_buf_t buffer;
+    ngx_http_graphite_buffer_t buffer;
 
     ngx_str_t prefix;
 
@@ -58,6 +108,12 @@ typedef struct {
     ngx_array_t *splits;
 
     ngx_uint_t timeout;
+    ngx_uint_t self;
+    ngx_uint_t lock_profiling;
+    ngx_uint_t idle;
+    ngx_uint_t heartbeat;
+    ngx_uint_t percentile_mode;
+    ngx_uint_t budget;
 
     ngx_array_t *default_params;
 
@@ -72,12 +128,23 @@ typedef struct {
     ngx_http_complex_value_t *default_data_filter;
 
     ngx_array_t *datas;
+    ngx_array_t *plans;
+    ngx_array_t *filters;
+    ngx_array_t *rollups;
+    ngx_array_t *data_statistics;
     ngx_array_t *internal_values;
+    double *scratch_values;
+    u_char *scratch_filters;
+    ngx_http_graphite_key_t *scratch_keys;
+    double *reduce_values;
+    ngx_uint_t *reduce_counts;
+    ngx_atomic_uint_t *reduce_ints;
 #ifdef NGX_LOG_LIMIT_ENABLED
     ngx_array_t *logs;
 #endif
 
     ngx_http_graphite_storage_t *storage;
+    ngx_http_graphite_hash_t *links;
 
     ngx_connection_t *connection;
 
@@ -5,10 +5,14 @@
 
 #include "ngx_http_graphite_module.h"
 
+#define NGX_HTTP_GRAPHITE_NET_IOVS 64
+
 static ngx_int_t ngx_http_graphite_net_send_tcp(ngx_http_graphite_main_conf_t *gmcf, ngx_log_t *log);
 static ngx_int_t ngx_http_graphite_net_send_udp(ngx_http_graphite_main_conf_t *gmcf, ngx_log_t *log);
 static ngx_int_t ngx_http_graphite_net_connect_tcp(ngx_http_graphite_main_conf_t *gmcf, ngx_log_t *log);
 static ngx_int_t ngx_http_graphite_net_connect_udp(ngx_http_graphite_main_conf_t *gmcf, ngx_log_t *log);
+static ngx_int_t ngx_http_graphite_net_send_iovs(ngx_connection_t *c, struct iovec *iovs, ngx_uint_t niovs, size_t size, ngx_log_t *log);
+static ngx_http_graphite_stat_t *ngx_http_graphite_net_stat(ngx_http_graphite_main_conf_t *gmcf);
 static void ngx_http_graphite_tcp_read(ngx_event_t *rev);
 static void ngx_http_graphite_tcp_write(ngx_event_t *wev);
 
@@ -33,10 +37,14 @@ ngx_http_graphite_net_send_tcp(ngx_http_graphite_main_conf_t *gmcf, ngx_log_t *l
         return NGX_ERROR;
 
     ngx_int_t rc = ngx_http_graphite_net_connect_tcp(gmcf, log);
-    if (rc == NGX_ERROR)
+    if (rc == NGX_ERROR) {
+        ngx_atomic_fetch_add(&ngx_http_graphite_net_stat(gmcf)->send_errors, 1);
         return NGX_ERROR;
+    }
 
     gmcf->connection->data = gmcf;
+    gmcf->buffer.busy = gmcf->buffer.out;
+
     gmcf->connection->read->handler = ngx_http_graphite_tcp_read;
     gmcf->connection->write->handler = ngx_http_graphite_tcp_write;
 
@@ -57,44 +65,66 @@ ngx_http_graphite_net_send_udp(ngx_http_graphite_main_conf_t *gmcf, ngx_log_t *l
 
     if (ngx_http_graphite_net_connect_udp(gmcf, log) != NGX_OK) {
         ngx_log_error(NGX_LOG_ERR, log, 0, "graphite connect to %V failed", &gmcf->server.name);
+        ngx_atomic_fetch_add(&ngx_http_graphite_net_stat(gmcf)->send_errors, 1);
         gmcf->connection = NULL;
         return NGX_ERROR;
     }
 
     gmcf->connection->data = gmcf;
 
-    ngx_buf_t *b = &gmcf->buffer;
+    struct iovec iovs[NGX_HTTP_GRAPHITE_NET_IOVS];
+    ngx_uint_t niovs = 0;
+    size_t size = 0;
 
-    u_char *part = b->start;
-    u_char *next = NULL;
-    u_char *nl = NULL;
+    ngx_chain_t *cl;
+    for (cl = gmcf->buffer.out; cl; cl = cl->next) {
 
-    while (*part) {
-        next = part;
-        nl = part;
+        u_char *part = cl->buf->pos;
 
-        while ((next = (u_char*)ngx_strchr(next, '\n')) && ((size_t)(next - part) <= gmcf->package_size)) {
-            nl = next;
-            next++;
-        }
-        if (nl > part) {
-            ssize_t n = ngx_send(gmcf->connection, part, nl - part + 1);
+        while (part < cl->buf->last) {
+            u_char *nl = NULL;
+            u_char *next = part;
 
-            if (n == -1) {
-                ngx_log_error(NGX_LOG_ERR, log, n, "graphite udp send error");
-                goto failed;
+            while ((next = ngx_strlchr(next, cl->buf->last, '\n')) && (size + (size_t)(next - part) + 1 <= gmcf->package_size)) {
+                nl = next;
+                next++;
             }
 
-            if (n != nl - part + 1) {
-                ngx_log_error(NGX_LOG_ERR, log, 0, "graphite udp send incomplete");
-                goto failed;
+            if (nl == NULL) {
+                if (size == 0) {
+                    next = ngx_strlchr(part, cl->buf->last, '\n');
+                    ngx_log_error(NGX_LOG_ERR, log, 0, "graphite package size too small, need send %z", (size_t)((next ? next + 1 : cl->buf->last) - part));
+                    part = next ? next + 1 : cl->buf->last;
+                    continue;
+                }
+
+                if (ngx_http_graphite_net_send_iovs(gmcf->connection, iovs, niovs, size, log) != NGX_OK)
+                    goto failed;
+
+                niovs = 0;
+                size = 0;
+                continue;
+            }
+
+            iovs[niovs].iov_base = (void *)part;
+            iovs[niovs].iov_len = nl - part + 1;
+            niovs++;
+            size += nl - part + 1;
+            part = nl + 1;
+
+            if (niovs == NGX_HTTP_GRAPHITE_NET_IOVS) {
+                if (ngx_http_graphite_net_send_iovs(gmcf->connection, iovs, niovs, size, log) != NGX_OK)
+                    goto failed;
+
+                niovs = 0;
+                size = 0;
             }
         }
-        else {
-            ngx_log_error(NGX_LOG_ERR, log, 0, "graphite package size too small, need send %z", (size_t)(next - part));
-        }
+    }
 
-        part = nl + 1;
+    if (size) {
+        if (ngx_http_graphite_net_send_iovs(gmcf->connection, iovs, niovs, size, log) != NGX_OK)
+            goto failed;
     }
 
     ngx_close_connection(gmcf->connection);
@@ -104,6 +134,8 @@ ngx_http_graphite_net_send_udp(ngx_http_graphite_main_conf_t *gmcf, ngx_log_t *l
 
 failed:
 
+    ngx_atomic_fetch_add(&ngx_http_graphite_net_stat(gmcf)->send_errors, 1);
+
     ngx_close_connection(gmcf->connection);
     gmcf->connection = NULL;
 
@@ -266,6 +298,38 @@ failed:
     return NGX_ERROR;
 }
 
+static ngx_int_t
+ngx_http_graphite_net_send_iovs(ngx_connection_t *c, struct iovec *iovs, ngx_uint_t niovs, size_t size, ngx_log_t *log)
+{
+    ngx_http_graphite_stat_t *stat = ngx_http_graphite_net_stat((ngx_http_graphite_main_conf_t*)(c->data));
+
+    ssize_t n = writev(c->fd, iovs, niovs);
+
+    if (n == -1) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_socket_errno, "graphite udp send error");
+        return NGX_ERROR;
+    }
+
+    if ((size_t)n != size) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "graphite udp send incomplete");
+        return NGX_ERROR;
+    }
+
+    ngx_atomic_fetch_add(&stat->sent_bytes, n);
+    ngx_atomic_fetch_add(&stat->sent_datagrams, 1);
+
+    return NGX_OK;
+}
+
+static ngx_http_graphite_stat_t *
+ngx_http_graphite_net_stat(ngx_http_graphite_main_conf_t *gmcf)
+{
+    ngx_slab_pool_t *shpool = (ngx_slab_pool_t*)gmcf->shared->shm.addr;
+    ngx_http_graphite_storage_t *storage = (ngx_http_graphite_storage_t*)shpool->data;
+
+    return &storage->stat;
+}
+
 static void
 ngx_http_graphite_tcp_read(ngx_event_t *rev)
 {
@@ -276,7 +340,7 @@ ngx_http_graphite_tcp_write(ngx_event_t *wev)
 {
     ngx_connection_t *c = wev->data;
     ngx_http_graphite_main_conf_t *gmcf = (ngx_http_graphite_main_conf_t*)(c->data);
-    ngx_buf_t *b = &gmcf->buffer;
+    ngx_http_graphite_buffer_t *buffer = &gmcf->buffer;
 
     if (wev->timedout) {
         ngx_log_error(NGX_LOG_ERR, wev->log, 0, "graphite tcp connection timeout");
@@ -285,26 +349,21 @@ ngx_http_graphite_tcp_write(ngx_event_t *wev)
 
     off_t sent = c->sent;
 
-    while (wev->ready && b->pos < b->last) {
-        ssize_t n = ngx_send(c, b->pos, b->last - b->pos);
-
-        if (n == NGX_AGAIN)
-            break;
+    if (wev->ready) {
+        ngx_chain_t *cl = ngx_send_chain(c, buffer->busy, 0);
 
-        if (n == NGX_ERROR) {
+        if (cl == NGX_CHAIN_ERROR) {
             ngx_log_error(NGX_LOG_ERR, wev->log, 0, "graphite tcp send error");
             goto failed;
         }
 
-        b->pos += n;
+        buffer->busy = cl;
     }
 
-    if (b->pos != b->start) {
-        b->last = ngx_movemem(b->start, b->pos, b->last - b->pos);
-        b->pos = b->start;
-    }
+    if (c->sent != sent)
+        ngx_atomic_fetch_add(&ngx_http_graphite_net_stat(gmcf)->sent_bytes, c->sent - sent);
 
-    if (b->last - b->pos == 0) {
+    if (buffer->busy == NULL) {
         ngx_close_connection(c);
         gmcf->connection = NULL;
         return;
@@ -319,6 +378,7 @@ ngx_http_graphite_tcp_write(ngx_event_t *wev)
     return;
 
 failed:
+    ngx_atomic_fetch_add(&ngx_http_graphite_net_stat(gmcf)->send_errors, 1);
     ngx_close_connection(c);
     gmcf->connection = NULL;
 }
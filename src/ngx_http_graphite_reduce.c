@@ -0,0 +1,65 @@
+#include <nginx.h>
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "ngx_http_graphite_reduce.h"
+
+#if (NGX_PTR_SIZE == 8)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define NGX_HTTP_GRAPHITE_REDUCE_AVX2 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define NGX_HTTP_GRAPHITE_REDUCE_SSE2 1
+#endif
+#endif
+
+void
+ngx_http_graphite_reduce_add(double *acc_values, ngx_uint_t *acc_counts, const double *values, const ngx_uint_t *counts, ngx_uint_t n) {
+
+    ngx_uint_t i = 0;
+
+#if (NGX_HTTP_GRAPHITE_REDUCE_AVX2)
+    for (; i + 4 <= n; i += 4) {
+        __m256d v = _mm256_add_pd(_mm256_loadu_pd(&acc_values[i]), _mm256_loadu_pd(&values[i]));
+        __m256i c = _mm256_add_epi64(_mm256_loadu_si256((const __m256i*)&acc_counts[i]), _mm256_loadu_si256((const __m256i*)&counts[i]));
+        _mm256_storeu_pd(&acc_values[i], v);
+        _mm256_storeu_si256((__m256i*)&acc_counts[i], c);
+    }
+#elif (NGX_HTTP_GRAPHITE_REDUCE_SSE2)
+    for (; i + 2 <= n; i += 2) {
+        __m128d v = _mm_add_pd(_mm_loadu_pd(&acc_values[i]), _mm_loadu_pd(&values[i]));
+        __m128i c = _mm_add_epi64(_mm_loadu_si128((const __m128i*)&acc_counts[i]), _mm_loadu_si128((const __m128i*)&counts[i]));
+        _mm_storeu_pd(&acc_values[i], v);
+        _mm_storeu_si128((__m128i*)&acc_counts[i], c);
+    }
+#endif
+
+    for (; i < n; i++) {
+        acc_values[i] += values[i];
+        acc_counts[i] += counts[i];
+    }
+}
+
+void
+ngx_http_graphite_reduce_add_ints(ngx_atomic_uint_t *acc_ints, const ngx_atomic_t *ints, ngx_uint_t n) {
+
+    ngx_uint_t i = 0;
+
+    /* flush sums only past seconds, whose cells are not added to anymore */
+#if (NGX_HTTP_GRAPHITE_REDUCE_AVX2)
+    for (; i + 4 <= n; i += 4) {
+        __m256i c = _mm256_add_epi64(_mm256_loadu_si256((const __m256i*)&acc_ints[i]), _mm256_loadu_si256((const __m256i*)&ints[i]));
+        _mm256_storeu_si256((__m256i*)&acc_ints[i], c);
+    }
+#elif (NGX_HTTP_GRAPHITE_REDUCE_SSE2)
+    for (; i + 2 <= n; i += 2) {
+        __m128i c = _mm_add_epi64(_mm_loadu_si128((const __m128i*)&acc_ints[i]), _mm_loadu_si128((const __m128i*)&ints[i]));
+        _mm_storeu_si128((__m128i*)&acc_ints[i], c);
+    }
+#endif
+
+    for (; i < n; i++)
+        acc_ints[i] += ints[i];
+}
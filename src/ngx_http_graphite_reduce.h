@@ -0,0 +1,15 @@
+#ifndef _NGX_HTTP_GRAPHITE_REDUCE_H_INCLUDED_
+#define _NGX_HTTP_GRAPHITE_REDUCE_H_INCLUDED_
+
+#include <nginx.h>
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+/* planes are padded to a cache line of doubles, so a row is a whole number of steps */
+#define NGX_HTTP_GRAPHITE_REDUCE_STEP (NGX_CPU_CACHE_LINE / sizeof(double))
+
+void ngx_http_graphite_reduce_add(double *acc_values, ngx_uint_t *acc_counts, const double *values, const ngx_uint_t *counts, ngx_uint_t n);
+void ngx_http_graphite_reduce_add_ints(ngx_atomic_uint_t *acc_ints, const ngx_atomic_t *ints, ngx_uint_t n);
+
+#endif
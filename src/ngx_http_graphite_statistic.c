@@ -0,0 +1,147 @@
+#include <nginx.h>
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "ngx_http_graphite_statistic.h"
+
+static int
+ngx_http_graphite_sample_compare(const void *one, const void *two) {
+
+    double a = *(const double*)one;
+    double b = *(const double*)two;
+
+    return (a < b) ? -1 : (a > b);
+}
+
+void
+ngx_http_graphite_statistic_reset(ngx_http_graphite_statistic_data_t *data) {
+
+    ngx_memzero(data->q, sizeof(data->q));
+    data->count = 0;
+
+    size_t i;
+    for (i = 0; i < data->markers; i++) {
+        data->np[i] = (data->markers - 1) * data->dn[i] + 1;
+        data->n[i] = i + 1;
+    }
+}
+
+/*
+ * The percentiles are sorted, the quantile k gets the marker 2k + 2.
+ */
+void
+ngx_http_graphite_statistic_init(ngx_http_graphite_statistic_data_t *data, const ngx_uint_t *percentiles, ngx_uint_t m) {
+
+    ngx_memzero(data, sizeof(ngx_http_graphite_statistic_data_t));
+
+    data->markers = 2 * m + 3;
+
+    double prev = 0;
+
+    size_t k;
+    for (k = 0; k < m; k++) {
+        double p = (double)percentiles[k] / 100000;
+        data->dn[2 * k + 1] = (prev + p) / 2;
+        data->dn[2 * k + 2] = p;
+        prev = p;
+    }
+
+    data->dn[2 * m + 1] = (prev + 1) / 2;
+    data->dn[2 * m + 2] = 1;
+
+    ngx_http_graphite_statistic_reset(data);
+}
+
+void
+ngx_http_graphite_add_statistic_data(ngx_http_graphite_statistic_data_t *data, double value) {
+
+    /* Algorithm R keeps a uniform sample of all values of the flush */
+    if (data->samples != NULL) {
+        if (data->count < RESERVOIR_SIZE)
+            data->samples[data->count] = value;
+        else {
+            ngx_uint_t j = (ngx_uint_t)ngx_random() % (data->count + 1);
+            if (j < RESERVOIR_SIZE)
+                data->samples[j] = value;
+        }
+        data->count++;
+        return;
+    }
+
+    size_t markers = data->markers;
+
+    if (data->count >= markers) {
+
+        size_t k;
+        for (k = 0; k < markers; k++) {
+            if (value < data->q[k])
+                break;
+        }
+        if (k == 0) {
+            k = 1;
+            data->q[0] = value;
+        }
+        else if (k == markers) {
+            k = markers - 1;
+            data->q[markers - 1] = value;
+        }
+
+        size_t i;
+        for (i = 0; i < markers; i++) {
+            if (i >= k)
+                data->n[i]++;
+            data->np[i] += data->dn[i];
+        }
+
+        for (i = 1; i < markers - 1; i++) {
+            double d = data->np[i] - data->n[i];
+            int s = (d >= 0.0) ? 1 : -1;
+            if((d >= 1.0 && data->n[i + 1] - data->n[i] > 1) || (d <= -1.0 && data->n[i - 1] - data->n[i] < -1)) {
+                double a = data->q[i] + (double)s * ((data->n[i] - data->n[i - 1] + s) * (data->q[i + 1] - data->q[i]) / (data->n[i + 1] - data->n[i]) + (data->n[i + 1] - data->n[i] - s) * (data->q[i] - data->q[i - 1]) / (data->n[i] - data->n[i - 1])) / (data->n[i + 1] - data->n[i - 1]);
+                if (a <= data->q[i - 1] || data->q[i + 1] <= a)
+                    a = data->q[i] + (double)s * (data->q[i + s] - data->q[i]) / (data->n[i + s] - data->n[i]);
+                data->q[i] = a;
+                data->n[i] += s;
+            }
+        }
+    }
+    else {
+        size_t i = 0;
+        for (i = 0; i < data->count; i++) {
+            if (value < data->q[i])
+                break;
+        }
+        if (data->count != 0 && i < markers - 1)
+            memmove(&data->q[i + 1], &data->q[i], (data->count - i) * sizeof(*data->q));
+        data->q[i] = value;
+        data->count++;
+    }
+}
+
+void
+ngx_http_graphite_statistic_sort(ngx_http_graphite_statistic_data_t *data) {
+
+    if (data->samples != NULL)
+        ngx_qsort(data->samples, ngx_min(data->count, RESERVOIR_SIZE), sizeof(double), ngx_http_graphite_sample_compare);
+}
+
+/*
+ * The reservoir must be sorted. Until the markers are filled the sorted
+ * values give the percentile.
+ */
+double
+ngx_http_graphite_statistic_value(const ngx_http_graphite_statistic_data_t *data, ngx_uint_t marker, ngx_uint_t percentile) {
+
+    if (data->samples != NULL) {
+        ngx_uint_t n = ngx_min(data->count, RESERVOIR_SIZE);
+        return (n != 0) ? data->samples[(n - 1) * percentile / 100000] : 0;
+    }
+
+    if (data->count >= data->markers)
+        return data->q[marker];
+    if (data->count != 0)
+        return data->q[(data->count - 1) * percentile / 100000];
+
+    return 0;
+}
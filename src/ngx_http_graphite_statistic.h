@@ -0,0 +1,37 @@
+#ifndef _NGX_HTTP_GRAPHITE_STATISTIC_H_INCLUDED_
+#define _NGX_HTTP_GRAPHITE_STATISTIC_H_INCLUDED_
+
+#include <nginx.h>
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+/*
+ * Extended P2 keeps 2m + 3 markers for m quantiles: the minimum, the
+ * quantiles, the middles between them and the maximum. One estimator
+ * serves all percentiles of a param in a split. With percentile_mode
+ * reservoir the values are sampled into samples instead, and count is
+ * the number of values seen.
+ */
+#define P2_MAX_QUANTILES 8
+#define P2_MAX_MARKERS (2 * P2_MAX_QUANTILES + 3)
+
+#define RESERVOIR_SIZE 1024
+
+typedef struct ngx_http_graphite_statistic_data_s {
+    double q[P2_MAX_MARKERS];
+    double dn[P2_MAX_MARKERS];
+    double np[P2_MAX_MARKERS];
+    ngx_int_t n[P2_MAX_MARKERS];
+    ngx_uint_t markers;
+    ngx_uint_t count;
+    double *samples;
+} ngx_http_graphite_statistic_data_t;
+
+void ngx_http_graphite_statistic_init(ngx_http_graphite_statistic_data_t *data, const ngx_uint_t *percentiles, ngx_uint_t m);
+void ngx_http_graphite_statistic_reset(ngx_http_graphite_statistic_data_t *data);
+void ngx_http_graphite_add_statistic_data(ngx_http_graphite_statistic_data_t *data, double value);
+void ngx_http_graphite_statistic_sort(ngx_http_graphite_statistic_data_t *data);
+double ngx_http_graphite_statistic_value(const ngx_http_graphite_statistic_data_t *data, ngx_uint_t marker, ngx_uint_t percentile);
+
+#endif